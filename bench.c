@@ -0,0 +1,965 @@
+/*
+ * Headless end-to-end benchmark harness.
+ *
+ * Measures enthrall's own overhead, independent of X11/OS X and ssh: the
+ * harness plays the master, generating synthetic input and sending it via a
+ * msgchan the same way main.c's send_*() functions do, to a real remote
+ * (remote.c, run in a re-exec'd child of this program) connected directly
+ * over a socketpair, whose platform is a fake one that just notes when each
+ * event gets "injected".  For each scenario it reports input-to-injection
+ * latency percentiles, throughput, allocations and CPU time per event.
+ *
+ * Built (on Linux) with 'make bench' as enthrall-bench.  Usage:
+ *
+ *   ./enthrall-bench [-s SCALE] [-b]
+ *   ./enthrall-bench -t TRACE [-n REMOTE] [-x SPEED] [-b]
+ *
+ * where SCALE multiplies the number of events in each scenario (default 1)
+ * and -b enables event batching (as with the event-batching config option).
+ * The second form instead replays the messages sent to the given remote (by
+ * default the first one listed) in a trace recorded via the trace-file
+ * config option, at SPEED times their original rate (default 1).  Motion
+ * merging is disabled when replaying, so that every recorded event arrives
+ * as such and can be timed.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "misc.h"
+#include "msgchan.h"
+#include "platform.h"
+#include "kvmap.h"
+#include "stats.h"
+#include "trace.h"
+
+/* File descriptor on which the remote child writes its report */
+#define REPORT_FD 3
+
+/* SETUP parameter telling the fake platform how many events to expect */
+#define UNITS_PARAM "bench-units"
+
+/*
+ * A point at which some number of events (cumulatively, counting clipboard
+ * contents separately from input events since they take a separate lane and
+ * can overtake or be overtaken by them) had been injected.
+ */
+struct injection {
+	uint64_t when;
+	uint64_t units;
+	int bulk;
+};
+
+/* What the remote child reports once it's injected everything */
+struct report {
+	uint64_t num_injections;
+	uint64_t allocs;
+	uint64_t cpu_us;
+};
+
+static unsigned int loglevel = LL_WARN;
+
+void set_loglevel(unsigned int level)
+{
+	loglevel = level;
+}
+
+__printf(2, 3) void mlog(unsigned int level, const char* fmt, ...)
+{
+	va_list va;
+
+	if (level > loglevel)
+		return;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+}
+
+/*
+ * Allocation counting
+ * ===================
+ *
+ * The bench binary is linked with --wrap for malloc(), calloc() and
+ * realloc(), so calls to them made from enthrall's code (but not from within
+ * libc or other libraries) come through here and get counted.
+ */
+
+static uint64_t num_allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+	num_allocs += 1;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+	num_allocs += 1;
+	return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+	num_allocs += 1;
+	return __real_realloc(ptr, size);
+}
+
+/* User plus system CPU time consumed so far by this process. */
+static uint64_t cpu_time_us(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru)) {
+		perror("getrusage");
+		abort();
+	}
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Read or write exactly len bytes (blocking), returning non-zero on failure. */
+static int full_io(int fd, void* buf, size_t len, int writing)
+{
+	ssize_t status;
+	size_t done;
+
+	for (done = 0; done < len; done += status) {
+		if (writing)
+			status = write(fd, (char*)buf + done, len - done);
+		else
+			status = read(fd, (char*)buf + done, len - done);
+
+		if (status < 0 && errno == EINTR)
+			status = 0;
+		else if (status <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Fake platform
+ * =============
+ *
+ * Used by the remote child: a screen whose pointer position is just a pair
+ * of numbers, and input injection that records (in memory, until the
+ * expected number of events have arrived) when each event was applied.
+ * Mouse motion arrives as one unit per pixel, scrolling as one per notch,
+ * and keystrokes and clipboard contents as one apiece, so the number of
+ * events covered by each injection is known even once messages have been
+ * merged along the way.  (bench_units() below needs to agree.)
+ */
+
+#define SCREEN_SIZE (1 << 24)
+
+struct xypoint screen_center = { .x = SCREEN_SIZE / 2, .y = SCREEN_SIZE / 2, };
+
+static struct xypoint fake_mousepos;
+
+static struct {
+	uint64_t expected;
+	uint64_t done[2];
+	struct injection* log;
+	uint64_t num;
+	uint64_t allocs_start;
+	uint64_t cpu_start;
+} injections;
+
+/* Send the harness our report, and we're done. */
+static void finish_remote(void)
+{
+	struct report rep = {
+		.num_injections = injections.num,
+		.allocs = num_allocs - injections.allocs_start,
+		.cpu_us = cpu_time_us() - injections.cpu_start,
+	};
+
+	if (full_io(REPORT_FD, &rep, sizeof(rep), 1)
+	    || full_io(REPORT_FD, injections.log, injections.num * sizeof(*injections.log), 1)) {
+		perror("write");
+		exit(1);
+	}
+
+	exit(0);
+}
+
+static void injected(uint64_t units, int bulk)
+{
+	struct injection* inj;
+
+	if (!units)
+		return;
+
+	assert(injections.num < injections.expected);
+
+	injections.done[bulk] += units;
+	inj = &injections.log[injections.num++];
+	inj->when = get_microtime();
+	inj->units = injections.done[bulk];
+	inj->bulk = bulk;
+
+	if (injections.done[0] + injections.done[1] >= injections.expected)
+		finish_remote();
+}
+
+int platform_init(struct kvmap* params, mousepos_handler_t* edge_handler)
+{
+	const char* units = kvmap_get(params, UNITS_PARAM);
+
+	if (!units) {
+		errlog("no " UNITS_PARAM " parameter in SETUP\n");
+		return -1;
+	}
+
+	injections.expected = strtoull(units, NULL, 10);
+	injections.log = xmalloc(injections.expected * sizeof(*injections.log));
+
+	fake_mousepos = screen_center;
+
+	injections.allocs_start = num_allocs;
+	injections.cpu_start = cpu_time_us();
+
+	return 0;
+}
+
+void platform_exit(void)
+{
+	xfree(injections.log);
+}
+
+void get_screen_dimensions(struct rectangle* d)
+{
+	d->x.min = d->y.min = 0;
+	d->x.max = d->y.max = SCREEN_SIZE - 1;
+}
+
+struct xypoint get_mousepos(void)
+{
+	return fake_mousepos;
+}
+
+void set_mousepos(struct xypoint pos)
+{
+	fake_mousepos = pos;
+}
+
+void move_mousepos(int32_t dx, int32_t dy)
+{
+	fake_mousepos.x += dx;
+	fake_mousepos.y += dy;
+	injected(abs(dx) + abs(dy), 0);
+}
+
+void do_clickevent(mousebutton_t button, pressrel_t pr)
+{
+	injected(1, 0);
+}
+
+void do_keyevent(keycode_t key, pressrel_t pr)
+{
+	injected(1, 0);
+}
+
+void do_scroll(int32_t amount)
+{
+	injected(abs(amount) / SCROLL_NOTCH, 0);
+}
+
+void get_clipboard_text_async(clipboard_text_cb_t cb, void* arg)
+{
+	cb(xstrdup(""), arg);
+}
+
+int set_clipboard_text_owned(char* text)
+{
+	xfree(text);
+	injected(1, 1);
+	return 0;
+}
+
+int set_clipboard_text(const char* text)
+{
+	return set_clipboard_text_owned(xstrdup(text));
+}
+
+void hold_clipboard(void)
+{
+}
+
+void release_clipboard(void)
+{
+}
+
+int watch_clipboard_ownership(clipboard_lost_handler_t* cb)
+{
+	return 0;
+}
+
+void set_display_brightness(float f)
+{
+}
+
+/*
+ * Harness (master side)
+ * =====================
+ */
+
+struct scenario {
+	const char* name;
+
+	/* Number of events (before scaling), and how they're paced */
+	unsigned int count;
+	unsigned int burst;
+	uint64_t interval;
+
+	/* Send the i'th event of the scenario */
+	void (*gen)(unsigned int i);
+};
+
+/* Contents sent in the large-clipboard scenario */
+#define CLIP_SIZE (1024 * 1024)
+static char* clip_text;
+
+/*
+ * How many events the fake platform will count the given message as, and
+ * whether it's clipboard contents rather than input.
+ */
+static uint64_t bench_units(const struct message* msg, int* bulk)
+{
+	*bulk = 0;
+
+	switch (msg->body.type) {
+	case MT_MOVEREL:
+		return abs(MB(msg, moverel).dx) + abs(MB(msg, moverel).dy);
+	case MT_SCROLL:
+		return abs(MB(msg, scroll).amount) / SCROLL_NOTCH;
+	case MT_CLICKEVENT:
+	case MT_KEYEVENT:
+		return 1;
+	case MT_SETCLIPBOARD:
+		*bulk = 1;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void send_event(struct message* msg);
+
+static void gen_motion(unsigned int i)
+{
+	struct message* msg = new_message(MT_MOVEREL);
+
+	/* Always the same way, so merged motion still adds up to one per event */
+	MB(msg, moverel).dx = 1;
+	MB(msg, moverel).dy = 0;
+
+	send_event(msg);
+}
+
+static void gen_typing(unsigned int i)
+{
+	struct message* msg = new_message(MT_KEYEVENT);
+
+	MB(msg, keyevent).keycode = (i / 2) % 64;
+	MB(msg, keyevent).pressrel = i % 2 ? PR_RELEASE : PR_PRESS;
+
+	send_event(msg);
+}
+
+static void gen_scroll(unsigned int i)
+{
+	struct message* msg = new_message(MT_SCROLL);
+
+	MB(msg, scroll).amount = (i / 16) % 2 ? -SCROLL_NOTCH : SCROLL_NOTCH;
+
+	send_event(msg);
+}
+
+static void gen_clipboard(unsigned int i)
+{
+	struct message* msg = new_message(MT_SETCLIPBOARD);
+
+	MB(msg, setclipboard).text = xstrdup(clip_text);
+
+	send_event(msg);
+}
+
+static const struct scenario scenarios[] = {
+	{ "motion", 8000, 4, 1000, gen_motion, },
+	{ "typing", 2000, 2, 1000, gen_typing, },
+	{ "scroll", 1000, 1, 1000, gen_scroll, },
+	{ "clipboard", 20, 1, 50 * 1000, gen_clipboard, },
+};
+
+/*
+ * A message from a trace, due to be sent 'when' microseconds in (or if msg is
+ * NULL, a clipboard update of cliplen bytes, only built when it's sent).
+ */
+struct replay_event {
+	uint64_t when;
+	struct message* msg;
+	uint32_t cliplen;
+};
+
+static void gen_replay(unsigned int i);
+
+static const struct scenario replay_scenario = { "replay", 0, 0, 0, gen_replay, };
+
+/* The trace being replayed (if any) */
+static struct {
+	struct replay_event* events;
+	unsigned int num;
+	uint64_t units;
+	double speed;
+} replay = { .speed = 1.0, };
+
+/* How many of a replay's messages may be sent without returning to the event loop */
+#define REPLAY_BURST 16
+
+static const struct scenario* scenario_list = scenarios;
+static size_t num_scenarios = ARR_LEN(scenarios);
+
+static unsigned int scale = 1;
+static int batch_events;
+
+/* State of the scenario currently being run */
+static struct {
+	const struct scenario* sc;
+
+	/* Number of events (as counted by the fake platform) it involves */
+	uint64_t count;
+
+	/* Next event (or replayed message) to send, and how many there are */
+	unsigned int next, num_events;
+
+	pid_t pid;
+	struct msgchan mc;
+	int connected;
+	struct mcstats stats;
+	int reportfd;
+	struct fdmon_ctx* reportmon;
+
+	/* When each input [0] and clipboard [1] event was sent, and how many have been */
+	uint64_t* sent_at[2];
+	uint64_t num_sent[2];
+
+	uint64_t start, allocs_start, cpu_start;
+
+	/* Allocations made by the harness itself (not counted against enthrall) */
+	uint64_t harness_allocs;
+} run;
+
+static void start_scenario(const struct scenario* sc);
+
+static int cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t* sorted, unsigned int n, unsigned int pct)
+{
+	unsigned int idx = ((uint64_t)n * pct + 99) / 100;
+	return sorted[idx ? idx - 1 : 0];
+}
+
+static void print_results(const struct report* rep, const struct injection* log,
+                          uint64_t allocs, uint64_t cpu_us)
+{
+	uint64_t* lat = xmalloc(run.count * sizeof(*lat));
+	uint64_t i, n = 0, u[2] = { 0, 0, }, wall, msgs = 0, bytes = 0;
+	double secs, per_event = 1.0 / run.count;
+	const uint64_t* sent_at;
+	msgtype_t type;
+	int b;
+
+	for (i = 0; i < rep->num_injections; i++) {
+		b = log[i].bulk;
+		sent_at = run.sent_at[b];
+		for (; u[b] < log[i].units && u[b] < run.num_sent[b]; u[b]++, n++)
+			lat[n] = log[i].when > sent_at[u[b]] ? log[i].when - sent_at[u[b]] : 0;
+	}
+	assert(n == run.count);
+	qsort(lat, run.count, sizeof(*lat), cmp_u64);
+
+	for (type = 0; type < NUM_MSGTYPES; type++) {
+		if (type == MT_SETUP)
+			continue;
+		msgs += run.stats.sent[type].msgs;
+		bytes += run.stats.sent[type].bytes;
+	}
+
+	wall = log[rep->num_injections - 1].when - run.start;
+	secs = (wall ? wall : 1) / 1e6;
+
+	printf("%s: %"PRIu64" events in %.3fs (%.0f events/s, %.0f msgs/s, %.2f MB/s)\n",
+	       run.sc->name, run.count, secs, run.count / secs, msgs / secs,
+	       bytes / secs / (1024 * 1024));
+	printf("  latency: p50=%"PRIu64"us p90=%"PRIu64"us p99=%"PRIu64"us "
+	       "max=%"PRIu64"us\n", percentile(lat, run.count, 50),
+	       percentile(lat, run.count, 90), percentile(lat, run.count, 99),
+	       lat[run.count - 1]);
+	printf("  allocs/event: master %.2f, remote %.2f\n", allocs * per_event,
+	       rep->allocs * per_event);
+	printf("  cpu/event: master %.2fus, remote %.2fus\n", cpu_us * per_event,
+	       rep->cpu_us * per_event);
+	fflush(stdout);
+
+	xfree(lat);
+}
+
+/* fdmon callback for the remote child's report arriving. */
+static void report_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	uint64_t allocs = num_allocs - run.allocs_start - run.harness_allocs;
+	uint64_t cpu_us = cpu_time_us() - run.cpu_start;
+	struct injection* log;
+	struct report rep;
+	int status;
+
+	if (full_io(run.reportfd, &rep, sizeof(rep), 0)) {
+		fprintf(stderr, "%s: failed to read remote's report\n", run.sc->name);
+		exit(1);
+	}
+
+	log = xmalloc(rep.num_injections * sizeof(*log));
+	if (!rep.num_injections
+	    || full_io(run.reportfd, log, rep.num_injections * sizeof(*log), 0)) {
+		fprintf(stderr, "%s: truncated report from remote\n", run.sc->name);
+		exit(1);
+	}
+
+	fdmon_unregister(run.reportmon);
+	close(run.reportfd);
+	if (run.connected)
+		mc_close(&run.mc);
+	run.connected = 0;
+
+	if (waitpid(run.pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		fprintf(stderr, "%s: remote exited abnormally\n", run.sc->name);
+
+	print_results(&rep, log, allocs, cpu_us);
+
+	xfree(log);
+	xfree(run.sent_at[0]);
+	xfree(run.sent_at[1]);
+
+	if (run.sc + 1 < scenario_list + num_scenarios)
+		start_scenario(run.sc + 1);
+	else
+		exit(0);
+}
+
+/* Send an event to the remote as main.c would, noting when it was sent. */
+static void send_event(struct message* msg)
+{
+	int bulk;
+	uint64_t i, units = bench_units(msg, &bulk), now = get_microtime();
+
+	for (i = 0; i < units; i++)
+		run.sent_at[bulk][run.num_sent[bulk]++] = now;
+
+	if (mc_enqueue_message(&run.mc, msg)) {
+		fprintf(stderr, "%s: send backlog exceeded\n", run.sc->name);
+		exit(1);
+	}
+}
+
+/* Schedule the next tick, not counting the timer against enthrall. */
+static void schedule_tick(void (*fn)(void* arg), uint64_t delay)
+{
+	uint64_t allocs = num_allocs;
+
+	schedule_call(fn, NULL, delay);
+	run.harness_allocs += num_allocs - allocs;
+}
+
+static void tick_cb(void* arg)
+{
+	unsigned int i;
+
+	for (i = 0; i < run.sc->burst && run.next < run.num_events; i++)
+		run.sc->gen(run.next++);
+
+	if (run.next < run.num_events)
+		schedule_tick(tick_cb, run.sc->interval);
+}
+
+/* How far into the replay the i'th message is due to be sent. */
+static uint64_t replay_due(unsigned int i)
+{
+	return (replay.events[i].when - replay.events[0].when) / replay.speed;
+}
+
+/* Build a clipboard update of the given length to stand in for a recorded one. */
+static struct message* replay_clipboard(uint32_t len)
+{
+	struct message* msg = new_message(MT_SETCLIPBOARD);
+	char* text = xmalloc(len + 1);
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		text[i] = clip_text[i % CLIP_SIZE];
+	text[len] = '\0';
+	MB(msg, setclipboard).text = text;
+
+	return msg;
+}
+
+static void gen_replay(unsigned int i)
+{
+	struct replay_event* ev = &replay.events[i];
+
+	send_event(ev->msg ? ev->msg : replay_clipboard(ev->cliplen));
+	ev->msg = NULL;
+}
+
+/*
+ * Send whatever's due of the trace being replayed, a limited number at a
+ * time so the msgchan gets a chance to drain if it's running behind.
+ */
+static void replay_tick_cb(void* arg)
+{
+	uint64_t now = get_microtime() - run.start, due = now;
+	unsigned int i;
+
+	for (i = 0; i < REPLAY_BURST && run.next < run.num_events; i++) {
+		due = replay_due(run.next);
+		if (due > now)
+			break;
+		run.sc->gen(run.next++);
+	}
+
+	if (run.next < run.num_events)
+		schedule_tick(replay_tick_cb, due > now ? due - now : 0);
+}
+
+static void handle_ready(const struct message* msg)
+{
+	struct kvmap* params = unflatten_kvmap(MB(msg, ready).params.params_val,
+	                                       MB(msg, ready).params.params_len);
+	const char* compression = params ? kvmap_get(params, "clipboard-compression") : NULL;
+
+	if (compression && !strcmp(compression, "zlib"))
+		run.mc.compress_clipboard = 1;
+	if (params)
+		destroy_kvmap(params);
+
+	run.start = get_microtime();
+	run.allocs_start = num_allocs;
+	run.cpu_start = cpu_time_us();
+	run.harness_allocs = 0;
+
+	schedule_tick(run.sc == &replay_scenario ? replay_tick_cb : tick_cb, 0);
+}
+
+static void recv_cb(struct msgchan* mc, struct message* msg, void* arg)
+{
+	switch (msg->body.type) {
+	case MT_READY:
+		handle_ready(msg);
+		break;
+
+	case MT_LOGMSG:
+		fprintf(stderr, "remote: %s", MB(msg, logmsg).msg);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void err_cb(struct msgchan* mc, void* arg)
+{
+	if (run.next < run.num_events) {
+		fprintf(stderr, "%s: connection to remote failed\n", run.sc->name);
+		exit(1);
+	}
+
+	/*
+	 * The remote exits once it's seen everything, possibly before we get
+	 * to its report; whether one arrives tells us if that's what this is.
+	 */
+	mc_close(&run.mc);
+	run.connected = 0;
+}
+
+static void send_setup(void)
+{
+	struct message* msg = new_message(MT_SETUP);
+	struct kvmap* params = new_kvmap();
+	char units[32];
+
+	snprintf(units, sizeof(units), "%"PRIu64, run.count);
+	kvmap_put(params, UNITS_PARAM, units);
+	kvmap_put(params, "edge-mask", "15");
+#ifdef HAVE_ZLIB
+	kvmap_put(params, "clipboard-compression", "zlib");
+#endif
+
+	MB(msg, setup).prot_vers = PROT_VERSION;
+	MB(msg, setup).loglevel = loglevel;
+	MB(msg, setup).params.params_val = flatten_kvmap(params,
+	                                                 &MB(msg, setup).params.params_len);
+	destroy_kvmap(params);
+
+	mc_enqueue_message(&run.mc, msg);
+}
+
+/* Start a remote child connected via a socketpair, as ssh would. */
+static void spawn_remote(int* sockfd)
+{
+	int sv[2], rp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) || pipe(rp)) {
+		perror("socketpair/pipe");
+		exit(1);
+	}
+
+	run.pid = fork();
+	if (run.pid < 0) {
+		perror("fork");
+		exit(1);
+	} else if (!run.pid) {
+		if (dup2(sv[1], STDIN_FILENO) < 0 || dup2(sv[1], STDOUT_FILENO) < 0
+		    || dup2(rp[1], REPORT_FD) < 0) {
+			perror("dup2");
+			_exit(1);
+		}
+		execl("/proc/self/exe", "enthrall-bench", "-R", (char*)NULL);
+		perror("execl");
+		_exit(1);
+	}
+
+	close(sv[1]);
+	close(rp[1]);
+	set_fd_cloexec(sv[0], 1);
+	set_fd_cloexec(rp[0], 1);
+
+	*sockfd = sv[0];
+	run.reportfd = rp[0];
+}
+
+static void start_scenario(const struct scenario* sc)
+{
+	int fd;
+
+	run.sc = sc;
+	if (sc == &replay_scenario) {
+		run.num_events = replay.num;
+		run.count = replay.units;
+	} else {
+		/* (Each one counting as a single event) */
+		run.num_events = sc->count * scale;
+		run.count = run.num_events;
+	}
+	run.next = 0;
+	run.sent_at[0] = xmalloc(run.count * sizeof(*run.sent_at[0]));
+	run.sent_at[1] = xmalloc(run.count * sizeof(*run.sent_at[1]));
+	run.num_sent[0] = run.num_sent[1] = 0;
+	memset(&run.stats, 0, sizeof(run.stats));
+
+	spawn_remote(&fd);
+
+	mc_init(&run.mc, fd, fd, recv_cb, err_cb, NULL);
+	run.connected = 1;
+	run.mc.stats = &run.stats;
+	run.mc.coalesce_motion = sc != &replay_scenario;
+	run.mc.batch_events = batch_events;
+
+	run.reportmon = fdmon_register_fd(run.reportfd, report_cb, NULL, NULL);
+	fdmon_monitor(run.reportmon, FM_READ);
+
+	send_setup();
+}
+
+/* Can the fake platform take a message of the given type? */
+static int replayable(msgtype_t type)
+{
+	switch (type) {
+	case MT_MOVEREL:
+	case MT_MOVEABS:
+	case MT_CLICKEVENT:
+	case MT_KEYEVENT:
+	case MT_SCROLL:
+	case MT_GETCLIPBOARD:
+	case MT_CHECKCLIPBOARD:
+	case MT_SETBRIGHTNESS:
+	case MT_PING:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Load the messages sent to the named remote (or the first, if NULL) from
+ * the given trace file for replaying.
+ */
+static void load_replay(const char* path, const char* name)
+{
+	struct trace tr;
+	struct trace_record rec;
+	struct message* msg;
+	unsigned int rmtidx, skipped = 0, last = 0;
+	uint64_t units;
+	int status, bulk;
+	size_t alloc = 0;
+
+	if (load_trace(path, &tr))
+		exit(1);
+
+	for (rmtidx = 0; rmtidx < tr.num_remotes; rmtidx++) {
+		if (!name || !strcmp(tr.remotes[rmtidx], name))
+			break;
+	}
+	if (rmtidx == tr.num_remotes) {
+		if (name)
+			fprintf(stderr, "%s: no remote %s in trace\n", path, name);
+		else
+			fprintf(stderr, "%s: no remotes in trace\n", path);
+		exit(1);
+	}
+
+	while ((status = next_trace_record(&tr, &rec)) > 0) {
+		if (rec.remote != rmtidx)
+			continue;
+
+		if (rec.kind == TR_CLIPBOARD) {
+			msg = NULL;
+			units = 1;
+		} else {
+			/* (Its type gets filled in by decoding it.) */
+			msg = new_message(MT_SETUP);
+			if (decode_message(rec.data, rec.len, msg)) {
+				fprintf(stderr, "%s: undecodable message in trace\n", path);
+				exit(1);
+			}
+			if (!replayable(msg->body.type)) {
+				free_message(msg);
+				skipped += 1;
+				continue;
+			}
+			units = bench_units(msg, &bulk);
+		}
+
+		if (replay.num == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			replay.events = xrealloc(replay.events, alloc * sizeof(*replay.events));
+		}
+		replay.events[replay.num].when = rec.when;
+		replay.events[replay.num].msg = msg;
+		replay.events[replay.num].cliplen = rec.len;
+		replay.num += 1;
+
+		replay.units += units;
+		if (units)
+			last = replay.num;
+	}
+
+	if (status < 0)
+		fprintf(stderr, "%s: trace truncated or corrupt, replaying what's there\n", path);
+
+	/* Anything after the last event the fake platform counts can't be timed */
+	while (replay.num > last) {
+		msg = replay.events[--replay.num].msg;
+		if (msg)
+			free_message(msg);
+	}
+
+	if (!replay.units) {
+		fprintf(stderr, "%s: no input events for remote %s in trace\n", path,
+		        tr.remotes[rmtidx]);
+		exit(1);
+	}
+
+	printf("replaying %u messages to %s from %s (%u skipped)\n", replay.num,
+	       tr.remotes[rmtidx], path, skipped);
+
+	free_trace(&tr);
+
+	scenario_list = &replay_scenario;
+	num_scenarios = 1;
+}
+
+static void usage(const char* progname)
+{
+	fprintf(stderr, "Usage: %s [-s SCALE] [-b]\n"
+	        "       %s -t TRACE [-n REMOTE] [-x SPEED] [-b]\n", progname, progname);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	int opt, remote = 0;
+	const char* tracefile = NULL;
+	const char* tracermt = NULL;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "s:bt:n:x:R")) != -1) {
+		switch (opt) {
+		case 's':
+			scale = atoi(optarg);
+			if (scale < 1)
+				usage(argv[0]);
+			break;
+		case 'b':
+			batch_events = 1;
+			break;
+		case 't':
+			tracefile = optarg;
+			break;
+		case 'n':
+			tracermt = optarg;
+			break;
+		case 'x':
+			replay.speed = atof(optarg);
+			if (!(replay.speed > 0))
+				usage(argv[0]);
+			break;
+		case 'R':
+			remote = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || (tracermt && !tracefile))
+		usage(argv[0]);
+
+	if (remote) {
+		/* Runs until finish_remote() exits */
+		run_remote();
+		return 1;
+	}
+
+	/* Enough variety to give compression something to do */
+	clip_text = xmalloc(CLIP_SIZE + 1);
+	for (i = 0; i < CLIP_SIZE; i++)
+		clip_text[i] = "abcdefghijklmnopqrstuvwxyz \n"[(i * 2654435761U >> 7) % 28];
+	clip_text[CLIP_SIZE] = '\0';
+
+	if (tracefile)
+		load_replay(tracefile, tracermt);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	start_scenario(&scenario_list[0]);
+	run_event_loop();
+
+	return 0;
+}
@@ -65,6 +65,7 @@ static struct remote* new_uninit_remote(void)
 	rmt->params = new_kvmap();
 	rmt->node.remote = rmt;
 	rmt->scrollmult = 1;
+	rmt->broadcast = 1;
 
 	return rmt;
 }
@@ -89,6 +90,12 @@ static struct remote* new_uninit_remote(void)
 %token KW_NONE KW_MOUSESWITCH KW_MULTITAP KW_SHOWNULLSWITCH KW_HOTKEYONLY KW_QUIT
 %token KW_PREVIOUS KW_RECONMAXINT KW_RECONMAXTRIES KW_CLEARCLIPBOARD
 %token KW_USEPRIVATEAGENT KW_SCROLLMULT KW_HALT_RECONNECTS
+%token KW_COALESCEMOTION KW_EVENTBATCHING KW_EVENTBATCHWINDOW
+%token KW_REMOTEEDGEDETECT KW_CLIPBOARDHASHING KW_CLIPBOARDCOMPRESSION
+%token KW_SSHMULTIPLEX KW_SSHMULTIPLEXPERSIST KW_DIRECTTRANSPORT KW_UDPMOTION
+%token KW_STATS KW_HEARTBEATINTERVAL KW_HEARTBEATMAXMISSED KW_REMOTEPERSIST
+%token KW_TRACEFILE
+%token KW_BROADCASTINPUT KW_BROADCAST
 
 %token KW_USER KW_HOSTNAME KW_PORT KW_REMOTECMD
 
@@ -304,6 +311,61 @@ master_opt: remoteshell_setting {
 | KW_USEPRIVATEAGENT EQ yesno_bool {
 	st->cfg->use_private_ssh_agent = $3;
 }
+| KW_SSHMULTIPLEX EQ yesno_bool {
+	st->cfg->ssh_multiplex.enabled = $3;
+}
+| KW_SSHMULTIPLEXPERSIST EQ realnum {
+	if ($3 < 1)
+		fail_parse(st, "ssh-multiplex-persist must be >= 1");
+	st->cfg->ssh_multiplex.persist = (uint64_t)($3 * 1000000);
+}
+| KW_COALESCEMOTION EQ yesno_bool {
+	st->cfg->coalesce_motion = $3;
+}
+| KW_REMOTEEDGEDETECT EQ yesno_bool {
+	st->cfg->remote_edge_detection = $3;
+}
+| KW_CLIPBOARDHASHING EQ yesno_bool {
+	st->cfg->clipboard_hashing = $3;
+}
+| KW_CLIPBOARDCOMPRESSION EQ yesno_bool {
+	st->cfg->clipboard_compression = $3;
+}
+| KW_DIRECTTRANSPORT EQ yesno_bool {
+	st->cfg->direct_transport = $3;
+}
+| KW_UDPMOTION EQ yesno_bool {
+	st->cfg->udp_motion = $3;
+}
+| KW_EVENTBATCHING EQ yesno_bool {
+	st->cfg->event_batching = $3;
+}
+| KW_EVENTBATCHWINDOW EQ realnum {
+	st->cfg->event_batch_window = (uint64_t)($3 * 1000000);
+}
+| KW_STATS EQ yesno_bool {
+	st->cfg->stats = $3;
+}
+| KW_HEARTBEATINTERVAL EQ realnum {
+	if ($3 < 0)
+		fail_parse(st, "heartbeat-interval must be >= 0");
+	st->cfg->heartbeat.interval = (uint64_t)($3 * 1000000);
+}
+| KW_REMOTEPERSIST EQ realnum {
+	if ($3 < 0)
+		fail_parse(st, "remote-persist must be >= 0");
+	st->cfg->remote_persist = (uint64_t)($3 * 1000000);
+}
+| KW_TRACEFILE EQ STRING {
+	st->cfg->trace_file = expand_word($3);
+	if (!st->cfg->trace_file)
+		fail_parse(st, "bad syntax in trace-file");
+}
+| KW_HEARTBEATMAXMISSED EQ INTEGER {
+	if ($3 < 1)
+		fail_parse(st, "heartbeat-max-missed must be >= 1");
+	st->cfg->heartbeat.max_missed = $3;
+}
 | KW_LOGFILE EQ logfile {
 	st->cfg->log.file = $3;
 }
@@ -345,6 +407,9 @@ action: KW_FOCUS focus_target {
 }
 | KW_QUIT {
 	$$.type = AT_QUIT;
+}
+| KW_BROADCASTINPUT {
+	$$.type = AT_BROADCAST_INPUT;
 };
 
 topology_block: KW_TOPOLOGY LBRACE links RBRACE {
@@ -427,6 +492,9 @@ remote_opt: KW_HOSTNAME EQ STRING {
 | scrollmult_setting {
 	st->nextrmt->scrollmult = $1;
 }
+| KW_BROADCAST EQ yesno_bool {
+	st->nextrmt->broadcast = $3;
+}
 | KW_PARAM LBRACKET STRING RBRACKET EQ STRING {
 	kvmap_put(st->nextrmt->params, $3, $6);
 	xfree($3);
@@ -0,0 +1,546 @@
+/*
+ * Generic POSIX event loop.
+ *
+ * File descriptor readiness is polled via epoll(7) on Linux, kqueue(2) on the
+ * BSDs, and plain old select(2) elsewhere.  Changes to the set of monitored
+ * file descriptors are batched up and handed to the kernel just before the
+ * loop next blocks, so toggling FM_WRITE on and off within a single
+ * iteration (as msgchans routinely do) costs nothing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#define EVLOOP_EPOLL
+#include <sys/epoll.h>
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) \
+	|| defined(__DragonFly__)
+#define EVLOOP_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#else
+#define EVLOOP_SELECT
+#include <sys/select.h>
+#endif
+
+#include "misc.h"
+#include "evloop.h"
+#include "timerheap.h"
+#include "stats.h"
+
+#if defined(CLOCK_MONOTONIC_RAW)
+#define CGT_CLOCK CLOCK_MONOTONIC_RAW
+#elif defined(CLOCK_UPTIME_PRECISE)
+#define CGT_CLOCK CLOCK_UPTIME_PRECISE
+#else
+#error no CGT_CLOCK!
+#endif
+
+uint64_t get_microtime(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CGT_CLOCK, &ts)) {
+		perror("clock_gettime");
+		abort();
+	}
+	return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static struct timerheap timers;
+
+timer_ctx_t schedule_call(void (*fn)(void* arg), void* arg, uint64_t delay)
+{
+	return timerheap_insert(&timers, fn, arg, get_microtime() + delay);
+}
+
+int cancel_call(timer_ctx_t timer)
+{
+	return timerheap_cancel(&timers, timer);
+}
+
+/*
+ * Microseconds until the next scheduled call is due (zero if it's overdue),
+ * or -1 if there isn't one.
+ */
+static int64_t get_poll_timeout(uint64_t now_us)
+{
+	uint64_t next;
+
+	if (!timerheap_next(&timers, &next))
+		return -1;
+	else if (next <= now_us)
+		return 0;
+	else
+		return next - now_us;
+}
+
+struct fdmon_ctx {
+	int fd;
+	fdmon_callback_t readcb, writecb;
+	void* arg;
+	uint32_t flags;
+	int refcount;
+
+	/* Links to other fdmon_ctxs on the same file descriptor */
+	struct fdmon_ctx* next;
+	struct fdmon_ctx* prev;
+};
+
+/*
+ * Per-file-descriptor state.  There may be more than one fdmon_ctx for a
+ * given file descriptor (e.g. a msgchan's send and receive sides on a single
+ * socket), so the backend is told about the union of their flags.
+ */
+struct fdent {
+	struct fdmon_ctx* ctxs;
+
+	/* The flags the backend currently has for this file descriptor */
+	uint32_t kflags;
+
+	/* Whether this fd is on the pending_updates list */
+	int dirty;
+};
+
+static struct fdent* fdtab;
+static int fdtab_len;
+
+/* File descriptors whose flags may need to be updated in the backend */
+static struct {
+	int* fds;
+	int num;
+	int cap;
+} pending_updates;
+
+static void (*prepoll_hook)(void);
+
+void evloop_set_prepoll_hook(void (*fn)(void))
+{
+	prepoll_hook = fn;
+}
+
+static void fdtab_ensure(int fd)
+{
+	int newlen;
+
+	if (fd < fdtab_len)
+		return;
+
+	newlen = fdtab_len ? fdtab_len : 64;
+	while (newlen <= fd)
+		newlen *= 2;
+
+	fdtab = xrealloc(fdtab, newlen * sizeof(*fdtab));
+	memset(fdtab + fdtab_len, 0, (newlen - fdtab_len) * sizeof(*fdtab));
+	fdtab_len = newlen;
+}
+
+/* The flags wanted by all of the fdmon_ctxs on the given file descriptor. */
+static uint32_t fd_wanted_flags(int fd)
+{
+	struct fdmon_ctx* ctx;
+	uint32_t flags = 0;
+
+	for (ctx = fdtab[fd].ctxs; ctx; ctx = ctx->next)
+		flags |= ctx->flags;
+
+	return flags;
+}
+
+static void backend_update(int fd, uint32_t oldflags, uint32_t newflags);
+
+/* Bring the backend's idea of the given fd's flags up to date. */
+static void sync_fd(int fd)
+{
+	uint32_t flags = fd_wanted_flags(fd);
+
+	if (flags != fdtab[fd].kflags) {
+		backend_update(fd, fdtab[fd].kflags, flags);
+		fdtab[fd].kflags = flags;
+	}
+}
+
+static void mark_dirty(int fd)
+{
+	if (fdtab[fd].dirty)
+		return;
+
+	if (pending_updates.num == pending_updates.cap) {
+		pending_updates.cap = pending_updates.cap ? pending_updates.cap * 2 : 16;
+		pending_updates.fds = xrealloc(pending_updates.fds, pending_updates.cap
+		                               * sizeof(*pending_updates.fds));
+	}
+
+	pending_updates.fds[pending_updates.num++] = fd;
+	fdtab[fd].dirty = 1;
+}
+
+static void flush_pending_updates(void)
+{
+	int i, fd;
+
+	for (i = 0; i < pending_updates.num; i++) {
+		fd = pending_updates.fds[i];
+		fdtab[fd].dirty = 0;
+		sync_fd(fd);
+	}
+
+	pending_updates.num = 0;
+}
+
+struct fdmon_ctx* fdmon_register_fd(int fd, fdmon_callback_t readcb,
+                                    fdmon_callback_t writecb, void* arg)
+{
+	struct fdmon_ctx* ctx = xmalloc(sizeof(*ctx));
+
+	fdtab_ensure(fd);
+
+	ctx->fd = fd;
+	ctx->readcb = readcb;
+	ctx->writecb = writecb;
+	ctx->arg = arg;
+	ctx->flags = 0;
+	ctx->refcount = 1;
+
+	ctx->prev = NULL;
+	ctx->next = fdtab[fd].ctxs;
+	if (ctx->next)
+		ctx->next->prev = ctx;
+	fdtab[fd].ctxs = ctx;
+
+	return ctx;
+}
+
+static void fdmon_unref(struct fdmon_ctx* ctx)
+{
+	assert(ctx->refcount > 0);
+	ctx->refcount -= 1;
+
+	if (ctx->refcount)
+		return;
+
+	if (ctx->prev)
+		ctx->prev->next = ctx->next;
+	else
+		fdtab[ctx->fd].ctxs = ctx->next;
+
+	if (ctx->next)
+		ctx->next->prev = ctx->prev;
+
+	xfree(ctx);
+}
+
+static void fdmon_ref(struct fdmon_ctx* ctx)
+{
+	assert(ctx->refcount > 0);
+	ctx->refcount += 1;
+}
+
+void fdmon_unregister(struct fdmon_ctx* ctx)
+{
+	int fd = ctx->fd;
+
+	fdmon_unmonitor(ctx, FM_READ|FM_WRITE);
+	fdmon_unref(ctx);
+
+	/*
+	 * Unlike other updates, this one is applied immediately: callers
+	 * typically close the file descriptor right after unregistering it,
+	 * and with epoll a closed fd whose underlying file is still open
+	 * elsewhere (e.g. in a child process) would otherwise stay in the
+	 * interest set with no way left to remove it.
+	 */
+	sync_fd(fd);
+}
+
+void fdmon_monitor(struct fdmon_ctx* ctx, uint32_t flags)
+{
+	if (flags & ~(FM_READ|FM_WRITE)) {
+		errlog("invalid fdmon flags: %u\n", flags);
+		abort();
+	}
+
+	if ((ctx->flags | flags) != ctx->flags) {
+		ctx->flags |= flags;
+		mark_dirty(ctx->fd);
+	}
+}
+
+void fdmon_unmonitor(struct fdmon_ctx* ctx, uint32_t flags)
+{
+	if (flags & ~(FM_READ|FM_WRITE)) {
+		errlog("invalid fdmon flags: %u\n", flags);
+		abort();
+	}
+
+	if (ctx->flags & flags) {
+		ctx->flags &= ~flags;
+		mark_dirty(ctx->fd);
+	}
+}
+
+/* Call the callbacks on the given fd for the given readiness flags. */
+static void dispatch_fd(int fd, uint32_t ready)
+{
+	struct fdmon_ctx* ctx;
+	struct fdmon_ctx* next;
+
+	if (fd < 0 || fd >= fdtab_len)
+		return;
+
+	for (ctx = fdtab[fd].ctxs; ctx; ctx = next) {
+		/*
+		 * Callbacks could unregister ctx, so we ref/unref it around
+		 * the body of this loop
+		 */
+		fdmon_ref(ctx);
+
+		if ((ready & FM_READ) && (ctx->flags & FM_READ))
+			ctx->readcb(ctx, ctx->arg);
+
+		if ((ready & FM_WRITE) && (ctx->flags & FM_WRITE))
+			ctx->writecb(ctx, ctx->arg);
+
+		next = ctx->next;
+		fdmon_unref(ctx);
+	}
+}
+
+#if defined(EVLOOP_EPOLL)
+
+static int epfd = -1;
+
+/* Max events to retrieve per epoll_wait() */
+#define EPOLL_BATCH 64
+
+static void backend_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+}
+
+static void backend_update(int fd, uint32_t oldflags, uint32_t newflags)
+{
+	int op;
+	struct epoll_event ev = {
+		.events = ((newflags & FM_READ) ? EPOLLIN : 0)
+			| ((newflags & FM_WRITE) ? EPOLLOUT : 0),
+		.data.fd = fd,
+	};
+
+	if (epfd < 0)
+		backend_init();
+
+	op = !oldflags ? EPOLL_CTL_ADD : !newflags ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+	if (!epoll_ctl(epfd, op, fd, &ev))
+		return;
+
+	/*
+	 * The fd number may have been closed (which silently drops it from
+	 * the epoll set) and possibly reused since we last touched it.
+	 */
+	if (op == EPOLL_CTL_MOD && errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else if (op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+		return;
+	else
+		goto fail;
+
+	if (!epoll_ctl(epfd, op, fd, &ev))
+		return;
+
+fail:
+	perror("epoll_ctl");
+	exit(1);
+}
+
+static void backend_wait(int64_t timeout_us)
+{
+	int i, n, timeout_ms;
+	uint32_t ready;
+	struct epoll_event events[EPOLL_BATCH];
+
+	if (epfd < 0)
+		backend_init();
+
+	/* Round up so we don't wake up early and spin */
+	timeout_ms = timeout_us < 0 ? -1 : (int)((timeout_us + 999) / 1000);
+
+	n = epoll_wait(epfd, events, ARR_LEN(events), timeout_ms);
+	if (n < 0 && errno != EINTR) {
+		perror("epoll_wait");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		ready = 0;
+		if (events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			ready |= FM_READ;
+		if (events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+			ready |= FM_WRITE;
+		dispatch_fd(events[i].data.fd, ready);
+	}
+}
+
+#elif defined(EVLOOP_KQUEUE)
+
+static int kqfd = -1;
+
+/* Max events to retrieve per kevent() */
+#define KQUEUE_BATCH 64
+
+static void backend_init(void)
+{
+	kqfd = kqueue();
+	if (kqfd < 0) {
+		perror("kqueue");
+		exit(1);
+	}
+	set_fd_cloexec(kqfd, 1);
+}
+
+static void backend_update(int fd, uint32_t oldflags, uint32_t newflags)
+{
+	struct kevent changes[2];
+	int i, n = 0;
+
+	if (kqfd < 0)
+		backend_init();
+
+	if ((oldflags ^ newflags) & FM_READ)
+		EV_SET(&changes[n++], fd, EVFILT_READ,
+		       (newflags & FM_READ) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	if ((oldflags ^ newflags) & FM_WRITE)
+		EV_SET(&changes[n++], fd, EVFILT_WRITE,
+		       (newflags & FM_WRITE) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+
+	/*
+	 * Apply the changes one at a time so a failed deletion (the fd having
+	 * been closed, which drops its filters automatically) can be
+	 * distinguished and ignored.
+	 */
+	for (i = 0; i < n; i++) {
+		if (kevent(kqfd, &changes[i], 1, NULL, 0, NULL)
+		    && !((changes[i].flags & EV_DELETE)
+		         && (errno == ENOENT || errno == EBADF))) {
+			perror("kevent");
+			exit(1);
+		}
+	}
+}
+
+static void backend_wait(int64_t timeout_us)
+{
+	int i, n;
+	struct timespec ts;
+	struct kevent events[KQUEUE_BATCH];
+
+	if (kqfd < 0)
+		backend_init();
+
+	if (timeout_us >= 0) {
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+	}
+
+	n = kevent(kqfd, NULL, 0, events, ARR_LEN(events),
+	           timeout_us < 0 ? NULL : &ts);
+	if (n < 0 && errno != EINTR) {
+		perror("kevent");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (events[i].flags & EV_ERROR)
+			continue;
+		dispatch_fd(events[i].ident,
+		            events[i].filter == EVFILT_READ ? FM_READ : FM_WRITE);
+	}
+}
+
+#else /* EVLOOP_SELECT */
+
+static void backend_update(int fd, uint32_t oldflags, uint32_t newflags)
+{
+	if (fd >= FD_SETSIZE) {
+		errlog("file descriptor %d exceeds FD_SETSIZE\n", fd);
+		abort();
+	}
+}
+
+static void backend_wait(int64_t timeout_us)
+{
+	int fd, status, nfds = 0;
+	fd_set rfds, wfds;
+	struct timeval tv;
+	uint32_t ready;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+	for (fd = 0; fd < fdtab_len; fd++) {
+		if (fdtab[fd].kflags & FM_READ)
+			fdset_add(fd, &rfds, &nfds);
+		if (fdtab[fd].kflags & FM_WRITE)
+			fdset_add(fd, &wfds, &nfds);
+	}
+
+	if (timeout_us >= 0) {
+		tv.tv_sec = timeout_us / 1000000;
+		tv.tv_usec = timeout_us % 1000000;
+	}
+
+	status = select(nfds, &rfds, &wfds, NULL, timeout_us < 0 ? NULL : &tv);
+	if (status < 0) {
+		if (errno != EINTR) {
+			perror("select");
+			exit(1);
+		}
+		return;
+	}
+
+	for (fd = 0; fd < nfds; fd++) {
+		ready = (FD_ISSET(fd, &rfds) ? FM_READ : 0)
+			| (FD_ISSET(fd, &wfds) ? FM_WRITE : 0);
+		if (ready)
+			dispatch_fd(fd, ready);
+	}
+}
+
+#endif
+
+/* When the loop last returned from backend_wait(), for stats collection */
+static uint64_t last_wakeup;
+
+static void run_event_loop_once(void)
+{
+	timerheap_run(&timers, get_microtime());
+
+	if (prepoll_hook)
+		prepoll_hook();
+
+	flush_pending_updates();
+
+	if (stats_enabled && last_wakeup)
+		hist_record(&evloop_busy, get_microtime() - last_wakeup);
+
+	backend_wait(get_poll_timeout(get_microtime()));
+
+	if (stats_enabled)
+		last_wakeup = get_microtime();
+}
+
+void run_event_loop(void)
+{
+	for (;;)
+		run_event_loop_once();
+}
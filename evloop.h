@@ -0,0 +1,19 @@
+/*
+ * Generic POSIX implementation of the events.h interface (used by platforms
+ * that don't have an event loop of their own to integrate with).
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include "events.h"
+
+/*
+ * Set a function to be called on each iteration of the event loop just
+ * before it blocks waiting for file descriptors or timers (e.g. to process
+ * input that a library has already buffered internally, which wouldn't
+ * otherwise show up as the file descriptor being readable).
+ */
+void evloop_set_prepoll_hook(void (*fn)(void));
+
+#endif /* EVLOOP_H */
@@ -14,6 +14,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <netdb.h>
 #include <math.h>
 
 #include "types.h"
@@ -21,6 +22,8 @@
 #include "message.h"
 #include "platform.h"
 #include "keycodes.h"
+#include "seal.h"
+#include "trace.h"
 
 #include "cfg-parse.tab.h"
 
@@ -31,6 +34,16 @@ static struct config global_cfg = {
 		.max_tries = 10,
 		.max_interval = 30 * 1000 * 1000,
 	},
+	.coalesce_motion = 1,
+	.remote_edge_detection = 1,
+	.clipboard_hashing = 1,
+	.clipboard_compression = 1,
+	.ssh_multiplex.persist = 300 * 1000 * 1000,
+	.udp_motion = 1,
+	.heartbeat = {
+		.interval = 1000 * 1000,
+		.max_missed = 3,
+	},
 };
 static struct config* config = &global_cfg;
 
@@ -38,6 +51,9 @@ struct node* focused_node;
 static struct node* last_focused_node;
 opmode_t opmode;
 
+/* Whether keystrokes are being sent to the whole broadcast group */
+static int broadcast_input;
+
 static char* progname;
 static int orig_argc;
 static char** orig_argv;
@@ -48,7 +64,8 @@ static FILE* logfile;
 
 static void focus_master(void);
 static void setup_remote(struct remote* rmt);
-static void handle_message(struct remote* rmt, const struct message* msg);
+static void handle_message(struct remote* rmt, struct message* msg);
+static void cancel_fade(struct node* node);
 
 #define SYSLOG_FACILITY LOG_USER
 
@@ -153,7 +170,7 @@ __printf(2, 3) void mlog(unsigned int level, const char* fmt, ...)
 	va_start(va, fmt);
 	if (opmode == MASTER) {
 		vlog(fmt, va);
-	} else {
+	} else if (remote_attached()) {
 		msg = new_message(MT_LOGMSG);
 		MB(msg, logmsg).msg = xvasprintf(fmt, va);
 		mc_enqueue_message(&stdio_msgchan, msg);
@@ -161,14 +178,135 @@ __printf(2, 3) void mlog(unsigned int level, const char* fmt, ...)
 	va_end(va);
 }
 
+/*
+ * Direct transport
+ * ================
+ *
+ * If the direct-transport option is enabled, the master generates a pair
+ * of keys for each connection and sends them in the SETUP (via ssh, which
+ * protects them in transit).  A remote that accepts opens a TCP listening
+ * socket on the address it was reached at by ssh and reports it in its
+ * READY; the master connects to it, and once connected each side sends a
+ * TRANSPORTSWITCH via ssh and moves its msgchan over onto the TCP
+ * connection, with every frame sealed with the sending side's key.  The ssh
+ * connection stays up (idle) for as long as the remote does.  If anything
+ * goes wrong before the switch the connection just stays on ssh.
+ *
+ * With udp-motion also enabled, a third key is sent for a UDP side-channel
+ * carrying pointer motion (see msgchan.c), which the remote sets up
+ * alongside the TCP listener, and which is put into use along with the
+ * switch.
+ */
+
+/* Discard any direct-transport state (short of what msgchan owns). */
+static void clear_direct_transport(struct remote* rmt)
+{
+	if (rmt->direct.state == DT_CONNECTING) {
+		fdmon_unregister(rmt->direct.mon);
+		close(rmt->direct.fd);
+	}
+	rmt->direct.mon = NULL;
+	rmt->direct.fd = -1;
+
+	if (rmt->direct.state != DT_NONE && rmt->direct.motionfd >= 0)
+		close(rmt->direct.motionfd);
+	rmt->direct.motionfd = -1;
+
+#ifdef HAVE_OPENSSL
+	free_seal(rmt->direct.sendseal);
+	free_seal(rmt->direct.recvseal);
+	free_seal(rmt->direct.motionseal);
+#endif
+	rmt->direct.sendseal = NULL;
+	rmt->direct.recvseal = NULL;
+	rmt->direct.motionseal = NULL;
+
+	rmt->direct.state = DT_NONE;
+}
+
+#ifdef HAVE_OPENSSL
+/*
+ * Generate keys for a direct transport to the given remote and add them to
+ * the params to be offered in its SETUP.
+ */
+static void offer_direct_transport(struct remote* rmt)
+{
+	static const char* const keynames[] = {
+		"direct-key-master",
+		"direct-key-remote",
+		"direct-key-motion",
+	};
+	unsigned char keys[ARR_LEN(keynames)][SEAL_KEY_LEN];
+	int i, numkeys = config->udp_motion ? 3 : 2;
+	char* hex;
+
+	for (i = 0; i < numkeys; i++) {
+		if (gen_seal_key(keys[i])) {
+			warn("failed to generate keys, not offering direct transport\n");
+			explicit_bzero(keys, sizeof(keys));
+			return;
+		}
+	}
+
+	rmt->direct.motionfd = -1;
+	rmt->direct.sendseal = new_seal(keys[0]);
+	rmt->direct.recvseal = new_seal(keys[1]);
+	if (config->udp_motion)
+		rmt->direct.motionseal = new_seal(keys[2]);
+	if (!rmt->direct.sendseal || !rmt->direct.recvseal
+	    || (config->udp_motion && !rmt->direct.motionseal)) {
+		warn("failed to set up seals, not offering direct transport\n");
+		clear_direct_transport(rmt);
+		explicit_bzero(keys, sizeof(keys));
+		return;
+	}
+
+	kvmap_put(rmt->params, "direct-transport", "tcp");
+	if (config->udp_motion)
+		kvmap_put(rmt->params, "direct-motion", "udp");
+	for (i = 0; i < numkeys; i++) {
+		hex = seal_key_to_hex(keys[i]);
+		kvmap_put(rmt->params, keynames[i], hex);
+		explicit_bzero(hex, strlen(hex));
+		xfree(hex);
+	}
+	explicit_bzero(keys, sizeof(keys));
+
+	rmt->direct.state = DT_OFFERED;
+}
+#endif
+
+static void stop_heartbeat(struct remote* rmt)
+{
+	if (rmt->heartbeat.timer) {
+		cancel_call(rmt->heartbeat.timer);
+		rmt->heartbeat.timer = NULL;
+	}
+}
+
 static void disconnect_remote(struct remote* rmt)
 {
 	pid_t pid;
 	int status;
 
+	stop_heartbeat(rmt);
+
 	/* Close fds and reset send & receive queues/buffers */
 	mc_close(&rmt->msgchan);
 
+	/* Whatever brightness it was left at, it'll start over fresh */
+	cancel_fade(&rmt->node);
+	rmt->node.fade.known = 0;
+
+	/*
+	 * Even if its session is resumed, its clipboard may have changed
+	 * while we weren't connected to hear about it.
+	 */
+	rmt->clipboard_known = 0;
+	rmt->clipboard_pending = 0;
+
+	clear_direct_transport(rmt);
+
 	/*
 	 * A note on signal choice here: initially this used SIGTERM (which
 	 * seemed more appropriate), but it appears ssh has a tendency to
@@ -239,10 +377,86 @@ static void fail_remote(struct remote* rmt, const char* reason)
 
 static void enqueue_message(struct remote* rmt, struct message* msg)
 {
+	msg = trace_message(rmt, msg);
+
 	if (mc_enqueue_message(&rmt->msgchan, msg))
 		fail_remote(rmt, "send backlog exceeded");
 }
 
+/*
+ * Heartbeats
+ * ==========
+ *
+ * Every heartbeat.interval the master sends each connected remote a PING,
+ * which it answers with a PONG.  Each PONG gives a round-trip time sample
+ * (smoothed as per TCP's SRTT, RFC 6298), and if max_missed intervals go by
+ * with a PING outstanding and no PONG received, the remote is failed.
+ */
+
+static void send_ping(struct remote* rmt)
+{
+	struct message* msg = new_message(MT_PING);
+
+	MB(msg, ping).seq = ++rmt->heartbeat.seq;
+	MB(msg, ping).timestamp = get_microtime();
+	enqueue_message(rmt, msg);
+}
+
+static void heartbeat_cb(void* arg)
+{
+	struct remote* rmt = arg;
+
+	rmt->heartbeat.timer = NULL;
+
+	if (rmt->heartbeat.acked != rmt->heartbeat.seq
+	    && ++rmt->heartbeat.missed >= config->heartbeat.max_missed) {
+		fail_remote(rmt, "heartbeat timed out");
+		return;
+	}
+
+	/* (Scheduled first so that a failure in sending cancels it.) */
+	rmt->heartbeat.timer = schedule_call(heartbeat_cb, rmt,
+	                                     config->heartbeat.interval);
+
+	send_ping(rmt);
+}
+
+static void start_heartbeat(struct remote* rmt)
+{
+	rmt->heartbeat.seq = 0;
+	rmt->heartbeat.acked = 0;
+	rmt->heartbeat.missed = 0;
+	rmt->heartbeat.srtt = 0;
+
+	if (config->heartbeat.interval)
+		rmt->heartbeat.timer = schedule_call(heartbeat_cb, rmt,
+		                                     config->heartbeat.interval);
+}
+
+static void handle_pong(struct remote* rmt, const struct ping_body* pong)
+{
+	uint64_t now = get_microtime();
+	uint64_t rtt;
+
+	if (pong->seq > rmt->heartbeat.seq || pong->timestamp > now) {
+		fail_remote(rmt, "bogus PONG");
+		return;
+	}
+
+	/* Even a late one shows the remote's still alive */
+	rmt->heartbeat.acked = pong->seq;
+	rmt->heartbeat.missed = 0;
+
+	rtt = now - pong->timestamp;
+	if (!rmt->heartbeat.srtt)
+		rmt->heartbeat.srtt = rtt;
+	else
+		rmt->heartbeat.srtt = (7 * rmt->heartbeat.srtt + rtt) / 8;
+
+	if (rmt->msgchan.stats)
+		hist_record(&rmt->stats.ping_rtt, rtt);
+}
+
 void send_keyevent(struct remote* rmt, keycode_t kc, pressrel_t pr)
 {
 	struct message* msg;
@@ -270,31 +484,54 @@ void send_moverel(struct remote* rmt, int32_t dx, int32_t dy)
 	MB(msg, moverel).dx = dx;
 	MB(msg, moverel).dy = dy;
 
+	/*
+	 * Remotes doing their own edge detection don't answer every MOVEREL
+	 * with a MOUSEPOS, so there's no round trip to time.
+	 */
+	if (stats_enabled && !config->remote_edge_detection && !rmt->moverel_sent)
+		rmt->moverel_sent = get_microtime();
+
+	enqueue_message(rmt, msg);
+}
+
+/*
+ * Scroll by the given amount (in SCROLL_NOTCH units, positive being up),
+ * scaled by the remote's scrollmult setting.
+ */
+void send_scroll(struct remote* rmt, int32_t amount)
+{
+	struct message* msg;
+
+	if (!rmt)
+		return;
+
+	msg = new_message(MT_SCROLL);
+
+	MB(msg, scroll).amount = clamp_scroll((int64_t)amount * rmt->scrollmult);
+
 	enqueue_message(rmt, msg);
 }
 
 void send_clickevent(struct remote* rmt, mousebutton_t button, pressrel_t pr)
 {
 	struct message* msg;
-	unsigned int i, count = 1;
 
 	if (!rmt)
 		return;
 
+	/* Scroll buttons get sent as a single SCROLL per "click" */
 	if (button == MB_SCROLLUP || button == MB_SCROLLDOWN) {
-		count = abs(rmt->scrollmult);
-		if (rmt->scrollmult < 0)
-			button = (button == MB_SCROLLUP) ? MB_SCROLLDOWN : MB_SCROLLUP;
+		if (pr == PR_PRESS)
+			send_scroll(rmt, button == MB_SCROLLUP ? SCROLL_NOTCH : -SCROLL_NOTCH);
+		return;
 	}
 
-	for (i = 0; i < count; i++) {
-		msg = new_message(MT_CLICKEVENT);
+	msg = new_message(MT_CLICKEVENT);
 
-		MB(msg, clickevent).button = button;
-		MB(msg, clickevent).pressrel = pr;
+	MB(msg, clickevent).button = button;
+	MB(msg, clickevent).pressrel = pr;
 
-		enqueue_message(rmt, msg);
-	}
+	enqueue_message(rmt, msg);
 }
 
 void send_setbrightness(struct remote* rmt, float f)
@@ -322,9 +559,104 @@ void send_setclipboard(struct remote* rmt, char* text)
 
 	MB(msg, setclipboard).text = text;
 
+	hash_clipboard(text, &rmt->clipboard);
+	rmt->clipboard_known = 1;
+
+	/* (This also ends any CLIPPENDING hold.) */
+	rmt->clipboard_pending = 0;
+
 	enqueue_message(rmt, msg);
 }
 
+/*
+ * Send the given message (which is consumed) to every connected remote for
+ * which 'include' (if non-NULL) returns non-zero, encoding it only once for
+ * all of them.
+ */
+static void broadcast_message(struct message* msg,
+                              int (*include)(const struct remote* rmt))
+{
+	struct encmsg* em = encode_message(msg);
+	struct remote* rmt;
+
+	free_message(msg);
+
+	for_each_remote (rmt) {
+		if (rmt->state == CS_CONNECTED && (!include || include(rmt)))
+			enqueue_message(rmt, share_message(em));
+	}
+
+	encmsg_unref(em);
+}
+
+/*
+ * Broadcast input
+ * ===============
+ *
+ * With broadcast input toggled on, keystrokes typed while a remote has focus
+ * are sent not only to that remote but to every connected remote in the
+ * broadcast group (all those not configured with 'broadcast = no').
+ */
+
+static int in_broadcast_group(const struct remote* rmt)
+{
+	return rmt->broadcast || &rmt->node == focused_node;
+}
+
+/* Members of the broadcast group other than the focused node */
+static int is_broadcast_peer(const struct remote* rmt)
+{
+	return rmt->broadcast && &rmt->node != focused_node;
+}
+
+static void broadcast_keyevent(keycode_t kc, pressrel_t pr,
+                               int (*include)(const struct remote* rmt))
+{
+	struct message* msg = new_message(MT_KEYEVENT);
+
+	MB(msg, keyevent).keycode = kc;
+	MB(msg, keyevent).pressrel = pr;
+
+	broadcast_message(msg, include);
+}
+
+/*
+ * Pass a keystroke from the master's keyboard on to the focused remote, and
+ * (if broadcast input is on) the rest of the broadcast group.
+ */
+void forward_keyevent(keycode_t kc, pressrel_t pr)
+{
+	if (broadcast_input)
+		broadcast_keyevent(kc, pr, in_broadcast_group);
+	else
+		send_keyevent(focused_node->remote, kc, pr);
+}
+
+static void toggle_broadcast_input(const keycode_t* modkeys)
+{
+	struct remote* rmt;
+	int i, peers = 0;
+
+	broadcast_input = !broadcast_input;
+
+	for_each_remote (rmt) {
+		if (rmt->state == CS_CONNECTED && is_broadcast_peer(rmt))
+			peers += 1;
+	}
+
+	/*
+	 * The hotkey's modifiers went to the peers as they were pressed, but
+	 * their releases won't; don't leave them stuck down.
+	 */
+	if (!broadcast_input) {
+		for (i = 0; modkeys[i] != ET_null; i++)
+			broadcast_keyevent(modkeys[i], PR_RELEASE, is_broadcast_peer);
+	}
+
+	info("broadcast input %s (%d other remote%s in group)\n",
+	     broadcast_input ? "enabled" : "disabled", peers, peers == 1 ? "" : "s");
+}
+
 #define SSH_DEFAULT(type, name) \
 	static inline type get_##name(const struct remote* rmt) \
 	{ \
@@ -352,6 +684,9 @@ static void exec_remote_shell(const struct remote* rmt)
 
 		/* placeholders */
 		NULL, /* -q */
+		NULL, /* -oControlMaster=auto */
+		NULL, /* -oControlPath=... */
+		NULL, /* -oControlPersist=... */
 		NULL, /* -E */
 		NULL, /* logfile */
 		NULL, /* -b */
@@ -374,6 +709,23 @@ static void exec_remote_shell(const struct remote* rmt)
 	if (config->log.level < LL_WARN)
 		argv[nargs++] = "-q";
 
+	/*
+	 * With multiplexing enabled, the first connection to a given host
+	 * leaves a master ssh process running in the background (for
+	 * ControlPersist seconds after its last client goes away), and
+	 * subsequent connections (reconnects in particular) just open a new
+	 * channel over it instead of going through a full handshake.  Note
+	 * that the process we fork (and SIGKILL in disconnect_remote()) is
+	 * then only a mux client, so killing it doesn't take down the shared
+	 * connection.
+	 */
+	if (config->ssh_multiplex.enabled) {
+		argv[nargs++] = "-oControlMaster=auto";
+		argv[nargs++] = "-oControlPath=~/.ssh/enthrall-%C";
+		argv[nargs++] = xasprintf("-oControlPersist=%d",
+		                          (int)(config->ssh_multiplex.persist / 1000000));
+	}
+
 	if (config->log.file.type == LF_FILE) {
 		argv[nargs++] = "-E";
 		argv[nargs++] = config->log.file.path;
@@ -436,11 +788,27 @@ static void rmt_mc_err_cb(struct msgchan* mc, void* arg)
 	fail_remote(rmt, "msgchan error");
 }
 
+/* Mask of the directions in which the given node has neighbors */
+static dirmask_t neighbor_dirmask(const struct node* node)
+{
+	direction_t dir;
+	dirmask_t mask = 0;
+
+	for_each_direction (dir) {
+		if (node->neighbors[dir])
+			mask |= 1U << dir;
+	}
+
+	return mask;
+}
+
 static void setup_remote(struct remote* rmt)
 {
 	int sockfds[2];
 	struct message* setupmsg;
 	int sndbuf_sz;
+	char edgemask_str[16];
+	char persist_str[32];
 
 	info("initiating connection attempt to remote %s...\n", rmt->node.name);
 
@@ -451,17 +819,20 @@ static void setup_remote(struct remote* rmt)
 
 	/*
 	 * If a remote goes offline, we want to detect it sooner rather than
-	 * later (which happens via ssh getting backed up, thus allowing our
-	 * send backlog to reach its limit), so we shrink our send-buffer size
-	 * on the socket we'll be sending messages through.  Granted, ssh's
-	 * network-facing socket probably still has a much larger send buffer,
-	 * so the effectiveness of this is likely to be pretty limited, but we
-	 * might as well try.
+	 * later.  Normally heartbeats take care of that, but with them
+	 * disabled it happens only via ssh getting backed up (thus allowing
+	 * our send backlog to reach its limit), so in that case we shrink our
+	 * send-buffer size on the socket we'll be sending messages through.
+	 * Granted, ssh's network-facing socket probably still has a much
+	 * larger send buffer, so the effectiveness of this is likely to be
+	 * pretty limited, but we might as well try.
 	 */
-	sndbuf_sz = 1024;
-	if (setsockopt(sockfds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf_sz,
-	               sizeof(sndbuf_sz)))
-		warn("setsockopt(SO_SNDBUF) failed: %s\n", strerror(errno));
+	if (!config->heartbeat.interval) {
+		sndbuf_sz = 1024;
+		if (setsockopt(sockfds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf_sz,
+		               sizeof(sndbuf_sz)))
+			warn("setsockopt(SO_SNDBUF) failed: %s\n", strerror(errno));
+	}
 
 	rmt->sshpid = fork();
 	if (rmt->sshpid < 0) {
@@ -470,6 +841,7 @@ static void setup_remote(struct remote* rmt)
 	}
 
 	rmt->state = CS_SETTINGUP;
+	rmt->setup_start = get_microtime();
 
 	if (!rmt->sshpid) {
 		/* ssh child */
@@ -493,6 +865,12 @@ static void setup_remote(struct remote* rmt)
 
 	mc_init(&rmt->msgchan, sockfds[0], sockfds[0], rmt_mc_read_cb,
 	        rmt_mc_err_cb, rmt);
+	rmt->msgchan.coalesce_motion = config->coalesce_motion;
+	rmt->msgchan.batch_events = config->event_batching;
+	rmt->msgchan.batch_window = config->event_batch_window;
+	if (config->stats)
+		rmt->msgchan.stats = &rmt->stats;
+	rmt->moverel_sent = 0;
 
 	if (close(sockfds[1]))
 		perror("close");
@@ -501,9 +879,61 @@ static void setup_remote(struct remote* rmt)
 	setupmsg->body.type = MT_SETUP;
 	MB(setupmsg, setup).prot_vers = PROT_VERSION;
 	MB(setupmsg, setup).loglevel = config->log.level;
+
+	/*
+	 * Tell the remote which of its screen edges we actually care about
+	 * (those with neighbors, if the mouse can switch focus); it will then
+	 * only send MOUSEPOS messages when that edge state changes.
+	 */
+	if (config->remote_edge_detection) {
+		snprintf(edgemask_str, sizeof(edgemask_str), "%u",
+		         config->mouseswitch.type == MS_NONE ? 0
+		         : neighbor_dirmask(&rmt->node));
+		kvmap_put(rmt->params, "edge-mask", edgemask_str);
+	}
+
+	/* Ask the remote to report clipboard changes (see push_clipboard()) */
+	if (config->clipboard_hashing)
+		kvmap_put(rmt->params, "clipboard-hashing", "1");
+
+#ifdef HAVE_ZLIB
+	/* Offer clipboard compression; the remote accepts it in its READY */
+	if (config->clipboard_compression)
+		kvmap_put(rmt->params, "clipboard-compression", "zlib");
+#endif
+
+#ifdef HAVE_OPENSSL
+	if (config->direct_transport)
+		offer_direct_transport(rmt);
+#endif
+
+	/*
+	 * Ask the remote to stick around after losing its connection, and if
+	 * one already is (as far as we know), to reattach to it.
+	 */
+	if (config->remote_persist) {
+		snprintf(persist_str, sizeof(persist_str), "%llu",
+		         (unsigned long long)config->remote_persist);
+		kvmap_put(rmt->params, "persist", persist_str);
+		kvmap_put(rmt->params, "resume-session",
+		          rmt->session.id ? rmt->session.id : "");
+		kvmap_put(rmt->params, "resume-token",
+		          rmt->session.token ? rmt->session.token : "");
+	}
+
 	MB(setupmsg, setup).params.params_val = flatten_kvmap(rmt->params,
 	                                                      &MB(setupmsg, setup).params.params_len);
 
+	/* No need to keep the keys around once they're in the SETUP */
+	if (rmt->direct.state == DT_OFFERED) {
+		kvmap_put(rmt->params, "direct-key-master", "");
+		kvmap_put(rmt->params, "direct-key-remote", "");
+		if (rmt->direct.motionseal)
+			kvmap_put(rmt->params, "direct-key-motion", "");
+	}
+	if (config->remote_persist)
+		kvmap_put(rmt->params, "resume-token", "");
+
 	enqueue_message(rmt, setupmsg);
 }
 
@@ -623,6 +1053,86 @@ static void check_remotes(void)
 }
 
 
+/*
+ * Have a remote hold off pastes until its clipboard's brought up to date
+ * (i.e. until the next send_setclipboard() or release_remote_clipboard()).
+ */
+static void hold_remote_clipboard(struct remote* rmt)
+{
+	if (rmt->state != CS_CONNECTED)
+		return;
+
+	rmt->clipboard_pending = 1;
+	enqueue_message(rmt, new_message(MT_CLIPPENDING));
+}
+
+/* Tell a remote held by hold_remote_clipboard() there's nothing coming. */
+static void release_remote_clipboard(struct remote* rmt)
+{
+	if (!rmt->clipboard_pending || rmt->state != CS_CONNECTED)
+		return;
+
+	rmt->clipboard_pending = 0;
+	enqueue_message(rmt, new_message(MT_CLIPBOARDUNCHANGED));
+}
+
+/* Completion callback for retrieving the clipboard in push_clipboard(). */
+static void push_clipboard_cb(char* text, void* arg)
+{
+	struct remote* rmt = arg;
+	struct cliphash ch;
+
+	/* It may have gone away while we were waiting */
+	if (rmt->state != CS_CONNECTED) {
+		explicit_bzero(text, strlen(text));
+		xfree(text);
+		return;
+	}
+
+	if (config->clipboard_hashing && rmt->clipboard_known && rmt->clipboard_watched) {
+		hash_clipboard(text, &ch);
+		if (cliphash_eq(&ch, &rmt->clipboard)) {
+			debug("%s already has clipboard contents, not sending\n",
+			      rmt->node.name);
+			explicit_bzero(text, ch.length);
+			xfree(text);
+			release_remote_clipboard(rmt);
+			return;
+		}
+	}
+
+	send_setclipboard(rmt, text);
+}
+
+/*
+ * Send the master's clipboard contents to the given remote (once they've
+ * been retrieved), unless (clipboard-hashing being enabled) it's known to
+ * already have them -- which is only trusted of remotes that would have
+ * told us (via CLIPBOARDLOST) if their clipboard had since changed hands.
+ */
+static void push_clipboard(struct remote* rmt)
+{
+	get_clipboard_text_async(push_clipboard_cb, rmt);
+}
+
+/*
+ * Retrieve the given remote's clipboard contents (or, if clipboard-hashing is
+ * enabled and we know what they should be, just check if they've changed).
+ */
+static void pull_clipboard(struct remote* rmt)
+{
+	struct message* msg;
+
+	if (config->clipboard_hashing && rmt->clipboard_known) {
+		msg = new_message(MT_CHECKCLIPBOARD);
+		MB(msg, checkclipboard).expect = rmt->clipboard;
+	} else {
+		msg = new_message(MT_GETCLIPBOARD);
+	}
+
+	enqueue_message(rmt, msg);
+}
+
 static void transfer_clipboard(struct node* from, struct node* to)
 {
 	if (is_master(from) && is_master(to)) {
@@ -630,10 +1140,21 @@ static void transfer_clipboard(struct node* from, struct node* to)
 		return;
 	}
 
-	if (is_remote(from))
-		enqueue_message(from->remote, new_message(MT_GETCLIPBOARD));
-	else if (is_remote(to))
-		send_setclipboard(to->remote, get_clipboard_text());
+	/*
+	 * Whatever the new focus will end up with gets there after the
+	 * CLIPPENDING, on the interactive lane, so any paste it's sent in the
+	 * meantime waits for it.  The old focus mustn't be left holding (not
+	 * least because its own clipboard's about to be retrieved).
+	 */
+	if (is_remote(to))
+		hold_remote_clipboard(to->remote);
+
+	if (is_remote(from)) {
+		release_remote_clipboard(from->remote);
+		pull_clipboard(from->remote);
+	} else if (is_remote(to)) {
+		push_clipboard(to->remote);
+	}
 }
 
 static void transfer_modifiers(struct node* from, struct node* to,
@@ -641,7 +1162,11 @@ static void transfer_modifiers(struct node* from, struct node* to,
 {
 	int i;
 
-	if (is_remote(from)) {
+	/* When broadcasting, the whole group got the presses */
+	if (broadcast_input) {
+		for (i = 0; modkeys[i] != ET_null; i++)
+			broadcast_keyevent(modkeys[i], PR_RELEASE, in_broadcast_group);
+	} else if (is_remote(from)) {
 		for (i = 0; modkeys[i] != ET_null; i++)
 			send_keyevent(from->remote, modkeys[i], PR_RELEASE);
 	}
@@ -654,57 +1179,96 @@ static void transfer_modifiers(struct node* from, struct node* to,
 
 static void set_node_display_brightness(struct node* node, float f)
 {
+	/* Don't bother sending anything that wouldn't change anything */
+	if (node->fade.known && node->fade.level == f)
+		return;
+
 	if (is_master(node))
 		set_display_brightness(f);
 	else
 		send_setbrightness(node->remote, f);
+
+	node->fade.level = f;
+	node->fade.known = 1;
 }
 
-struct setbrightness_cb_args {
-	struct node* node;
-	float brightness;
-};
+/* Time (relative to the start of a fade) at which the given step is due. */
+static inline uint64_t fade_step_time(const struct brightness_fade* fade, int step)
+{
+	return (fade->duration * step) / fade->steps;
+}
 
-static void set_brightness_cb(void* arg)
+static void fade_step_cb(void* arg)
 {
-	struct setbrightness_cb_args* args = arg;
+	struct node* node = arg;
+	struct brightness_fade* fade = &node->fade;
+	float frac, level;
+
+	fade->timer = NULL;
 
 	/*
-	 * There's a chance this can be called after a remote has been
-	 * disconnected, in which case we need to not try to send the
-	 * brightness-change message to avoid a use-after-free.
+	 * Fades are cancelled when a remote is disconnected, but be careful
+	 * not to send anything to one that isn't (yet) fully connected.
 	 */
-	if (!(is_remote(args->node) && args->node->remote->state != CS_CONNECTED))
-		set_node_display_brightness(args->node, args->brightness);
+	if (is_remote(node) && node->remote->state != CS_CONNECTED)
+		return;
 
-	xfree(args);
-}
+	fade->step += 1;
+	if (fade->step >= fade->steps) {
+		level = fade->target;
+	} else {
+		frac = (float)fade->step / (float)fade->steps;
+		level = fade->start + (frac * (fade->target - fade->start));
+	}
 
-static void schedule_brightness_change(struct node* node, float f, uint64_t delay)
-{
-	struct setbrightness_cb_args* args = xmalloc(sizeof(*args));
+	set_node_display_brightness(node, level);
 
-	args->node = node;
-	args->brightness = f;
+	if (fade->step < fade->steps)
+		fade->timer = schedule_call(fade_step_cb, node,
+		                            fade_step_time(fade, fade->step + 1)
+		                            - fade_step_time(fade, fade->step));
+}
 
-	schedule_call(set_brightness_cb, args, delay);
+/* Abort any fade in progress on the given node, leaving it where it is. */
+static void cancel_fade(struct node* node)
+{
+	if (node->fade.timer) {
+		if (!cancel_call(node->fade.timer))
+			warn("Failed to cancel brightness fade for %s\n", node->name);
+		node->fade.timer = NULL;
+	}
 }
 
-static void transition_brightness(struct node* node, float from, float to,
-                                  uint64_t duration, int steps)
+/* Sentinel 'from' level for fade_brightness() */
+#define FADE_FROM_CURRENT (-1.0)
+
+/*
+ * Fade the given node's display brightness to 'to'.  If 'from' is
+ * non-negative the brightness first jumps to that level; otherwise the fade
+ * starts from wherever the node's brightness currently is (including partway
+ * through an earlier fade, which this one supersedes).
+ */
+static void fade_brightness(struct node* node, float from, float to,
+                            uint64_t duration, int steps)
 {
-	int i;
-	float frac, level;
-	uint64_t delay;
+	struct brightness_fade* fade = &node->fade;
 
-	set_node_display_brightness(node, from);
-	for (i = 1; i < steps; i++) {
-		frac = (float)i / (float)steps;
-		delay = (uint64_t)(frac * (float)duration);
-		level = from + (frac * (to - from));
-		schedule_brightness_change(node, level, delay);
-	}
-	schedule_brightness_change(node, to, duration);
+	cancel_fade(node);
+
+	if (from != FADE_FROM_CURRENT)
+		set_node_display_brightness(node, from);
+	else if (!fade->known)
+		set_node_display_brightness(node, 1.0);
+
+	fade->start = fade->level;
+	fade->target = to;
+	fade->duration = duration;
+	fade->steps = steps > 0 ? steps : 1;
+	fade->step = 0;
+
+	if (fade->start != fade->target)
+		fade->timer = schedule_call(fade_step_cb, node,
+		                            fade_step_time(fade, 1));
 }
 
 static void indicate_switch(struct node* from, struct node* to)
@@ -717,15 +1281,15 @@ static void indicate_switch(struct node* from, struct node* to)
 
 	case FH_DIM_INACTIVE:
 		if (from && from != to)
-			transition_brightness(from, 1.0, fh->brightness, fh->duration,
-			                      fh->fade_steps);
-		transition_brightness(to, fh->brightness, 1.0, fh->duration,
-		                      fh->fade_steps);
+			fade_brightness(from, FADE_FROM_CURRENT, fh->brightness,
+			                fh->duration, fh->fade_steps);
+		fade_brightness(to, FADE_FROM_CURRENT, 1.0, fh->duration,
+		                fh->fade_steps);
 		break;
 
 	case FH_FLASH_ACTIVE:
-		transition_brightness(to, fh->brightness, 1.0, fh->duration,
-		                      fh->fade_steps);
+		fade_brightness(to, fh->brightness, 1.0, fh->duration,
+		                fh->fade_steps);
 		break;
 
 	default:
@@ -747,6 +1311,7 @@ static int reconnect_remote(struct remote* rmt)
 		if (!cancel_call(rmt->reconnect_timer))
 			warn("Failed to cancel reconnect_timer for remote %s\n",
 			     rmt->node.name);
+		rmt->reconnect_timer = NULL;
 	}
 
 	if (rmt->state == CS_SETTINGUP)
@@ -842,6 +1407,8 @@ static void free_remote(struct remote* rmt)
 	xfree(rmt->hostname);
 	destroy_kvmap(rmt->params);
 	clear_ssh_config(&rmt->sshcfg);
+	xfree(rmt->session.id);
+	xfree(rmt->session.token);
 	xfree(rmt);
 }
 
@@ -875,6 +1442,8 @@ static void shutdown_master(void)
 		free_remote(rmt);
 	}
 
+	trace_stop();
+
 	while (config->hotkeys) {
 		hk = config->hotkeys;
 		config->hotkeys = hk->next;
@@ -925,9 +1494,10 @@ static int halt_reconnects(void)
 				disconnect_remote(rmt);
 
 			if (rmt->state == CS_FAILED) {
-				if (rmt->reconnect_timer)
+				if (rmt->reconnect_timer) {
 					cancel_call(rmt->reconnect_timer);
-				else
+					rmt->reconnect_timer = NULL;
+				} else
 					bug("remote '%s' in CS_FAILED state, but reconnect_timer is unset\n",
 					    rmt->node.name);
 			}
@@ -944,6 +1514,7 @@ static void action_cb(hotkey_context_t ctx, void* arg)
 {
 	int count;
 	struct remote* rmt;
+	struct message* msg;
 	struct action* a = arg;
 	keycode_t* modkeys = get_hotkey_modifiers(ctx);
 
@@ -988,9 +1559,19 @@ static void action_cb(hotkey_context_t ctx, void* arg)
 		info("clearing clipboard on all connected nodes\n");
 		set_clipboard_text("");
 		for_each_remote (rmt) {
-			if (rmt->state == CS_CONNECTED)
-				send_setclipboard(rmt, xstrdup(""));
+			if (rmt->state == CS_CONNECTED) {
+				hash_clipboard("", &rmt->clipboard);
+				rmt->clipboard_known = 1;
+				rmt->clipboard_pending = 0;
+			}
 		}
+		msg = new_message(MT_SETCLIPBOARD);
+		MB(msg, setclipboard).text = xstrdup("");
+		broadcast_message(msg, NULL);
+		break;
+
+	case AT_BROADCAST_INPUT:
+		toggle_broadcast_input(modkeys);
 		break;
 
 	default:
@@ -1116,22 +1697,6 @@ static int trigger_edgeevent(struct edge_state* ehist, direction_t dir, edgeeven
 	return 0;
 }
 
-static dirmask_t point_edgemask(struct xypoint pt, const struct rectangle* screen)
-{
-	dirmask_t mask = 0;
-
-	if (pt.x == screen->x.min)
-		mask |= LEFTMASK;
-	if (pt.x == screen->x.max)
-		mask |= RIGHTMASK;
-	if (pt.y == screen->y.min)
-		mask |= UPMASK;
-	if (pt.y == screen->y.max)
-		mask |= DOWNMASK;
-
-	return mask;
-}
-
 static void check_edgeevents(struct node* node, struct xypoint pt)
 {
 	direction_t dir;
@@ -1165,7 +1730,206 @@ static void mousepos_cb(struct xypoint pt)
 	check_edgeevents(&config->master, pt);
 }
 
-static void handle_message(struct remote* rmt, const struct message* msg)
+#ifdef HAVE_OPENSSL
+/*
+ * fdmon callback for completion (successful or otherwise) of the direct
+ * transport's connect().
+ */
+static void direct_connect_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	struct remote* rmt = arg;
+	int err;
+	socklen_t errlen = sizeof(err);
+
+	if (getsockopt(rmt->direct.fd, SOL_SOCKET, SO_ERROR, &err, &errlen))
+		err = errno;
+
+	if (err) {
+		warn("%s: direct connection failed (%s), staying on ssh\n",
+		     rmt->node.name, strerror(err));
+		clear_direct_transport(rmt);
+		return;
+	}
+
+	fdmon_unregister(rmt->direct.mon);
+	rmt->direct.mon = NULL;
+
+	/* The msgchan owns the fd and the seal from here on */
+	mc_switch_send(&rmt->msgchan, rmt->direct.fd, rmt->direct.sendseal);
+	rmt->direct.sendseal = NULL;
+	rmt->direct.state = DT_SWITCHING;
+
+	/* Give the remote a frame to recognize our connection by right away */
+	send_ping(rmt);
+}
+
+/*
+ * Set up a UDP socket for sending motion datagrams to the given address
+ * (from a remote's READY), to be handed to its msgchan along with the
+ * transport switch.
+ */
+static void open_motion_socket(struct remote* rmt, const char* addr,
+                               const char* port)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo* ai;
+	int fd;
+
+	if (getaddrinfo(addr, port, &hints, &ai)) {
+		warn("%s: bad motion-channel address %s:%s\n", rmt->node.name,
+		     addr, port);
+		return;
+	}
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+
+	if (fd < 0) {
+		warn("%s: failed to set up motion channel: %s\n", rmt->node.name,
+		     strerror(errno));
+		return;
+	}
+
+	set_fd_cloexec(fd, 1);
+	rmt->direct.motionfd = fd;
+}
+
+/* Start connecting to the direct-transport address a remote gave us. */
+static void start_direct_connect(struct remote* rmt, const char* addr,
+                                 const char* port)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo* ai;
+	int status, fd;
+
+	status = getaddrinfo(addr, port, &hints, &ai);
+	if (status) {
+		warn("%s: bad direct-transport address %s:%s (%s)\n",
+		     rmt->node.name, addr, port, gai_strerror(status));
+		clear_direct_transport(rmt);
+		return;
+	}
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0) {
+		warn("socket: %s\n", strerror(errno));
+		freeaddrinfo(ai);
+		clear_direct_transport(rmt);
+		return;
+	}
+
+	set_fd_nonblock(fd, 1);
+	set_fd_cloexec(fd, 1);
+	set_tcp_nodelay(fd);
+
+	status = connect(fd, ai->ai_addr, ai->ai_addrlen);
+	freeaddrinfo(ai);
+	if (status && errno != EINPROGRESS) {
+		warn("%s: direct connection to %s:%s failed (%s), staying on ssh\n",
+		     rmt->node.name, addr, port, strerror(errno));
+		close(fd);
+		clear_direct_transport(rmt);
+		return;
+	}
+
+	vinfo("%s: connecting to %s:%s for direct transport\n", rmt->node.name,
+	      addr, port);
+
+	rmt->direct.fd = fd;
+	rmt->direct.mon = fdmon_register_fd(fd, NULL, direct_connect_cb, rmt);
+	fdmon_monitor(rmt->direct.mon, FM_WRITE);
+	rmt->direct.state = DT_CONNECTING;
+}
+
+/* Handle a remote's TRANSPORTSWITCH, completing the move to direct transport. */
+static void finish_direct_switch(struct remote* rmt)
+{
+	if (rmt->direct.state != DT_SWITCHING) {
+		fail_remote(rmt, "unexpected TRANSPORTSWITCH message");
+		return;
+	}
+
+	if (mc_switch_recv(&rmt->msgchan, rmt->direct.fd, rmt->direct.recvseal)) {
+		fail_remote(rmt, "data after TRANSPORTSWITCH");
+		return;
+	}
+
+	rmt->direct.recvseal = NULL;
+	rmt->direct.fd = -1;
+	rmt->direct.state = DT_ACTIVE;
+
+	if (rmt->direct.motionfd >= 0) {
+		mc_set_motion_send(&rmt->msgchan, rmt->direct.motionfd,
+		                   rmt->direct.motionseal);
+		rmt->direct.motionfd = -1;
+		rmt->direct.motionseal = NULL;
+	}
+
+	info("%s: switched to direct transport%s\n", rmt->node.name,
+	     rmt->msgchan.motion.sending ? " (with UDP motion)" : "");
+}
+#endif
+
+/* Act on the feature acceptances in a remote's READY message. */
+static void handle_ready_params(struct remote* rmt, const struct message* msg)
+{
+	struct kvmap* params;
+	const char* compression;
+#ifdef HAVE_OPENSSL
+	const char* transport;
+#endif
+
+	params = unflatten_kvmap(MB(msg, ready).params.params_val,
+	                         MB(msg, ready).params.params_len);
+
+	xfree(rmt->session.id);
+	xfree(rmt->session.token);
+	rmt->session.id = NULL;
+	rmt->session.token = NULL;
+	if (kvmap_get(params, "session-id") && kvmap_get(params, "session-token")) {
+		rmt->session.id = xstrdup(kvmap_get(params, "session-id"));
+		rmt->session.token = xstrdup(kvmap_get(params, "session-token"));
+		if (kvmap_get(params, "resumed"))
+			info("%s: resumed existing session\n", rmt->node.name);
+	}
+
+	rmt->clipboard_watched = !!kvmap_get(params, "clipboard-ownership");
+
+	compression = kvmap_get(params, "clipboard-compression");
+	if (compression && !strcmp(compression, "zlib")) {
+		vinfo("%s: compressing clipboard transfers\n", rmt->node.name);
+		rmt->msgchan.compress_clipboard = 1;
+	}
+
+#ifdef HAVE_OPENSSL
+	transport = kvmap_get(params, "direct-transport");
+	if (rmt->direct.state == DT_OFFERED && transport && !strcmp(transport, "tcp")
+	    && kvmap_get(params, "direct-transport-addr")
+	    && kvmap_get(params, "direct-transport-port")) {
+		if (rmt->direct.motionseal && kvmap_get(params, "direct-motion-port"))
+			open_motion_socket(rmt, kvmap_get(params, "direct-transport-addr"),
+			                   kvmap_get(params, "direct-motion-port"));
+		start_direct_connect(rmt, kvmap_get(params, "direct-transport-addr"),
+		                     kvmap_get(params, "direct-transport-port"));
+	} else {
+		clear_direct_transport(rmt);
+	}
+#endif
+
+	destroy_kvmap(params);
+}
+
+static void handle_message(struct remote* rmt, struct message* msg)
 {
 	int loglen;
 	char* logmsg;
@@ -1178,20 +1942,39 @@ static void handle_message(struct remote* rmt, const struct message* msg)
 		}
 		rmt->state = CS_CONNECTED;
 		rmt->failcount = 0;
-		info("remote %s becomes ready.\n", rmt->node.name);
+		info("remote %s becomes ready (%.3fs).\n", rmt->node.name,
+		     (double)(get_microtime() - rmt->setup_start) / 1000000.0);
 		vinfo("%s screen dimensions: %ux%u\n", rmt->node.name,
 		      MB(msg, ready).screendim.x.max, MB(msg, ready).screendim.y.max);
 		rmt->node.dimensions = MB(msg, ready).screendim;
+		/* A fresh remote starts out with no edge state reported */
+		rmt->node.edgemask = 0;
+		start_heartbeat(rmt);
+		handle_ready_params(rmt, msg);
 		if (config->focus_hint.type == FH_DIM_INACTIVE)
-			transition_brightness(&rmt->node, 1.0, config->focus_hint.brightness,
-			                      config->focus_hint.duration,
-			                      config->focus_hint.fade_steps);
+			fade_brightness(&rmt->node, 1.0, config->focus_hint.brightness,
+			                config->focus_hint.duration,
+			                config->focus_hint.fade_steps);
 		break;
 
 	case MT_SETCLIPBOARD:
-		set_clipboard_text(MB(msg, setclipboard).text);
+		hash_clipboard(MB(msg, setclipboard).text, &rmt->clipboard);
+		rmt->clipboard_known = 1;
+		set_clipboard_text_owned(MB(msg, setclipboard).text);
+		MB(msg, setclipboard).text = NULL;
+		if (focused_node->remote)
+			push_clipboard(focused_node->remote);
+		break;
+
+	case MT_CLIPBOARDUNCHANGED:
+		/* The master's clipboard is already up to date */
 		if (focused_node->remote)
-			send_setclipboard(focused_node->remote, get_clipboard_text());
+			push_clipboard(focused_node->remote);
+		break;
+
+	case MT_CLIPBOARDLOST:
+		/* Whatever it has now, it's not what we last knew of */
+		rmt->clipboard_known = 0;
 		break;
 
 	case MT_LOGMSG:
@@ -1205,10 +1988,24 @@ static void handle_message(struct remote* rmt, const struct message* msg)
 		           logmsg[loglen-1] == '\n' ? "" : "\n");
 		break;
 
+	case MT_PONG:
+		handle_pong(rmt, &MB(msg, pong));
+		break;
+
 	case MT_MOUSEPOS:
+		if (rmt->moverel_sent) {
+			hist_record(&rmt->stats.rtt, get_microtime() - rmt->moverel_sent);
+			rmt->moverel_sent = 0;
+		}
 		check_edgeevents(&rmt->node, MB(msg, mousepos).pt);
 		break;
 
+#ifdef HAVE_OPENSSL
+	case MT_TRANSPORTSWITCH:
+		finish_direct_switch(rmt);
+		break;
+#endif
+
 	default:
 		fail_remote(rmt, "unexpected message type");
 		break;
@@ -1389,6 +2186,89 @@ static void exitsig_handler(int signo)
 	exit(0);
 }
 
+/*
+ * SIGUSR1 requests a stats dump, which its handler passes on via a pipe to
+ * be done from the event loop.
+ */
+static int statsig_pipe[2] = { -1, -1, };
+
+static void statsig_handler(int signo)
+{
+	int saved_errno = errno;
+	char c = 0;
+	ssize_t status;
+
+	/* A full pipe means a dump's already pending; other failures just drop it */
+	status = write(statsig_pipe[1], &c, 1);
+	(void)status;
+
+	errno = saved_errno;
+}
+
+static void dump_stats(void)
+{
+	struct remote* rmt;
+
+	if (!config->stats) {
+		log_direct("stats collection is disabled (see the 'stats' option)\n");
+		return;
+	}
+
+	log_direct("stats: event loop:\n");
+	dump_histogram(log_direct, "  ", "busy time", &evloop_busy);
+
+	for_each_remote (rmt) {
+		log_direct("stats: remote %s (%s):\n", rmt->node.name,
+		           rmt->state == CS_CONNECTED ? "connected" : "not connected");
+		if (rmt->state == CS_CONNECTED && rmt->heartbeat.srtt)
+			log_direct("  smoothed RTT: %.3fms\n",
+			           (double)rmt->heartbeat.srtt / 1000.0);
+		dump_mcstats(log_direct, "  ", &rmt->stats);
+	}
+}
+
+static void statsig_read_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	char buf[64];
+
+	while (read(statsig_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	dump_stats();
+}
+
+static void setup_stats_signal(void)
+{
+	static struct sigaction sigact = {
+		.sa_handler = statsig_handler,
+		.sa_flags = SA_RESTART,
+	};
+	struct fdmon_ctx* mon;
+	int i;
+
+	if (pipe(statsig_pipe)) {
+		initerr("Warning: pipe() failed (%s), SIGUSR1 stats dumps disabled\n",
+		        strerror(errno));
+		/* ...rather than leaving it to kill us */
+		signal(SIGUSR1, SIG_IGN);
+		return;
+	}
+
+	for (i = 0; i < 2; i++) {
+		set_fd_nonblock(statsig_pipe[i], 1);
+		set_fd_cloexec(statsig_pipe[i], 1);
+	}
+
+	mon = fdmon_register_fd(statsig_pipe[0], statsig_read_cb, NULL, NULL);
+	fdmon_monitor(mon, FM_READ);
+
+	sigemptyset(&sigact.sa_mask);
+
+	if (sigaction(SIGUSR1, &sigact, NULL))
+		initerr("Warning: failed to set signal handler for signal %d (%s)\n",
+		        SIGUSR1, strsignal(SIGUSR1));
+}
+
 static void setup_signal_handlers(void)
 {
 	int i;
@@ -1405,6 +2285,8 @@ static void setup_signal_handlers(void)
 			initerr("Warning: failed to set signal handler for signal %d (%s)\n",
 			        exitsigs[i], strsignal(exitsigs[i]));
 	}
+
+	setup_stats_signal();
 }
 
 static void usage(FILE* out)
@@ -1483,6 +2365,13 @@ int main(int argc, char** argv)
 		exit(1);
 	fclose(cfgfile);
 
+	stats_enabled = config->stats;
+
+#ifndef HAVE_OPENSSL
+	if (config->direct_transport)
+		initerr("Warning: built without OpenSSL, ignoring direct-transport\n");
+#endif
+
 	ssh_pubkey_setup();
 
 	init_logfile();
@@ -1501,6 +2390,9 @@ int main(int argc, char** argv)
 	focused_node = &config->master;
 	last_focused_node = focused_node;
 
+	if (config->trace_file && trace_start(config->trace_file, config->remotes))
+		exit(1);
+
 	for_each_remote (rmt)
 		setup_remote(rmt);
 
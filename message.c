@@ -2,12 +2,14 @@
 #include <errno.h>
 #include <stdint.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <math.h>
 
 #include <assert.h>
 
 #include "misc.h"
 #include "message.h"
+#include "seal.h"
 
 /*
  * glibc's xdr routines use char*, BSD/OSX use void*.  Solarish appears to use
@@ -64,6 +66,88 @@ static size_t xdr_msgbody_len(const struct message* msg)
 	return pos;
 }
 
+/*
+ * Message & buffer pools
+ * ======================
+ *
+ * Input events generate a steady stream of small, short-lived allocations
+ * (message structs, encmsgs for those broadcast to several remotes, and
+ * wire-format buffers for the messages that don't take the fixed-size fast
+ * path); rather than going back to the heap for each of them we recycle them
+ * via simple freelists.  Buffers above MSGBUF_POOL_SIZE
+ * (in practice, clipboard contents) are allocated and freed normally.
+ */
+
+/* Upper bounds on the number of idle objects we'll hold on to */
+#define MSG_POOL_MAX 256
+#define MSGBUF_POOL_MAX 64
+#define ENCMSG_POOL_MAX 64
+
+static struct message* msg_pool;
+static unsigned int msg_pool_len;
+
+union pooled_encmsg {
+	union pooled_encmsg* next;
+	struct encmsg em;
+};
+
+static union pooled_encmsg* encmsg_pool;
+static unsigned int encmsg_pool_len;
+
+union pooled_msgbuf {
+	union pooled_msgbuf* next;
+	char data[MSGBUF_POOL_SIZE];
+};
+
+static union pooled_msgbuf* msgbuf_pool;
+static unsigned int msgbuf_pool_len;
+
+/*
+ * Allocate a buffer of at least len bytes.  Returns NULL on failure (which
+ * can only happen for large sizes).
+ */
+void* alloc_msgbuf(size_t len)
+{
+	union pooled_msgbuf* pb;
+
+	if (len > MSGBUF_POOL_SIZE)
+		return malloc(len);
+
+	if (!msgbuf_pool)
+		return xmalloc(sizeof(*pb));
+
+	pb = msgbuf_pool;
+	msgbuf_pool = pb->next;
+	msgbuf_pool_len -= 1;
+
+	return pb;
+}
+
+/*
+ * Release a buffer obtained from alloc_msgbuf(); len must be no greater than
+ * the size it was allocated with, but must cover all of the data written to
+ * it, since (as buffers may contain keystrokes or clipboard contents) that
+ * part gets wiped.
+ */
+void release_msgbuf(void* buf, size_t len)
+{
+	union pooled_msgbuf* pb = buf;
+
+	if (!buf)
+		return;
+
+	explicit_bzero(buf, len);
+
+	if (len > MSGBUF_POOL_SIZE || msgbuf_pool_len >= MSGBUF_POOL_MAX) {
+		xfree(buf);
+		return;
+	}
+
+	pb->next = msgbuf_pool;
+	msgbuf_pool = pb;
+	msgbuf_pool_len += 1;
+}
+
 /*
  * Wire protocol
  * =============
@@ -81,15 +165,130 @@ static size_t xdr_msgbody_len(const struct message* msg)
  * async-IO/O_NOBLOCK/select(2)-based event-loop IO scheme.
  */
 
+/* Store a u32 in network byte order (which is also its XDR encoding). */
+static inline char* put_u32(char* p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+/*
+ * Fast path for the small, constant-size message types that make up the
+ * bulk of the traffic: write out their XDR encoding by hand directly into
+ * ps->fixbuf, avoiding the sizing pass and heap allocation of the generic
+ * path.  The bytes produced are identical to what xdr_msgbody() would
+ * generate.  Returns zero (having done nothing) if the message isn't of one
+ * of these types.
+ */
+int unparse_fixed_message(const struct message* msg, struct partsend* ps)
+{
+	char* p = ps->fixbuf + MSGHDR_SIZE;
+	uint32_t fbits;
+
+	/* XDR floats are IEEE single-precision, encoded like a u32 */
+	_Static_assert(sizeof(float) == sizeof(uint32_t), "unexpected float size");
+
+	switch (msg->body.type) {
+	case MT_MOVEREL:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, moverel).dx);
+		p = put_u32(p, MB(msg, moverel).dy);
+		break;
+
+	case MT_MOVEABS:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, moveabs).pt.x);
+		p = put_u32(p, MB(msg, moveabs).pt.y);
+		break;
+
+	case MT_MOUSEPOS:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, mousepos).pt.x);
+		p = put_u32(p, MB(msg, mousepos).pt.y);
+		break;
+
+	case MT_CLICKEVENT:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, clickevent).button);
+		p = put_u32(p, MB(msg, clickevent).pressrel);
+		break;
+
+	case MT_KEYEVENT:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, keyevent).keycode);
+		p = put_u32(p, MB(msg, keyevent).pressrel);
+		break;
+
+	case MT_SCROLL:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, scroll).amount);
+		break;
+
+	case MT_SETBRIGHTNESS:
+		memcpy(&fbits, &MB(msg, setbrightness).brightness, sizeof(fbits));
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, fbits);
+		break;
+
+	case MT_CLIPBEGIN:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, clipbegin).length);
+		p = put_u32(p, MB(msg, clipbegin).encoding);
+		break;
+
+	case MT_CLIPEND:
+		p = put_u32(p, msg->body.type);
+		break;
+
+	case MT_MOTION:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, motion).epoch);
+		p = put_u32(p, MB(msg, motion).dx);
+		p = put_u32(p, MB(msg, motion).dy);
+		break;
+
+	case MT_MOTIONBARRIER:
+		p = put_u32(p, msg->body.type);
+		p = put_u32(p, MB(msg, motionbarrier).epoch);
+		p = put_u32(p, MB(msg, motionbarrier).dx);
+		p = put_u32(p, MB(msg, motionbarrier).dy);
+		p = put_u32(p, !!MB(msg, motionbarrier).hold);
+		break;
+
+	default:
+		return 0;
+	}
+
+	assert(p <= ps->fixbuf + sizeof(ps->fixbuf));
+
+	ps->buf = ps->fixbuf;
+	ps->len = p - ps->fixbuf;
+	put_u32(ps->fixbuf, ps->len - MSGHDR_SIZE);
+
+	return 1;
+}
+
 /* Flatten a message struct into a wire-protocol format byte array */
 void unparse_message(const struct message* msg, struct partsend* ps)
 {
 	XDR xdrs;
 	unsigned int pos;
-	size_t xdrlen = xdr_msgbody_len(msg);
+	size_t xdrlen;
+
+	ps->shared = NULL;
+
+	if (unparse_fixed_message(msg, ps))
+		return;
+
+	xdrlen = xdr_msgbody_len(msg);
 
-	ps->len = xdrlen + MSGHDR_SIZE;
-	ps->buf = xmalloc(ps->len);
+	ps->len = ps->bufsize = xdrlen + MSGHDR_SIZE;
+	ps->buf = alloc_msgbuf(ps->bufsize);
+	if (!ps->buf) {
+		perror("malloc");
+		abort();
+	}
 	*(uint32_t*)ps->buf = htonl(xdrlen);
 
 	xdrmem_create(&xdrs, ps->buf + MSGHDR_SIZE, xdrlen, XDR_ENCODE);
@@ -101,11 +300,13 @@ void unparse_message(const struct message* msg, struct partsend* ps)
 
 	pos = xdr_getpos(&xdrs);
 
-	/* This is probably always the case.  See comment on xdr_msgbody_len(). */
+	/*
+	 * This is probably always the case.  See comment on xdr_msgbody_len().
+	 * (The excess allocation is harmless; it goes away with the buffer.)
+	 */
 	if (pos != xdrlen) {
 		assert(pos < xdrlen);
 		ps->len = pos + MSGHDR_SIZE;
-		ps->buf = xrealloc(ps->buf, ps->len);
 		*(uint32_t*)ps->buf = htonl(pos);
 	}
 
@@ -113,68 +314,180 @@ void unparse_message(const struct message* msg, struct partsend* ps)
 }
 
 /*
- * Drain data in the given partsend buffer out via the given file descriptor.
- * Returns 1 if the buffer is successfully emptied, 0 if data remains and
- * further writes to the file descriptor would block, and negative on error.
+ * Drain data in the given sequence of partsend buffers out via the given file
+ * descriptor, gathering as many of them as possible into each writev(2).
+ * Buffers are emptied strictly in order, so a short write leaves the first
+ * non-empty one (only) partially sent.  Returns the number of buffers (from
+ * the start of the sequence) completely emptied -- if less than n, further
+ * writes to the file descriptor would block -- or negative on error.
  */
-int drain_msgbuf(int fd, struct partsend* ps)
+int drain_msgbufs(int fd, struct partsend* const* bufs, unsigned int n)
 {
+	struct iovec iov[MAX_DRAIN_BUFS];
+	unsigned int i, done = 0;
 	ssize_t status;
+	size_t left;
+
+	assert(n <= MAX_DRAIN_BUFS);
 
-	while (ps->bytes_sent < ps->len) {
-		status = write(fd, ps->buf + ps->bytes_sent,
-		               ps->len - ps->bytes_sent);
+	while (done < n) {
+		for (i = done; i < n; i++) {
+			iov[i - done].iov_base = bufs[i]->buf + bufs[i]->bytes_sent;
+			iov[i - done].iov_len = bufs[i]->len - bufs[i]->bytes_sent;
+		}
+
+		status = writev(fd, iov, n - done);
 		if (status < 0) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
-				return 0;
+				break;
 			else
 				return -errno;
 		}
-		ps->bytes_sent += status;
+
+		/* Credit the bytes written to the buffers they came from */
+		for (; done < n; done++) {
+			left = bufs[done]->len - bufs[done]->bytes_sent;
+			if (status < left) {
+				bufs[done]->bytes_sent += status;
+				break;
+			}
+			status -= left;
+			clear_msgbuf(bufs[done]);
+		}
 	}
 
-	xfree(ps->buf);
+	return done;
+}
+
+/* Discard any data in the given partsend buffer, releasing its memory. */
+void clear_msgbuf(struct partsend* ps)
+{
+	/* fixbuf may hold a KEYEVENT; see wipe_message() */
+	if (ps->shared)
+		encmsg_unref(ps->shared);
+	else if (ps->buf == ps->fixbuf)
+		explicit_bzero(ps->fixbuf, sizeof(ps->fixbuf));
+	else
+		release_msgbuf(ps->buf, ps->bufsize);
 	ps->buf = NULL;
+	ps->bufsize = 0;
 	ps->len = 0;
 	ps->bytes_sent = 0;
-
-	return 1;
+	ps->shared = NULL;
 }
 
 /*
- * Try to read a message (or the remainder of a partially-received one) into
- * the given partrecv buffer from the given file descriptor.  Returns 1 if the
- * buffer has been filled with a complete message, 0 if the message is
- * incomplete and further reads on the file descriptor would block, and
- * negative on error.
+ * Encode a message into a new encmsg (with a single reference, owned by the
+ * caller).  The message itself is left untouched.  For the fixed-size types
+ * (input events, mostly) this involves no heap allocation at all, barring
+ * the encmsg pool running dry: the encoding goes in the encmsg's own fixbuf.
  */
-int fill_msgbuf(int fd, struct partrecv* pr)
+struct encmsg* encode_message(const struct message* msg)
 {
-	ssize_t status, to_read;
-	uint32_t msgsize;
-	void* hdrbuf;
+	union pooled_encmsg* pe;
+	struct encmsg* em;
 
-	while (pr->bytes_recvd < MSGHDR_SIZE) {
-		status = read(fd, pr->hdrbuf + pr->bytes_recvd,
-		              MSGHDR_SIZE - pr->bytes_recvd);
-		if (status < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK)
-				return 0;
-			else
-				return -errno;
-		} else if (status == 0) {
-			return -EINVAL;
-		}
-		pr->bytes_recvd += status;
+	if (encmsg_pool) {
+		pe = encmsg_pool;
+		encmsg_pool = pe->next;
+		encmsg_pool_len -= 1;
+	} else {
+		pe = xmalloc(sizeof(*pe));
 	}
+	em = &pe->em;
+
+	em->refs = 1;
+	em->type = msg->body.type;
+	unparse_message(msg, &em->ps);
 
-	hdrbuf = pr->hdrbuf;
-	msgsize = ntohl(*(uint32_t*)hdrbuf);
+	/* If it went in fixbuf, buf now points into em itself (which is fine) */
+	return em;
+}
 
-	to_read = msgsize - (pr->bytes_recvd - MSGHDR_SIZE);
+struct encmsg* encmsg_ref(struct encmsg* em)
+{
+	em->refs += 1;
+	return em;
+}
 
-	if (!pr->plbuf) {
-		assert(pr->bytes_recvd == MSGHDR_SIZE);
+void encmsg_unref(struct encmsg* em)
+{
+	union pooled_encmsg* pe = (union pooled_encmsg*)em;
+
+	assert(em->refs > 0);
+
+	if (--em->refs)
+		return;
+
+	clear_msgbuf(&em->ps);
+
+	if (encmsg_pool_len >= ENCMSG_POOL_MAX) {
+		xfree(pe);
+		return;
+	}
+
+	pe->next = encmsg_pool;
+	encmsg_pool = pe;
+	encmsg_pool_len += 1;
+}
+
+/*
+ * Create a message (for enqueuing like any other) that will be sent in the
+ * given encoded form, taking a new reference on it.
+ *
+ * Note that since a shared message is sent as the single frame it was
+ * encoded into, a SETCLIPBOARD shared this way bypasses the chunked
+ * streaming (and compression) msgchans otherwise apply to large clipboard
+ * contents; msgchan.c asserts that it's no bigger than a single chunk, so
+ * larger ones must be sent to each remote as a message of its own.
+ */
+struct message* share_message(struct encmsg* em)
+{
+	struct message* msg = new_message(em->type);
+
+	msg->encoded = encmsg_ref(em);
+
+	return msg;
+}
+
+/*
+ * Point an (empty) partsend buffer at an encmsg's data, taking a new
+ * reference on it to be dropped when the buffer is cleared.
+ */
+void share_msgbuf(struct encmsg* em, struct partsend* ps)
+{
+	ps->buf = em->ps.buf;
+	ps->len = em->ps.len;
+	ps->bufsize = 0;
+	ps->bytes_sent = 0;
+	ps->shared = encmsg_ref(em);
+}
+
+/* Load a u32 in network byte order from a (possibly unaligned) address. */
+static inline uint32_t get_u32(const char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+/*
+ * Make sure the given partrecv buffer has space to read more data into,
+ * including (if its header has arrived) all of the frame currently being
+ * received.  Returns zero on success, negative on failure.
+ */
+static int make_recvbuf_room(struct partrecv* pr)
+{
+	size_t pending = pr->end - pr->start;
+	size_t need = MSGHDR_SIZE;
+	char* newbuf;
+
+	if (pending >= MSGHDR_SIZE)
+		need += get_u32(pr->buf + pr->start);
+
+	if (need > pr->size || !pr->buf) {
+		if (need < RECVBUF_SIZE)
+			need = RECVBUF_SIZE;
 		/*
 		 * NOTE: malloc() instead of xmalloc() here is intentional.
 		 * This allocation size is taken directly from raw input from
@@ -193,59 +506,153 @@ int fill_msgbuf(int fd, struct partrecv* pr)
 		 * really achieve that without breaking into the XDR black
 		 * box.
 		 */
-		pr->plbuf = malloc(msgsize);
-		if (!pr->plbuf)
+		newbuf = malloc(need);
+		if (!newbuf)
 			return -ENOMEM;
+		if (pr->buf) {
+			memcpy(newbuf, pr->buf + pr->start, pending);
+			explicit_bzero(pr->buf + pr->start, pending);
+			xfree(pr->buf);
+		}
+		pr->buf = newbuf;
+		pr->size = need;
+		pr->start = 0;
+		pr->end = pending;
+	} else if (pr->start + need > pr->size) {
+		/* Slide the partial frame down to the start of the buffer */
+		memmove(pr->buf, pr->buf + pr->start, pending);
+		if (pr->end > pending)
+			explicit_bzero(pr->buf + pending, pr->end - pending);
+		pr->start = 0;
+		pr->end = pending;
 	}
 
-	while (to_read > 0) {
-		status = read(fd, pr->plbuf + (pr->bytes_recvd - MSGHDR_SIZE), to_read);
-		if (status < 0) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK)
-				return 0;
-			else
-				return -errno;
-		} else if (status == 0) {
-			return -EINVAL;
-		}
-		pr->bytes_recvd += status;
-		to_read -= status;
+	return 0;
+}
+
+/*
+ * Read as much data as is available (and fits) into the given partrecv
+ * buffer from the given file descriptor.  Returns 1 if some data was read, 0
+ * if further reads on the file descriptor would block, and negative on error
+ * (including EOF).
+ */
+int fill_msgbuf(int fd, struct partrecv* pr)
+{
+	ssize_t status;
+
+	status = make_recvbuf_room(pr);
+	if (status)
+		return status;
+
+	status = read(fd, pr->buf + pr->end, pr->size - pr->end);
+	if (status < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		else
+			return -errno;
+	} else if (status == 0) {
+		return -EINVAL;
 	}
 
+	pr->end += status;
+
 	return 1;
 }
 
 /*
- * "Unflatten" the wire-protocol byte array in the given partrecv buffer into
- * a message struct, returning zero on success and negative on error.
+ * Decode an XDR-encoded message body (len bytes at buf) into a message
+ * struct.  Returns zero on success, negative on failure.
  */
-int parse_message(struct partrecv* pr, struct message* msg)
+int decode_message(char* buf, uint32_t len, struct message* msg)
 {
 	XDR xdrs;
 
-	xdrmem_create(&xdrs, pr->plbuf, pr->bytes_recvd - MSGHDR_SIZE, XDR_DECODE);
+	xdrmem_create(&xdrs, buf, len, XDR_DECODE);
 	if (!xdr_msgbody(&xdrs, &msg->body)) {
-		fprintf(stderr, "xdr_msgbody() failed in parse_message() (invalid input?)\n");
+		xdr_destroy(&xdrs);
 		return -1;
 	}
 	msg->from_xdr = 1;
+	msg->encoded = NULL;
 	xdr_destroy(&xdrs);
 
-	xfree(pr->plbuf);
-	pr->plbuf = NULL;
-	pr->bytes_recvd = 0;
-
 	return 0;
 }
 
+/*
+ * "Unflatten" the next complete frame in the given partrecv buffer into a
+ * message struct, first opening it with the given seal if non-NULL.  Returns
+ * 1 if a message was parsed, 0 if the buffer does not (yet) hold a complete
+ * frame, and negative on error.
+ */
+int parse_message(struct partrecv* pr, struct message* msg, struct seal* seal)
+{
+	uint32_t msgsize, bodylen;
+	size_t avail = pr->end - pr->start;
+	char* frame = pr->buf + pr->start;
+
+	if (avail < MSGHDR_SIZE)
+		return 0;
+
+	msgsize = get_u32(frame);
+	if (avail - MSGHDR_SIZE < msgsize)
+		return 0;
+
+	bodylen = msgsize;
+#ifdef HAVE_OPENSSL
+	if (seal && open_frame(seal, frame, &bodylen)) {
+		fprintf(stderr, "open_frame() failed in parse_message() (forged or corrupted input?)\n");
+		return -1;
+	}
+#endif
+
+	if (decode_message(frame + MSGHDR_SIZE, bodylen, msg)) {
+		fprintf(stderr, "xdr_msgbody() failed in parse_message() (invalid input?)\n");
+		return -1;
+	}
+
+	/* The raw frame may contain keystrokes or clipboard contents */
+	explicit_bzero(frame, MSGHDR_SIZE + msgsize);
+	pr->start += MSGHDR_SIZE + msgsize;
+
+	if (pr->start == pr->end) {
+		pr->start = pr->end = 0;
+		/* Don't hang on to an oversized buffer after a large message */
+		if (pr->size > RECVBUF_SIZE)
+			clear_recvbuf(pr);
+	}
+
+	return 1;
+}
+
+/* Discard any data in the given partrecv buffer, releasing its memory. */
+void clear_recvbuf(struct partrecv* pr)
+{
+	if (pr->buf)
+		explicit_bzero(pr->buf + pr->start, pr->end - pr->start);
+	xfree(pr->buf);
+	pr->buf = NULL;
+	pr->size = 0;
+	pr->start = pr->end = 0;
+}
+
 /* Allocate and return a new message of the given type. */
 struct message* new_message(msgtype_t type)
 {
-	struct message* msg = xmalloc(sizeof(*msg));
+	struct message* msg;
+
+	if (msg_pool) {
+		msg = msg_pool;
+		msg_pool = msg->next;
+		msg_pool_len -= 1;
+	} else {
+		msg = xmalloc(sizeof(*msg));
+	}
 
 	msg->body.type = type;
 	msg->next = NULL;
 	msg->from_xdr = 0;
+	msg->encoded = NULL;
 
 	return msg;
 }
@@ -258,8 +665,14 @@ static void wipe_message(struct message* msg)
 
 	switch (msg->body.type) {
 	case MT_SETCLIPBOARD:
+		/* The recipient may have taken ownership of the text */
 		p = MB(msg, setclipboard).text;
-		sz = strlen(p);
+		sz = p ? strlen(p) : 0;
+		break;
+
+	case MT_CLIPCHUNK:
+		p = MB(msg, clipchunk).data.data_val;
+		sz = MB(msg, clipchunk).data.data_len;
 		break;
 
 	case MT_KEYEVENT:
@@ -267,6 +680,12 @@ static void wipe_message(struct message* msg)
 		sz = sizeof(MB(msg, keyevent).keycode);
 		break;
 
+	case MT_EVENTBATCH:
+		p = MB(msg, eventbatch).events.events_val;
+		sz = MB(msg, eventbatch).events.events_len
+			* sizeof(*MB(msg, eventbatch).events.events_val);
+		break;
+
 	default:
 		break;
 	}
@@ -275,13 +694,30 @@ static void wipe_message(struct message* msg)
 		explicit_bzero(p, sz);
 }
 
+/* Free an array of kvpairs as produced by flatten_kvmap(). */
+static void free_kvpairs(struct kvpair* pairs, u_int numpairs)
+{
+	u_int i;
+
+	for (i = 0; i < numpairs; i++) {
+		xfree(pairs[i].key);
+		xfree(pairs[i].value);
+	}
+	xfree(pairs);
+}
+
 /*
  * Free any dynamically-allocated members of the given message, but not the
  * message itself (e.g. for stack-allocated messages).
  */
 void free_msgbody(struct message* msg)
 {
-	int i;
+	/* Nothing in the body beyond its type */
+	if (msg->encoded) {
+		encmsg_unref(msg->encoded);
+		msg->encoded = NULL;
+		return;
+	}
 
 	wipe_message(msg);
 
@@ -293,18 +729,30 @@ void free_msgbody(struct message* msg)
 			xfree(MB(msg, setclipboard).text);
 			break;
 
+		case MT_CLIPCHUNK:
+			xfree(MB(msg, clipchunk).data.data_val);
+			break;
+
 		case MT_SETUP:
-			for (i = 0; i < MB(msg, setup).params.params_len; i++) {
-				xfree(MB(msg, setup).params.params_val[i].key);
-				xfree(MB(msg, setup).params.params_val[i].value);
-			}
-			xfree(MB(msg, setup).params.params_val);
+			free_kvpairs(MB(msg, setup).params.params_val,
+			             MB(msg, setup).params.params_len);
+			break;
+
+		case MT_READY:
+			free_kvpairs(MB(msg, ready).params.params_val,
+			             MB(msg, ready).params.params_len);
 			break;
 
 		case MT_LOGMSG:
 			xfree(MB(msg, logmsg).msg);
 			break;
 
+		case MT_EVENTBATCH:
+			release_msgbuf(MB(msg, eventbatch).events.events_val,
+			               MB(msg, eventbatch).events.events_len
+			               * sizeof(*MB(msg, eventbatch).events.events_val));
+			break;
+
 		default:
 			break;
 		}
@@ -315,7 +763,15 @@ void free_msgbody(struct message* msg)
 void free_message(struct message* msg)
 {
 	free_msgbody(msg);
-	xfree(msg);
+
+	if (msg_pool_len >= MSG_POOL_MAX) {
+		xfree(msg);
+		return;
+	}
+
+	msg->next = msg_pool;
+	msg_pool = msg;
+	msg_pool_len += 1;
 }
 
 /* Would be nice if there were some easy way to generate this from proto.x... */
@@ -332,9 +788,25 @@ static const char* const msgtype_names[] = {
 	MTN(SETCLIPBOARD),
 	MTN(LOGMSG),
 	MTN(SETBRIGHTNESS),
+	MTN(EVENTBATCH),
+	MTN(CLIPBEGIN),
+	MTN(CLIPCHUNK),
+	MTN(CLIPEND),
+	MTN(CHECKCLIPBOARD),
+	MTN(CLIPBOARDUNCHANGED),
+	MTN(TRANSPORTSWITCH),
+	MTN(MOTION),
+	MTN(MOTIONBARRIER),
+	MTN(SCROLL),
+	MTN(PING),
+	MTN(PONG),
+	MTN(CLIPPENDING),
+	MTN(CLIPBOARDLOST),
 #undef MTN
 };
 
+_Static_assert(ARR_LEN(msgtype_names) == NUM_MSGTYPES, "NUM_MSGTYPES out of date");
+
 const char* msgtype_name(msgtype_t type)
 {
 	const char* name = type >= ARR_LEN(msgtype_names) ? "???" : msgtype_names[type];
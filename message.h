@@ -9,7 +9,7 @@
 
 #include "proto.h"
 
-#define PROT_VERSION 0
+#define PROT_VERSION 8
 
 struct message {
 	struct msgbody body;
@@ -21,43 +21,121 @@ struct message {
 	 */
 	int from_xdr;
 
+	/*
+	 * If non-NULL, the message's already-encoded form (see encmsg below),
+	 * which is what gets sent; only body.type is then valid in body.
+	 */
+	struct encmsg* encoded;
+
 	/* For linking into a list (doesn't exist on the wire) */
 	struct message* next;
 };
 
+/* Limit a SCROLL amount to +/- SCROLL_MAX_NOTCHES notches */
+static inline int32_t clamp_scroll(int64_t amount)
+{
+	const int64_t max = SCROLL_MAX_NOTCHES * SCROLL_NOTCH;
+
+	return amount > max ? max : amount < -max ? -max : amount;
+}
+
 /* Shorthand macro for accessing message body members */
 #define MB(m, t) ((m)->body.msgbody_u.t)
 
-/*
- * How many bytes we will always unconditionally read at the start of a
- * message (the initial fixed-size part).
- */
+/* Size of the length descriptor at the start of each message */
 #define MSGHDR_SIZE (sizeof(uint32_t))
 
-/* Buffer used for storing an incoming (possibly incomplete) message */
+/* Default size of a partrecv buffer (grown as needed for larger messages) */
+#define RECVBUF_SIZE (16 * 1024)
+
+/*
+ * Read-ahead buffer for incoming data, which may hold any number of complete
+ * messages followed by a partial one.  Unparsed data lies between start and
+ * end.
+ */
 struct partrecv {
-	char hdrbuf[MSGHDR_SIZE];
-	void* plbuf;
-	size_t bytes_recvd;
+	char* buf;
+	size_t size;
+	size_t start;
+	size_t end;
 };
 
+/*
+ * Size of the largest encoded (header included) message of any of the
+ * fixed-size types that unparse_message() handles without going through XDR.
+ */
+#define MSG_FIXBUF_SIZE (MSGHDR_SIZE + 5 * sizeof(uint32_t))
+
+struct encmsg;
+
 /* Buffer for storing an outgoing (possibly only partially-sent) message */
 struct partsend {
+	/*
+	 * Points either to an alloc_msgbuf() allocation, to fixbuf, or (if
+	 * 'shared' is non-NULL) into an encmsg holding a reference on it.
+	 */
 	void* buf;
 	size_t len;
 	size_t bytes_sent;
+
+	/* Allocated size of buf (if not fixbuf) */
+	size_t bufsize;
+
+	/* Reused for small fixed-size messages to avoid heap allocations */
+	char fixbuf[MSG_FIXBUF_SIZE];
+
+	struct encmsg* shared;
+};
+
+/*
+ * An immutable, reference-counted, pre-encoded message, for sending the same
+ * message to any number of remotes while encoding (and storing) it only once.
+ * Each partsend buffer it gets queued into just refers to it; the last
+ * reference to be dropped frees (and wipes) it.
+ */
+struct encmsg {
+	unsigned int refs;
+	msgtype_t type;
+	struct partsend ps;
 };
 
+/*
+ * Buffers of up to this many bytes obtained via alloc_msgbuf() are recycled
+ * rather than freed.
+ */
+#define MSGBUF_POOL_SIZE 512
+
+void* alloc_msgbuf(size_t len);
+void release_msgbuf(void* buf, size_t len);
+
 struct message* new_message(msgtype_t type);
 void free_message(struct message* msg);
 void free_msgbody(struct message* msg);
 
+struct encmsg* encode_message(const struct message* msg);
+struct encmsg* encmsg_ref(struct encmsg* em);
+void encmsg_unref(struct encmsg* em);
+struct message* share_message(struct encmsg* em);
+void share_msgbuf(struct encmsg* em, struct partsend* ps);
+
 const char* msgtype_name(msgtype_t type);
 
+/* One more than the highest message type; must be kept in sync with proto.x */
+#define NUM_MSGTYPES (MT_CLIPBOARDLOST + 1)
+
 int fill_msgbuf(int fd, struct partrecv* pr);
-int parse_message(struct partrecv* pr, struct message* msg);
+int decode_message(char* buf, uint32_t len, struct message* msg);
+struct seal;
+int parse_message(struct partrecv* pr, struct message* msg, struct seal* seal);
+void clear_recvbuf(struct partrecv* pr);
 
+int unparse_fixed_message(const struct message* msg, struct partsend* ps);
 void unparse_message(const struct message* msg, struct partsend* ps);
-int drain_msgbuf(int fd, struct partsend* ps);
+void clear_msgbuf(struct partsend* ps);
+
+/* Maximum number of buffers drain_msgbufs() will accept at once */
+#define MAX_DRAIN_BUFS 16
+
+int drain_msgbufs(int fd, struct partsend* const* bufs, unsigned int n);
 
 #endif /* PROTO_H */
@@ -2,6 +2,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <wordexp.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "misc.h"
 #include "kvmap.h"
@@ -62,6 +65,15 @@ void set_fd_cloexec(int fd, int ce)
 	}
 }
 
+/* Disable Nagle's algorithm on a TCP socket (input events can't wait). */
+void set_tcp_nodelay(int fd)
+{
+	int one = 1;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		warn("setsockopt(TCP_NODELAY) failed: %s\n", strerror(errno));
+}
+
 /*
  * Perform shell-like word expansion on a string (so we can have conveniences
  * like "~" to refer to home directories in paths in config files).
@@ -147,6 +159,25 @@ void set_clipboard_from_buf(const void* buf, size_t len)
 	xfree(tmp);
 }
 
+/* FNV-1a parameters for 64-bit hashes */
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+/* Compute the cliphash of the given clipboard text. */
+void hash_clipboard(const char* text, struct cliphash* ch)
+{
+	const unsigned char* p;
+	uint64_t h = FNV64_OFFSET_BASIS;
+
+	for (p = (const unsigned char*)text; *p; p++) {
+		h ^= *p;
+		h *= FNV64_PRIME;
+	}
+
+	ch->hash = h;
+	ch->length = p - (const unsigned char*)text;
+}
+
 /*
  * Adapted from Ted Unangst's public-domain explicit_bzero.c (originally in
  * OpenBSD libc I think, now also elsewhere).
@@ -160,3 +191,23 @@ void explicit_bzero(void* p, size_t n)
 {
 	enthrall_bzero(p, n);
 }
+
+/*
+ * Return the mask of screen edges (of the given screen) that the given point
+ * lies on.
+ */
+dirmask_t point_edgemask(struct xypoint pt, const struct rectangle* screen)
+{
+	dirmask_t mask = 0;
+
+	if (pt.x == screen->x.min)
+		mask |= LEFTMASK;
+	if (pt.x == screen->x.max)
+		mask |= RIGHTMASK;
+	if (pt.y == screen->y.min)
+		mask |= UPMASK;
+	if (pt.y == screen->y.max)
+		mask |= DOWNMASK;
+
+	return mask;
+}
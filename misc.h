@@ -142,17 +142,21 @@ static inline int is_master(struct node* n)
 }
 
 void run_remote(void);
+int remote_attached(void);
 void set_loglevel(unsigned int level);
 extern struct msgchan stdio_msgchan;
 
 void send_keyevent(struct remote* rmt, keycode_t kc, pressrel_t pr);
+void forward_keyevent(keycode_t kc, pressrel_t pr);
 void send_moverel(struct remote* rmt, int32_t dx, int32_t dy);
 void send_clickevent(struct remote* rmt, mousebutton_t button, pressrel_t pr);
+void send_scroll(struct remote* rmt, int32_t amount);
 void send_setbrightness(struct remote* rmt, float f);
 
 int get_fd_nonblock(int fd);
 void set_fd_nonblock(int fd, int nb);
 void set_fd_cloexec(int fd, int ce);
+void set_tcp_nodelay(int fd);
 
 char* expand_word(const char* wd);
 
@@ -161,8 +165,17 @@ struct kvmap* unflatten_kvmap(const struct kvpair* pairs, u_int numpairs);
 
 void set_clipboard_from_buf(const void* buf, size_t len);
 
+void hash_clipboard(const char* text, struct cliphash* ch);
+
+static inline int cliphash_eq(const struct cliphash* a, const struct cliphash* b)
+{
+	return a->hash == b->hash && a->length == b->length;
+}
+
 void explicit_bzero(void* p, size_t n);
 
+dirmask_t point_edgemask(struct xypoint pt, const struct rectangle* screen);
+
 /*
  * Make a function to produce a gamma value for index 'idx' in a gamma table
  * by scaling (by compressing/expanding the X axis and interpolating, not just
@@ -195,4 +208,25 @@ void explicit_bzero(void* p, size_t n);
 		return defloat(lo + (frac * (hi - lo))); \
 	}
 
+/*
+ * Display brightness levels get quantized to multiples of 1/BRIGHTNESS_STEPS
+ * (and capped at BRIGHTNESS_MAX, far beyond anything useful), so that gamma
+ * tables scaled for each one can be cached for reuse, fades passing through
+ * the same levels over and over.  GAMMA_CACHE_SLOTS is how many scaled tables
+ * are kept per display.
+ */
+#define BRIGHTNESS_STEPS 256
+#define BRIGHTNESS_MAX 16.0
+#define GAMMA_CACHE_SLOTS 32
+
+static inline int quantize_brightness(float f)
+{
+	assert(f >= 0.0);
+
+	if (f > BRIGHTNESS_MAX)
+		f = BRIGHTNESS_MAX;
+
+	return (int)(f * BRIGHTNESS_STEPS + 0.5);
+}
+
 #endif /* MISC_H */
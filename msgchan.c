@@ -1,50 +1,718 @@
 
+#include <errno.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "misc.h"
 #include "msgchan.h"
+#include "seal.h"
+#include "stats.h"
 
 /*
- * If there's at least one message in the send queue, pull one off and return
- * it; otherwise return NULL.
+ * If there's at least one message in the given send queue, pull one off and
+ * return it; otherwise return NULL.
  */
-static struct message* mc_dequeue_message(struct msgchan* mc)
+static struct message* mc_dequeue_message(struct msgqueue* q)
 {
 	struct message* msg;
 
-	msg = mc->sendqueue.head;
+	msg = q->head;
 
 	if (msg) {
-		mc->sendqueue.head = msg->next;
+		q->head = msg->next;
 		if (!msg->next)
-			mc->sendqueue.tail = NULL;
-		mc->sendqueue.num_queued -= 1;
+			q->tail = NULL;
+		q->num_queued -= 1;
 	}
 
 	return msg;
 }
 
+/*
+ * Remove the first n (fully-sent or discarded) buffers from a msgchan's send
+ * ring.
+ */
+static void mc_pop_sendring(struct msgchan* mc, unsigned int n)
+{
+	assert(n <= mc->sendring.count);
+
+	while (n--) {
+		mc->sendring.lanecount[mc->sendring.lanes[mc->sendring.head]] -= 1;
+		mc->sendring.head = (mc->sendring.head + 1) % MAX_DRAIN_BUFS;
+		mc->sendring.count -= 1;
+	}
+}
+
+/*
+ * Clipboard text longer than this is streamed out in pieces of (at most)
+ * this size instead of being sent as a single SETCLIPBOARD.
+ */
+#define CLIPCHUNK_SIZE (8 * 1024)
+
+#ifdef HAVE_ZLIB
+/* Tear down (and free) a zlib stream, for either direction. */
+static void mc_zstream_free(z_stream* zs, int deflating)
+{
+	if (deflating)
+		deflateEnd(zs);
+	else
+		inflateEnd(zs);
+	explicit_bzero(zs, sizeof(*zs));
+	xfree(zs);
+}
+
+/*
+ * Set up compression for the outbound clipboard stream just started, leaving
+ * it uncompressed if that fails.
+ */
+static void mc_clipsend_zinit(struct msgchan* mc)
+{
+	z_stream* zs = xcalloc(sizeof(*zs));
+
+	if (deflateInit(zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		warn("deflateInit() failed, sending clipboard uncompressed\n");
+		xfree(zs);
+		return;
+	}
+
+	/* All the input is available up front */
+	zs->next_in = (Bytef*)mc->clipsend.text;
+	zs->avail_in = mc->clipsend.len;
+
+	mc->clipsend.zs = zs;
+	mc->clipsend.zbuf = xmalloc(CLIPCHUNK_SIZE);
+}
+
+/*
+ * Compress up to a chunk's worth of output from the outbound clipboard
+ * stream into clipsend.zbuf, returning the number of bytes produced.
+ */
+static size_t mc_clipsend_deflate(struct msgchan* mc)
+{
+	z_stream* zs = mc->clipsend.zs;
+	int status;
+
+	zs->next_out = (Bytef*)mc->clipsend.zbuf;
+	zs->avail_out = CLIPCHUNK_SIZE;
+
+	status = deflate(zs, Z_FINISH);
+	if (status != Z_OK && status != Z_STREAM_END) {
+		errlog("deflate() failed (%d)\n", status);
+		abort();
+	}
+
+	/* Input consumed doesn't tell us when the output is complete */
+	if (status == Z_STREAM_END)
+		mc->clipsend.sent = mc->clipsend.len;
+
+	return CLIPCHUNK_SIZE - zs->avail_out;
+}
+
+/* Set up decompression for an inbound clipboard stream. */
+static int mc_cliprecv_zinit(struct msgchan* mc)
+{
+	z_stream* zs = xcalloc(sizeof(*zs));
+
+	if (inflateInit(zs) != Z_OK) {
+		errlog("inflateInit() failed\n");
+		xfree(zs);
+		return -1;
+	}
+
+	zs->next_out = (Bytef*)mc->cliprecv.text;
+	zs->avail_out = mc->cliprecv.len;
+
+	mc->cliprecv.zs = zs;
+
+	return 0;
+}
+
+/*
+ * Decompress a chunk of an inbound clipboard stream into cliprecv.text.
+ * Returns negative if the data is invalid or would decompress to more than
+ * the announced length.
+ */
+static int mc_cliprecv_inflate(struct msgchan* mc, const char* data, size_t len)
+{
+	z_stream* zs = mc->cliprecv.zs;
+	int status;
+
+	if (mc->cliprecv.zdone)
+		return -1;
+
+	zs->next_in = (Bytef*)data;
+	zs->avail_in = len;
+
+	status = inflate(zs, Z_NO_FLUSH);
+	if (status == Z_STREAM_END)
+		mc->cliprecv.zdone = 1;
+	else if (status != Z_OK)
+		return -1;
+
+	/* Leftover input means trailing garbage or overlong output */
+	if (zs->avail_in)
+		return -1;
+
+	mc->cliprecv.received = mc->cliprecv.len - zs->avail_out;
+
+	return 0;
+}
+#endif /* HAVE_ZLIB */
+
+/* Discard any outbound clipboard stream in progress. */
+static void mc_clear_clipsend(struct msgchan* mc)
+{
+	if (mc->clipsend.text) {
+		explicit_bzero(mc->clipsend.text, mc->clipsend.len);
+		xfree(mc->clipsend.text);
+	}
+#ifdef HAVE_ZLIB
+	if (mc->clipsend.zs) {
+		mc_zstream_free(mc->clipsend.zs, 1);
+		explicit_bzero(mc->clipsend.zbuf, CLIPCHUNK_SIZE);
+		xfree(mc->clipsend.zbuf);
+	}
+#endif
+	mc->clipsend.text = NULL;
+	mc->clipsend.len = mc->clipsend.sent = 0;
+	mc->clipsend.begun = 0;
+	mc->clipsend.zs = NULL;
+	mc->clipsend.zbuf = NULL;
+}
+
+/* Discard any partially-reassembled inbound clipboard stream. */
+static void mc_clear_cliprecv(struct msgchan* mc)
+{
+	if (mc->cliprecv.text) {
+		explicit_bzero(mc->cliprecv.text, mc->cliprecv.received);
+		xfree(mc->cliprecv.text);
+	}
+#ifdef HAVE_ZLIB
+	if (mc->cliprecv.zs)
+		mc_zstream_free(mc->cliprecv.zs, 0);
+#endif
+	mc->cliprecv.text = NULL;
+	mc->cliprecv.len = mc->cliprecv.received = 0;
+	mc->cliprecv.zs = NULL;
+	mc->cliprecv.zdone = 0;
+}
+
 /* Clear inbound & outbound message buffers */
 void mc_clear(struct msgchan* mc)
 {
 	struct message* msg;
+	enum mc_lane lane;
 
-	while ((msg = mc_dequeue_message(mc)))
-		free_message(msg);
+	for (lane = 0; lane < MC_NUM_LANES; lane++) {
+		while ((msg = mc_dequeue_message(&mc->sendqueue[lane])))
+			free_message(msg);
+	}
+
+	if (mc->batch_timer) {
+		cancel_call(mc->batch_timer);
+		mc->batch_timer = NULL;
+	}
+
+	while (mc->sendring.count) {
+		clear_msgbuf(&mc->sendring.bufs[mc->sendring.head]);
+		mc_pop_sendring(mc, 1);
+	}
+	mc->sendring.head = 0;
+
+	clear_recvbuf(&mc->recv_msgbuf);
+
+	mc_clear_clipsend(mc);
+	mc_clear_cliprecv(mc);
+
+	mc->generation += 1;
+}
+
+/*
+ * Attempt to fold a MOVEREL into one already sitting at the tail of the send
+ * queue.  Only the tail is considered, so motion never gets reordered with
+ * respect to any other message (key or click events in particular).  Returns
+ * non-zero (having freed msg) if the merge was performed.
+ */
+static int mc_coalesce_moverel(struct msgchan* mc, struct message* msg)
+{
+	struct message* tail = mc->sendqueue[MCL_INTERACTIVE].tail;
+
+	if (!mc->coalesce_motion || msg->body.type != MT_MOVEREL || msg->encoded
+	    || !tail || tail->body.type != MT_MOVEREL || tail->encoded)
+		return 0;
+
+	MB(tail, moverel).dx += MB(msg, moverel).dx;
+	MB(tail, moverel).dy += MB(msg, moverel).dy;
+
+	free_message(msg);
+
+	return 1;
+}
+
+/* Which lane should messages of the given type be sent via? */
+static inline enum mc_lane msgtype_lane(msgtype_t type)
+{
+	switch (type) {
+	case MT_MOVEREL:
+	case MT_MOVEABS:
+	case MT_MOUSEPOS:
+	case MT_CLICKEVENT:
+	case MT_KEYEVENT:
+	case MT_EVENTBATCH:
+	case MT_MOTIONBARRIER:
+	case MT_SCROLL:
+	case MT_PING:
+	case MT_PONG:
+	case MT_CLIPPENDING:
+		return MCL_INTERACTIVE;
+	default:
+		return MCL_BULK;
+	}
+}
+
+/* Is the given message type one that can be carried in an EVENTBATCH? */
+static inline int is_batchable(msgtype_t type)
+{
+	switch (type) {
+	case MT_MOVEREL:
+	case MT_MOVEABS:
+	case MT_CLICKEVENT:
+	case MT_KEYEVENT:
+	case MT_SCROLL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Can the given message go in an EVENTBATCH?  (Pre-encoded ones can't, since
+ * that would mean decoding them again.)
+ */
+static inline int msg_batchable(const struct message* msg)
+{
+	return !msg->encoded && is_batchable(msg->body.type);
+}
+
+/* Does this msgchan have any data to be sent? */
+static inline int mc_have_outbound_data(const struct msgchan* mc)
+{
+	return mc->sendring.count || mc->sendqueue[MCL_INTERACTIVE].head
+		|| mc->sendqueue[MCL_BULK].head || mc->clipsend.text
+		|| mc->sendswitch.pending;
+}
+
+/*
+ * If msg is a SETCLIPBOARD large enough to warrant it, take ownership of its
+ * text and set it up to be streamed out in chunks instead.  Any stream
+ * already in progress is superseded by any new SETCLIPBOARD.  Returns
+ * non-zero (having freed msg) if the message was converted to a stream.
+ */
+static int mc_stream_clipboard(struct msgchan* mc, struct message* msg)
+{
+	size_t len;
+
+	if (msg->body.type != MT_SETCLIPBOARD)
+		return 0;
+
+	mc_clear_clipsend(mc);
+
+	/*
+	 * A pre-encoded one just goes out as it is, which is only acceptable
+	 * for small ones (see share_message()).  Its frame holds the type
+	 * and the string's length ahead of the (padded) text.
+	 */
+	if (msg->encoded) {
+		assert(msg->encoded->ps.len
+		       <= MSGHDR_SIZE + 2 * sizeof(uint32_t) + CLIPCHUNK_SIZE);
+		return 0;
+	}
+
+	len = strlen(MB(msg, setclipboard).text);
+	if (len <= CLIPCHUNK_SIZE)
+		return 0;
+
+	mc->clipsend.text = MB(msg, setclipboard).text;
+	mc->clipsend.len = len;
+	MB(msg, setclipboard).text = NULL;
+	free_message(msg);
+
+#ifdef HAVE_ZLIB
+	if (mc->compress_clipboard)
+		mc_clipsend_zinit(mc);
+#endif
+
+	fdmon_monitor(mc->send.mon, FM_WRITE);
+
+	return 1;
+}
+
+/*
+ * Produce the next chunk of data of the outbound clipboard stream, pointing
+ * *data at it (in memory owned by the stream) and returning its length.
+ */
+static size_t mc_next_clipchunk(struct msgchan* mc, char** data)
+{
+	size_t n;
+
+#ifdef HAVE_ZLIB
+	if (mc->clipsend.zs) {
+		*data = mc->clipsend.zbuf;
+		return mc_clipsend_deflate(mc);
+	}
+#endif
+
+	n = mc->clipsend.len - mc->clipsend.sent;
+	if (n > CLIPCHUNK_SIZE)
+		n = CLIPCHUNK_SIZE;
+
+	*data = mc->clipsend.text + mc->clipsend.sent;
+	mc->clipsend.sent += n;
+
+	return n;
+}
+
+/*
+ * Encode the next message of the outbound clipboard stream into the given
+ * partsend buffer, finishing off the stream when its end is reached.
+ * Returns the type of the message encoded.
+ */
+static msgtype_t mc_unparse_clipstep(struct msgchan* mc, struct partsend* ps)
+{
+	struct message msg = { .from_xdr = 0, .next = NULL, };
+
+	if (!mc->clipsend.begun) {
+		msg.body.type = MT_CLIPBEGIN;
+		MB(&msg, clipbegin).length = mc->clipsend.len;
+		MB(&msg, clipbegin).encoding = mc->clipsend.zs ? CE_ZLIB : CE_NONE;
+		mc->clipsend.begun = 1;
+	} else if (mc->clipsend.sent < mc->clipsend.len) {
+		/* Points into stream-owned memory, so msg must not be freed */
+		msg.body.type = MT_CLIPCHUNK;
+		MB(&msg, clipchunk).data.data_len =
+			mc_next_clipchunk(mc, &MB(&msg, clipchunk).data.data_val);
+	} else {
+		msg.body.type = MT_CLIPEND;
+	}
+
+	unparse_message(&msg, ps);
+
+	if (msg.body.type == MT_CLIPEND)
+		mc_clear_clipsend(mc);
+
+	return msg.body.type;
+}
+
+/* Timer callback for the end of a batching window. */
+static void mc_batch_timer_cb(void* arg)
+{
+	struct msgchan* mc = arg;
+
+	mc->batch_timer = NULL;
+
+	/* The send queue may have been drained in the meantime */
+	if (mc_have_outbound_data(mc))
+		fdmon_monitor(mc->send.mon, FM_WRITE);
+}
+
+/*
+ * Add a message to the appropriate send queue.  Returns 0 on success,
+ * non-zero if the send backlog is exceeded.
+ */
+static int mc_queue_message(struct msgchan* mc, struct message* msg)
+{
+	enum mc_lane lane;
+	struct msgqueue* q;
+	unsigned int backlog;
+
+	if (mc_coalesce_moverel(mc, msg) || mc_stream_clipboard(mc, msg))
+		return 0;
+
+	lane = msgtype_lane(msg->body.type);
+	q = &mc->sendqueue[lane];
+
+	msg->next = NULL;
+	if (q->tail)
+		q->tail->next = msg;
+	q->tail = msg;
+	if (!q->head)
+		q->head = msg;
+	q->num_queued += 1;
+
+	if (mc->batch_events && mc->batch_window && msg_batchable(msg)) {
+		if (!mc->batch_timer)
+			mc->batch_timer = schedule_call(mc_batch_timer_cb, mc,
+			                                mc->batch_window);
+	} else {
+		fdmon_monitor(mc->send.mon, FM_WRITE);
+	}
+
+	backlog = q->num_queued + mc->sendring.lanecount[lane];
+	if (mc->stats && backlog > mc->stats->queue_hwm)
+		mc->stats->queue_hwm = backlog;
+
+	return backlog > MAX_SEND_BACKLOG ? -1 : 0;
+}
+
+#ifdef HAVE_OPENSSL
+/*
+ * Motion side-channel
+ * ===================
+ *
+ * With a motion side-channel set up, MOVERELs enqueued on the sending side
+ * are instead sent immediately as MOTION datagrams, carrying the running
+ * total for the current epoch.  Any other interactive message (a click, a
+ * keystroke) gets a MOTIONBARRIER queued ahead of it in the message stream,
+ * as does a lull in the motion, so that everything happens at the right
+ * pointer position and lost datagrams get made up for.  The receiving side
+ * converts all of this back into MOVERELs (of whatever motion it hasn't yet
+ * applied) for the recv callback, so nothing beyond the msgchan needs to
+ * know about it.
+ */
+
+/* Upper bound on the size of a MOTION datagram */
+#define MOTION_DGRAM_MAX 64
+
+/* How long motion has to be idle before a barrier is sent to settle it */
+#define MOTION_SETTLE_US (20 * 1000)
+
+/*
+ * End the current motion epoch with a MOTIONBARRIER in the send queue, with
+ * 'hold' set if it's going in ahead of another message.
+ */
+static int mc_queue_barrier(struct msgchan* mc, int hold)
+{
+	struct message* msg = new_message(MT_MOTIONBARRIER);
+
+	MB(msg, motionbarrier).epoch = mc->motion.epoch;
+	MB(msg, motionbarrier).dx = mc->motion.dx;
+	MB(msg, motionbarrier).dy = mc->motion.dy;
+	MB(msg, motionbarrier).hold = hold;
+
+	mc->motion.epoch += 1;
+	mc->motion.dx = 0;
+	mc->motion.dy = 0;
+	mc->motion.dirty = 0;
+
+	return mc_queue_message(mc, msg);
+}
+
+/* Timer callback to settle motion after it's been idle for a while. */
+static void mc_motion_settle_cb(void* arg)
+{
+	struct msgchan* mc = arg;
+	uint64_t idle = get_microtime() - mc->motion.last_sent;
+
+	mc->motion.settle_timer = NULL;
+
+	if (!mc->motion.dirty)
+		return;
+
+	if (idle < MOTION_SETTLE_US) {
+		mc->motion.settle_timer = schedule_call(mc_motion_settle_cb, mc,
+		                                        MOTION_SETTLE_US - idle);
+		return;
+	}
+
+	if (mc_queue_barrier(mc, 0))
+		mc->cb.err(mc, mc->cb.arg);
+}
+
+/*
+ * Send a MOVEREL's worth of motion via the side-channel.  Failing to send
+ * the datagram isn't treated as an error: a later one or the next barrier
+ * will make up for it.
+ */
+static void mc_send_motion(struct msgchan* mc, const struct message* moverel)
+{
+	struct message msg = { .body.type = MT_MOTION, .from_xdr = 0, .next = NULL, };
+	struct partsend ps;
+	char dgram[MOTION_DGRAM_MAX];
+	size_t len;
+
+	mc->motion.dx += MB(moverel, moverel).dx;
+	mc->motion.dy += MB(moverel, moverel).dy;
+	mc->motion.dirty = 1;
+	mc->motion.last_sent = get_microtime();
 
-	xfree(mc->send_msgbuf.buf);
-	mc->send_msgbuf.buf = NULL;
-	mc->send_msgbuf.bytes_sent = 0;
-	mc->send_msgbuf.len = 0;
+	MB(&msg, motion).epoch = mc->motion.epoch;
+	MB(&msg, motion).dx = mc->motion.dx;
+	MB(&msg, motion).dy = mc->motion.dy;
 
-	xfree(mc->recv_msgbuf.plbuf);
-	mc->recv_msgbuf.plbuf = NULL;
-	mc->recv_msgbuf.bytes_recvd = 0;
+	unparse_message(&msg, &ps);
+	assert(ps.len - MSGHDR_SIZE + SEAL_DGRAM_OVERHEAD <= sizeof(dgram));
+	len = seal_dgram(mc->motion.seal, ++mc->motion.seq, ps.buf + MSGHDR_SIZE,
+	                 ps.len - MSGHDR_SIZE, dgram);
+	clear_msgbuf(&ps);
+
+	if (!len)
+		debug("failed to seal MOTION datagram\n");
+	else if (send(mc->motion.fd, dgram, len, 0) < 0)
+		debug("failed to send MOTION datagram: %s\n", strerror(errno));
+	else if (mc->stats)
+		count_msg(mc->stats->sent, MT_MOTION, len);
+
+	if (!mc->motion.settle_timer)
+		mc->motion.settle_timer = schedule_call(mc_motion_settle_cb, mc,
+		                                        MOTION_SETTLE_US);
+}
+
+/* Pass received side-channel motion on to the recv callback as a MOVEREL. */
+static void mc_deliver_motion(struct msgchan* mc, int32_t dx, int32_t dy)
+{
+	struct message msg = { .body.type = MT_MOVEREL, .from_xdr = 0, .next = NULL, };
+
+	if (!dx && !dy)
+		return;
+
+	MB(&msg, moverel).dx = dx;
+	MB(&msg, moverel).dy = dy;
+
+	mc->cb.recv(mc, &msg, mc->cb.arg);
+}
+
+/* Apply the given total motion for the current epoch. */
+static void mc_apply_motion(struct msgchan* mc, int32_t dx, int32_t dy)
+{
+	int32_t ddx = dx - mc->motion.dx;
+	int32_t ddy = dy - mc->motion.dy;
+
+	mc->motion.dx = dx;
+	mc->motion.dy = dy;
+	mc_deliver_motion(mc, ddx, ddy);
+}
+
+/* Apply a MOTION received via the side-channel. */
+static void mc_recv_motion(struct msgchan* mc, const struct motion_body* m)
+{
+	if (m->epoch == mc->motion.epoch && !mc->motion.held) {
+		mc->motion.ahead.valid = 0;
+		mc_apply_motion(mc, m->dx, m->dy);
+	} else if (m->epoch == mc->motion.epoch || m->epoch == mc->motion.epoch + 1) {
+		/* Can't apply it yet; hang on to it until we can */
+		mc->motion.ahead.valid = 1;
+		mc->motion.ahead.epoch = m->epoch;
+		mc->motion.ahead.dx = m->dx;
+		mc->motion.ahead.dy = m->dy;
+	}
+}
+
+/* Stop holding motion and apply any that's been waiting for that. */
+static void mc_release_motion(struct msgchan* mc)
+{
+	mc->motion.held = 0;
+
+	if (mc->motion.ahead.valid && mc->motion.ahead.epoch == mc->motion.epoch) {
+		mc->motion.ahead.valid = 0;
+		mc_apply_motion(mc, mc->motion.ahead.dx, mc->motion.ahead.dy);
+	}
+}
+
+/*
+ * Apply a MOTIONBARRIER received via the message stream, finishing off its
+ * epoch.  Returns negative on a protocol error.
+ */
+static int mc_recv_barrier(struct msgchan* mc, const struct motionbarrier_body* m)
+{
+	if (mc->motion.fd < 0 || mc->motion.sending || m->epoch != mc->motion.epoch)
+		return -EINVAL;
+
+	mc_apply_motion(mc, m->dx, m->dy);
+
+	mc->motion.epoch += 1;
+	mc->motion.dx = 0;
+	mc->motion.dy = 0;
+	mc->motion.held = m->hold;
+
+	/* Anything stashed from the epoch just finished is now moot */
+	if (mc->motion.ahead.valid && mc->motion.ahead.epoch != mc->motion.epoch)
+		mc->motion.ahead.valid = 0;
+
+	if (!mc->motion.held)
+		mc_release_motion(mc);
+
+	return 0;
+}
+
+/*
+ * fdmon callback for the receiving side of a motion side-channel.  Anything
+ * that fails to open, is out of date, or isn't a MOTION is silently dropped
+ * (it could just be noise from the network).
+ */
+static void mc_motion_read_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	struct msgchan* mc = arg;
+	unsigned char dgram[MOTION_DGRAM_MAX], body[MOTION_DGRAM_MAX];
+	unsigned int generation = mc->generation;
+	struct message msg;
+	uint64_t seq;
+	ssize_t len;
+
+	for (;;) {
+		len = recv(mc->motion.fd, dgram, sizeof(dgram), 0);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				debug("recv() on motion channel failed: %s\n", strerror(errno));
+			break;
+		}
+
+		if (open_dgram(mc->motion.seal, dgram, len, &seq, body)
+		    || seq <= mc->motion.seq)
+			continue;
+
+		/* See comment in mc_read_cb() */
+		memset(&msg.body, 0, sizeof(msg.body));
+		if (decode_message((char*)body, len - SEAL_DGRAM_OVERHEAD, &msg))
+			continue;
+
+		if (msg.body.type == MT_MOTION) {
+			if (mc->stats)
+				count_msg(mc->stats->recvd, MT_MOTION, len);
+			mc->motion.seq = seq;
+			mc_recv_motion(mc, &MB(&msg, motion));
+		}
+		free_msgbody(&msg);
+
+		if (mc->generation != generation)
+			return;
+	}
+
+	if (mc->cb.recv_done)
+		mc->cb.recv_done(mc, mc->cb.arg);
+}
+
+/*
+ * Start sending relative pointer motion via a datagram socket (connected
+ * to the receiving end) instead of the message stream, sealed with the
+ * given seal.  The msgchan takes ownership of both.
+ */
+void mc_set_motion_send(struct msgchan* mc, int fd, struct seal* seal)
+{
+	set_fd_nonblock(fd, 1);
+
+	mc->motion.fd = fd;
+	mc->motion.sending = 1;
+	mc->motion.seal = seal;
 }
 
 /*
- * Mamimum number of messages we'll buffer up in a msgchan's send queue before
- * calling the error handler.
+ * Start accepting relative pointer motion via the given datagram socket,
+ * opened with the given seal.  The msgchan takes ownership of both.
  */
-#define MAX_SEND_BACKLOG 64
+void mc_set_motion_recv(struct msgchan* mc, int fd, struct seal* seal)
+{
+	set_fd_nonblock(fd, 1);
+
+	mc->motion.fd = fd;
+	mc->motion.sending = 0;
+	mc->motion.seal = seal;
+	mc->motion.mon = fdmon_register_fd(fd, mc_motion_read_cb, NULL, mc);
+	fdmon_monitor(mc->motion.mon, FM_READ);
+}
+#endif /* HAVE_OPENSSL */
 
 /*
  * Enqueue a message to be sent.  Returns 0 on success, non-zero if the send
@@ -52,105 +720,425 @@ void mc_clear(struct msgchan* mc)
  */
 int mc_enqueue_message(struct msgchan* mc, struct message* msg)
 {
-	msg->next = NULL;
-	if (mc->sendqueue.tail)
-		mc->sendqueue.tail->next = msg;
-	mc->sendqueue.tail = msg;
-	if (!mc->sendqueue.head)
-		mc->sendqueue.head = msg;
-	mc->sendqueue.num_queued += 1;
+#ifdef HAVE_OPENSSL
+	if (mc->motion.sending) {
+		if (msg->body.type == MT_MOVEREL && !msg->encoded) {
+			mc_send_motion(mc, msg);
+			free_message(msg);
+			return 0;
+		}
 
-	fdmon_monitor(mc->send.mon, FM_WRITE);
+		if (mc->motion.dirty && msgtype_lane(msg->body.type) == MCL_INTERACTIVE
+		    && msg->body.type != MT_PING && mc_queue_barrier(mc, 1)) {
+			free_message(msg);
+			return -1;
+		}
+	}
+#endif
 
-	return mc->sendqueue.num_queued > MAX_SEND_BACKLOG ? -1 : 0;
+	return mc_queue_message(mc, msg);
 }
 
 /*
- * Attempt to finish sending an in-progress message or start sending the next
- * one in the send queue.  Returns positive if some data was sent, zero if
- * nothing was queued, and negative on error.
+ * Maximum number of input events we'll pack into a single EVENTBATCH.
  */
-static int send_message(struct msgchan* mc)
+#define MAX_BATCH_EVENTS 32
+
+/* Keep batch arrays within the size that gets recycled */
+_Static_assert(MAX_BATCH_EVENTS * sizeof(struct inputevent) <= MSGBUF_POOL_SIZE,
+               "EVENTBATCH array too large for buffer pool");
+
+/* Copy the body of an input-event message into an EVENTBATCH entry. */
+static void fill_inputevent(struct inputevent* ev, const struct message* msg)
 {
-	int status;
+	ev->type = msg->body.type;
+
+	switch (msg->body.type) {
+	case MT_MOVEREL:
+		ev->inputevent_u.moverel = MB(msg, moverel);
+		break;
+	case MT_MOVEABS:
+		ev->inputevent_u.moveabs = MB(msg, moveabs);
+		break;
+	case MT_CLICKEVENT:
+		ev->inputevent_u.clickevent = MB(msg, clickevent);
+		break;
+	case MT_KEYEVENT:
+		ev->inputevent_u.keyevent = MB(msg, keyevent);
+		break;
+	case MT_SCROLL:
+		ev->inputevent_u.scroll = MB(msg, scroll);
+		break;
+	default:
+		abort();
+	}
+}
+
+/*
+ * Like mc_dequeue_message() on the interactive lane, but if batching is
+ * enabled and the head of the queue is a run of two or more input events,
+ * pull them all (up to MAX_BATCH_EVENTS) off and return them packed into a
+ * single EVENTBATCH.
+ */
+static struct message* mc_dequeue_batch(struct msgchan* mc)
+{
+	struct msgqueue* q = &mc->sendqueue[MCL_INTERACTIVE];
 	struct message* msg;
+	struct message* batch;
+	struct inputevent* events;
+	unsigned int n;
 
-	if (!mc->send_msgbuf.buf) {
-		msg = mc_dequeue_message(mc);
-		if (!msg)
-			return 0;
-		mc->send_msgbuf.bytes_sent = 0;
-		unparse_message(msg, &mc->send_msgbuf);
+	msg = mc_dequeue_message(q);
+
+	if (!msg || !mc->batch_events || !msg_batchable(msg)
+	    || !q->head || !msg_batchable(q->head))
+		return msg;
+
+	events = alloc_msgbuf(MAX_BATCH_EVENTS * sizeof(*events));
+
+	for (n = 0; msg; n++) {
+		fill_inputevent(&events[n], msg);
 		free_message(msg);
+
+		if (n + 1 < MAX_BATCH_EVENTS && q->head && msg_batchable(q->head))
+			msg = mc_dequeue_message(q);
+		else
+			msg = NULL;
 	}
 
-	status = drain_msgbuf(mc->send.fd, &mc->send_msgbuf);
+	batch = new_message(MT_EVENTBATCH);
+	MB(batch, eventbatch).events.events_val = events;
+	MB(batch, eventbatch).events.events_len = n;
 
-	return status < 0 ? status : 1;
+	return batch;
 }
 
 /*
- * Read in (possibly only part of) a message.  Returns positive if a complete
- * message has been read, zero if the incoming message is still incomplete,
- * and negative on error.
+ * Encode messages from the send queues into the send ring until the former
+ * run out or the latter fills up.  Interactive messages always go first; the
+ * bulk lane (followed by the outbound clipboard stream, if any) only gets a
+ * slot when it doesn't already have one, so that interactive messages
+ * enqueued while bulk data is in transit have at most one bulk message ahead
+ * of them.  If a transport switch is pending, nothing goes in after the
+ * TRANSPORTSWITCH marker until it's been carried out.  Returns negative on
+ * error.
  */
-static int recv_message(struct msgchan* mc, struct message* msg)
+static int mc_fill_sendring(struct msgchan* mc)
 {
-	int status;
+	struct message* msg;
+	struct message marker = {
+		.body.type = MT_TRANSPORTSWITCH,
+		.from_xdr = 0,
+		.next = NULL,
+	};
+	struct partsend* ps;
+	unsigned int slot;
+	enum mc_lane lane;
+	msgtype_t type;
 
-	status = fill_msgbuf(mc->recv.fd, &mc->recv_msgbuf);
-	if (status <= 0)
-		return status;
+	while (mc->sendring.count < MAX_DRAIN_BUFS) {
+		slot = (mc->sendring.head + mc->sendring.count) % MAX_DRAIN_BUFS;
+		ps = &mc->sendring.bufs[slot];
+		ps->bytes_sent = 0;
 
-	status = parse_message(&mc->recv_msgbuf, msg);
-	if (status < 0)
-		return status;
+		if (mc->sendswitch.pending) {
+			if (mc->sendswitch.marked)
+				break;
+			lane = MCL_INTERACTIVE;
+			type = marker.body.type;
+			unparse_message(&marker, ps);
+			mc->sendswitch.marked = 1;
+		} else {
+			if ((msg = mc_dequeue_batch(mc))) {
+				lane = MCL_INTERACTIVE;
+			} else if (mc->sendring.lanecount[MCL_BULK]) {
+				break;
+			} else {
+				lane = MCL_BULK;
+				msg = mc_dequeue_message(&mc->sendqueue[MCL_BULK]);
+			}
 
-	return 1;
+			if (msg) {
+				type = msg->body.type;
+				if (msg->encoded)
+					share_msgbuf(msg->encoded, ps);
+				else
+					unparse_message(msg, ps);
+				free_message(msg);
+			} else if (mc->clipsend.text) {
+				type = mc_unparse_clipstep(mc, ps);
+			} else {
+				break;
+			}
+		}
+
+#ifdef HAVE_OPENSSL
+		if (mc->send.seal && seal_msgbuf(mc->send.seal, ps)) {
+			clear_msgbuf(ps);
+			return -EINVAL;
+		}
+#endif
+
+		if (mc->stats)
+			count_msg(mc->stats->sent, type, ps->len);
+
+		mc->sendring.lanes[slot] = lane;
+		mc->sendring.lanecount[lane] += 1;
+		mc->sendring.count += 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pass a received message on to the msgchan's recv callback, reassembling
+ * clipboard streams along the way: the pieces of a stream are absorbed here,
+ * and on its completion the callback gets a SETCLIPBOARD of the full text
+ * (which it may take ownership of, setting the text pointer to NULL).
+ * Returns negative on a protocol error.
+ */
+static int mc_deliver_message(struct msgchan* mc, struct message* msg)
+{
+	struct message full = { .from_xdr = 0, .next = NULL, };
+	uint32_t len;
+
+	switch (msg->body.type) {
+	case MT_CLIPBEGIN:
+		mc_clear_cliprecv(mc);
+		len = MB(msg, clipbegin).length;
+		/* malloc(), not xmalloc(); see make_recvbuf_room() */
+		mc->cliprecv.text = malloc((size_t)len + 1);
+		if (!mc->cliprecv.text)
+			return -ENOMEM;
+		mc->cliprecv.len = len;
+
+		switch (MB(msg, clipbegin).encoding) {
+		case CE_NONE:
+			return 0;
+#ifdef HAVE_ZLIB
+		case CE_ZLIB:
+			return mc_cliprecv_zinit(mc) ? -EINVAL : 0;
+#endif
+		default:
+			errlog("unsupported clipboard encoding %d\n",
+			       MB(msg, clipbegin).encoding);
+			return -EINVAL;
+		}
+
+	case MT_CLIPCHUNK:
+		len = MB(msg, clipchunk).data.data_len;
+		if (!mc->cliprecv.text)
+			return -EINVAL;
+#ifdef HAVE_ZLIB
+		if (mc->cliprecv.zs)
+			return mc_cliprecv_inflate(mc, MB(msg, clipchunk).data.data_val,
+			                           len) ? -EINVAL : 0;
+#endif
+		if (len > mc->cliprecv.len - mc->cliprecv.received)
+			return -EINVAL;
+		memcpy(mc->cliprecv.text + mc->cliprecv.received,
+		       MB(msg, clipchunk).data.data_val, len);
+		mc->cliprecv.received += len;
+		return 0;
+
+	case MT_CLIPEND:
+		if (!mc->cliprecv.text || mc->cliprecv.received != mc->cliprecv.len
+		    || (mc->cliprecv.zs && !mc->cliprecv.zdone))
+			return -EINVAL;
+		full.body.type = MT_SETCLIPBOARD;
+		MB(&full, setclipboard).text = mc->cliprecv.text;
+		MB(&full, setclipboard).text[mc->cliprecv.len] = '\0';
+		/* Hand off the text, discarding everything else */
+		mc->cliprecv.text = NULL;
+		mc_clear_cliprecv(mc);
+		mc->cb.recv(mc, &full, mc->cb.arg);
+		free_msgbody(&full);
+		return 0;
+
+#ifdef HAVE_OPENSSL
+	case MT_MOTIONBARRIER:
+		return mc_recv_barrier(mc, &MB(msg, motionbarrier));
+#endif
+
+	case MT_SETCLIPBOARD:
+		mc_clear_cliprecv(mc);
+		/* fall through */
+	default:
+		mc->cb.recv(mc, msg, mc->cb.arg);
+#ifdef HAVE_OPENSSL
+		/* (mc_close() clears 'held' if the callback closed mc) */
+		if (mc->motion.held && msgtype_lane(msg->body.type) == MCL_INTERACTIVE)
+			mc_release_motion(mc);
+#endif
+		return 0;
+	}
+}
+
+/*
+ * Record a msgchan's original file descriptors (if that hasn't already been
+ * done) before either side of it switches transports.
+ */
+static void mc_save_orig(struct msgchan* mc)
+{
+	if (mc->orig.saved)
+		return;
+
+	mc->orig.saved = 1;
+	mc->orig.send_fd = mc->send.fd;
+	mc->orig.recv_fd = mc->recv.fd;
+	mc->orig.mon = NULL;
+}
+
+static void mc_write_cb(struct fdmon_ctx* ctx, void* arg);
+
+/*
+ * Carry out a pending switch of a msgchan's send side once the
+ * TRANSPORTSWITCH marker has been sent.
+ */
+static void mc_finish_send_switch(struct msgchan* mc)
+{
+	mc_save_orig(mc);
+
+	fdmon_unregister(mc->send.mon);
+
+#ifdef HAVE_OPENSSL
+	free_seal(mc->send.seal);
+#endif
+
+	mc->send.fd = mc->sendswitch.fd;
+	mc->send.seal = mc->sendswitch.seal;
+	mc->send.mon = fdmon_register_fd(mc->send.fd, NULL, mc_write_cb, mc);
+
+	mc->sendswitch.pending = 0;
+	mc->sendswitch.marked = 0;
+	mc->sendswitch.fd = -1;
+	mc->sendswitch.seal = NULL;
+}
+
+/*
+ * Send as much queued data as the send file descriptor will accept without
+ * blocking, finishing off any partially-sent message first.  Returns positive
+ * if some data was sent, zero if nothing was queued, and negative on error.
+ */
+static int send_messages(struct msgchan* mc)
+{
+	struct partsend* bufs[MAX_DRAIN_BUFS];
+	unsigned int i, n;
+	int status, sent = 0;
+	uint64_t start;
+
+	for (;;) {
+		status = mc_fill_sendring(mc);
+		if (status < 0)
+			return status;
+
+		n = mc->sendring.count;
+		if (!n && mc->sendswitch.marked) {
+			/* The marker's gone; carry on via the new transport */
+			mc_finish_send_switch(mc);
+			continue;
+		} else if (!n) {
+			return sent;
+		}
+
+		for (i = 0; i < n; i++)
+			bufs[i] = &mc->sendring.bufs[(mc->sendring.head + i)
+			                             % MAX_DRAIN_BUFS];
+
+		if (mc->stats) {
+			start = get_microtime();
+			status = drain_msgbufs(mc->send.fd, bufs, n);
+			hist_record(&mc->stats->drain_time, get_microtime() - start);
+		} else {
+			status = drain_msgbufs(mc->send.fd, bufs, n);
+		}
+		if (status < 0)
+			return status;
+
+		mc_pop_sendring(mc, status);
+		sent = 1;
+
+		/* Stop once the file descriptor is full */
+		if (status < n)
+			return sent;
+	}
 }
 
 /*
  * fdmon callback for a msgchan's receive-side file descriptor (called when
- * the file descriptor is ready to be read).  Attemps to pull in a message,
- * calling the msgchan's recv callback if a complete message has arrived.
+ * the file descriptor is ready to be read).  Reads in whatever data is
+ * available and calls the msgchan's recv callback for each complete message
+ * that has arrived, leaving any trailing partial message buffered.
  */
 static void mc_read_cb(struct fdmon_ctx* ctx, void* arg)
 {
-	struct msgchan* mc;
+	struct msgchan* mc = arg;
 	struct message msg;
+	unsigned int generation;
 	int status;
+	uint64_t start;
+	size_t avail;
 
-	/*
-	 * Apparently the XDR code requires this, though I can't find it
-	 * documented anywhere (sigh).  Without it, anything involving
-	 * pointers inside msg.body (strings, arrays) goes haywire.
-	 */
-	memset(&msg.body, 0, sizeof(msg.body));
-
-	mc = arg;
-
-	status = recv_message(mc, &msg);
+	if (mc->stats) {
+		start = get_microtime();
+		status = fill_msgbuf(mc->recv.fd, &mc->recv_msgbuf);
+		hist_record(&mc->stats->fill_time, get_microtime() - start);
+	} else {
+		status = fill_msgbuf(mc->recv.fd, &mc->recv_msgbuf);
+	}
 	if (!status)
 		return;
-	else if (status < 0)
+	else if (status < 0) {
 		mc->cb.err(mc, mc->cb.arg);
-	else {
-		mc->cb.recv(mc, &msg, mc->cb.arg);
+		return;
+	}
+
+	generation = mc->generation;
+
+	for (;;) {
+		/*
+		 * Apparently the XDR code requires this, though I can't find
+		 * it documented anywhere (sigh).  Without it, anything
+		 * involving pointers inside msg.body (strings, arrays) goes
+		 * haywire.
+		 */
+		memset(&msg.body, 0, sizeof(msg.body));
+
+		avail = mc->recv_msgbuf.end - mc->recv_msgbuf.start;
+		status = parse_message(&mc->recv_msgbuf, &msg, mc->recv.seal);
+		if (!status)
+			break;
+		else if (status < 0) {
+			mc->cb.err(mc, mc->cb.arg);
+			return;
+		}
+
+		/* (parse_message() consumes exactly the frame it parsed) */
+		if (mc->stats)
+			count_msg(mc->stats->recvd, msg.body.type, avail
+			          - (mc->recv_msgbuf.end - mc->recv_msgbuf.start));
+
+		status = mc_deliver_message(mc, &msg);
 		free_msgbody(&msg);
+		if (status < 0) {
+			mc->cb.err(mc, mc->cb.arg);
+			return;
+		}
+
+		/* Stop if the callback closed or re-initialized the msgchan */
+		if (mc->generation != generation)
+			return;
 	}
-}
 
-/* Does this msgchan have any data to be sent? */
-static inline int mc_have_outbound_data(const struct msgchan* mc)
-{
-	return mc->send_msgbuf.buf || mc->sendqueue.head;
+	if (mc->cb.recv_done)
+		mc->cb.recv_done(mc, mc->cb.arg);
 }
 
 /*
  * fdmon callback for a msgchan's send-side file descriptor (called when the
- * file descriptor is ready to be written to).  Attempts to complete the
- * transmission of a partially-sent message if one is in progress, or starts
- * sending the next message in the send queue (perhaps completing it).
+ * file descriptor is ready to be written to).  Completes the transmission of
+ * a partially-sent message if one is in progress and continues on through
+ * the send queue until either it is empty or the file descriptor fills up.
  */
 static void mc_write_cb(struct fdmon_ctx* ctx, void* arg)
 {
@@ -163,16 +1151,32 @@ static void mc_write_cb(struct fdmon_ctx* ctx, void* arg)
 		return;
 	}
 
-	status = send_message(mc);
-	if (status < 0)
+	status = send_messages(mc);
+	if (status < 0) {
+		/* The error handler may well have torn down the msgchan. */
 		mc->cb.err(mc, mc->cb.arg);
-	else
-		assert(status == 1);
+		return;
+	}
 
+	/* (the send side may have switched file descriptors) */
 	if (mc_have_outbound_data(mc))
-		fdmon_monitor(ctx, FM_WRITE);
+		fdmon_monitor(mc->send.mon, FM_WRITE);
 	else
-		fdmon_unmonitor(ctx, FM_WRITE);
+		fdmon_unmonitor(mc->send.mon, FM_WRITE);
+}
+
+/*
+ * fdmon callback for a msgchan's original receive-side file descriptor after
+ * it has switched transports.  Nothing more should ever arrive via it, so
+ * its becoming readable (normally meaning EOF, the process at the other end
+ * having exited) is treated as an error.
+ */
+static void mc_orig_read_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	struct msgchan* mc = arg;
+
+	fdmon_unmonitor(ctx, FM_READ);
+	mc->cb.err(mc, mc->cb.arg);
 }
 
 /* Initialize a msgchan with the given send/recv FDs and callbacks. */
@@ -192,20 +1196,141 @@ void mc_init(struct msgchan* mc, int send_fd, int recv_fd, mc_recv_cb_t recv_cb,
 
 	mc->cb.recv = recv_cb;
 	mc->cb.err = err_cb;
+	mc->cb.recv_done = NULL;
 	mc->cb.arg = cb_arg;
 
+	mc->stats = NULL;
+
+	mc->coalesce_motion = 0;
+	mc->batch_events = 0;
+	mc->batch_window = 0;
+	mc->compress_clipboard = 0;
+
+	mc->send.seal = NULL;
+	mc->recv.seal = NULL;
+	mc->sendswitch.pending = 0;
+	mc->sendswitch.marked = 0;
+	mc->sendswitch.fd = -1;
+	mc->sendswitch.seal = NULL;
+	mc->orig.saved = 0;
+	mc->orig.mon = NULL;
+
+	memset(&mc->motion, 0, sizeof(mc->motion));
+	mc->motion.fd = -1;
+
 	fdmon_monitor(mc->recv.mon, FM_READ);
 }
 
-/* Tear down a msgchan, closing its send/recv file descriptors. */
+/* Close each distinct (non-negative) file descriptor of the n given. */
+static void close_distinct_fds(const int* fds, int n)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (fds[j] == fds[i])
+				break;
+		}
+		if (j == i && fds[i] >= 0)
+			close(fds[i]);
+	}
+}
+
+/*
+ * Tear down a msgchan, closing its send/recv file descriptors (including
+ * any it has switched away from or was about to switch to).
+ */
 void mc_close(struct msgchan* mc)
 {
+	int fds[] = {
+		mc->send.fd,
+		mc->recv.fd,
+		mc->orig.saved ? mc->orig.send_fd : -1,
+		mc->orig.saved ? mc->orig.recv_fd : -1,
+		mc->sendswitch.pending ? mc->sendswitch.fd : -1,
+		mc->motion.fd,
+	};
+
 	mc_clear(mc);
 
 	fdmon_unregister(mc->send.mon);
 	fdmon_unregister(mc->recv.mon);
+	if (mc->orig.saved && mc->orig.mon)
+		fdmon_unregister(mc->orig.mon);
+	if (mc->motion.mon)
+		fdmon_unregister(mc->motion.mon);
+	if (mc->motion.settle_timer)
+		cancel_call(mc->motion.settle_timer);
 
-	close(mc->send.fd);
-	if (mc->recv.fd != mc->send.fd)
-		close(mc->recv.fd);
+	close_distinct_fds(fds, ARR_LEN(fds));
+
+#ifdef HAVE_OPENSSL
+	free_seal(mc->send.seal);
+	free_seal(mc->recv.seal);
+	if (mc->sendswitch.pending)
+		free_seal(mc->sendswitch.seal);
+	free_seal(mc->motion.seal);
+#endif
+	mc->send.seal = NULL;
+	mc->recv.seal = NULL;
+	mc->sendswitch.pending = 0;
+	mc->sendswitch.marked = 0;
+	mc->orig.saved = 0;
+	memset(&mc->motion, 0, sizeof(mc->motion));
+	mc->motion.fd = -1;
+}
+
+/*
+ * Move a msgchan's outbound traffic over to a new file descriptor (e.g. a
+ * direct network connection bootstrapped via the original one), sealing
+ * frames with the given seal if it's non-NULL.  The msgchan takes ownership
+ * of both.  A TRANSPORTSWITCH marker is sent via the old file descriptor
+ * after whatever's already in transit there; everything after it goes via
+ * the new one.  May be done at most once.
+ */
+void mc_switch_send(struct msgchan* mc, int fd, struct seal* seal)
+{
+	assert(!mc->sendswitch.pending);
+
+	set_fd_nonblock(fd, 1);
+
+	mc->sendswitch.pending = 1;
+	mc->sendswitch.marked = 0;
+	mc->sendswitch.fd = fd;
+	mc->sendswitch.seal = seal;
+
+	fdmon_monitor(mc->send.mon, FM_WRITE);
+}
+
+/*
+ * Move a msgchan's inbound side over to a new file descriptor, opening
+ * frames with the given seal if it's non-NULL; to be called once a
+ * TRANSPORTSWITCH has been received.  Returns zero on success (the
+ * msgchan taking ownership of fd and seal), or negative if anything already
+ * arrived via the old file descriptor after the TRANSPORTSWITCH.  May be
+ * done at most once.
+ */
+int mc_switch_recv(struct msgchan* mc, int fd, struct seal* seal)
+{
+	if (mc->recv_msgbuf.end != mc->recv_msgbuf.start)
+		return -EINVAL;
+
+	mc_save_orig(mc);
+
+	fdmon_unregister(mc->recv.mon);
+	mc->orig.mon = fdmon_register_fd(mc->orig.recv_fd, mc_orig_read_cb, NULL, mc);
+	fdmon_monitor(mc->orig.mon, FM_READ);
+
+	set_fd_nonblock(fd, 1);
+
+#ifdef HAVE_OPENSSL
+	free_seal(mc->recv.seal);
+#endif
+
+	mc->recv.fd = fd;
+	mc->recv.seal = seal;
+	mc->recv.mon = fdmon_register_fd(fd, mc_read_cb, NULL, mc);
+	fdmon_monitor(mc->recv.mon, FM_READ);
+
+	return 0;
 }
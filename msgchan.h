@@ -14,18 +14,131 @@
 
 struct msgchan;
 
+/* Opaque to anything outside msgchan.c (and unused without zlib) */
+struct z_stream_s;
+
+/* Opaque outside of seal.c (and unused without OpenSSL) */
+struct seal;
+
+/* See stats.h */
+struct mcstats;
+
+/*
+ * Mamimum number of messages of each lane we'll buffer up in a msgchan's send
+ * queue and send ring before reporting the backlog as exceeded.
+ */
+#define MAX_SEND_BACKLOG 64
+
+/*
+ * Priority classes ("lanes") for outbound messages.  Queued interactive
+ * messages (input events, heartbeats) are always sent ahead of bulk ones
+ * (clipboard contents, brightness changes, log messages, etc.) regardless of
+ * the order in which they were enqueued; within a lane order is preserved.
+ */
+enum mc_lane {
+	MCL_INTERACTIVE = 0,
+	MCL_BULK,
+
+	MC_NUM_LANES,
+};
+
+/* A FIFO queue of pending outbound messages */
+struct msgqueue {
+	struct message* head;
+	struct message* tail;
+	int num_queued;
+};
+
 typedef void (*mc_recv_cb_t)(struct msgchan* chan, struct message* msg, void* arg);
 typedef void (*mc_err_cb_t)(struct msgchan* chan, void* arg);
+typedef void (*mc_recv_done_cb_t)(struct msgchan* chan, void* arg);
 
 struct msgchan {
 	struct {
 		int fd;
 		struct fdmon_ctx* mon;
+
+		/* If non-NULL, frames are sealed (encrypted) with this */
+		struct seal* seal;
 	} send, recv;
 
-	/* For buffering partial inbound & outbound messages */
+	/*
+	 * A pending switch of the send side to a new transport (see
+	 * mc_switch_send()), to happen once the TRANSPORTSWITCH marker (in
+	 * the send ring if 'marked' is set) has gone out via the old one.
+	 */
+	struct {
+		int pending;
+		int marked;
+		int fd;
+		struct seal* seal;
+	} sendswitch;
+
+	/*
+	 * Once either side has switched transports (i.e. 'saved' is set),
+	 * the file descriptors the msgchan was initialized with.  They're
+	 * kept open (closed by mc_close()), and the original receive side is
+	 * watched (via mon) so that the msgchan still errors out if whatever
+	 * it was connected to (e.g. an ssh process) goes away.
+	 */
+	struct {
+		int saved;
+		int send_fd, recv_fd;
+		struct fdmon_ctx* mon;
+	} orig;
+
+	/*
+	 * Optional unreliable datagram side-channel for relative pointer
+	 * motion (see mc_set_motion_send() and mc_set_motion_recv()), used in
+	 * one direction only.  dx and dy are the total motion sent or applied
+	 * so far in the current epoch; 'dirty' is set on the sending side
+	 * when some of that hasn't yet been followed by a MOTIONBARRIER.  On
+	 * the receiving side, 'ahead' holds the latest MOTION received that
+	 * can't be applied yet, either because it overtook the barrier ending
+	 * the current epoch or because 'held' is set (by a barrier, until the
+	 * message following it has been delivered).
+	 */
+	struct {
+		int fd;
+		int sending;
+		struct fdmon_ctx* mon;
+		struct seal* seal;
+		uint64_t seq;
+		uint32_t epoch;
+		int32_t dx, dy;
+		int dirty;
+		uint64_t last_sent;
+		timer_ctx_t settle_timer;
+		int held;
+		struct {
+			int valid;
+			uint32_t epoch;
+			int32_t dx, dy;
+		} ahead;
+	} motion;
+
+	/* For buffering partial inbound messages */
 	struct partrecv recv_msgbuf;
-	struct partsend send_msgbuf;
+
+	/*
+	 * Incremented by mc_clear() so that code calling out to callbacks can
+	 * tell if the msgchan got torn down underneath it.
+	 */
+	unsigned int generation;
+
+	/*
+	 * Ring of encoded outbound messages awaiting transmission, the first
+	 * of which may have been partially sent already.  The lane each
+	 * buffer's message came from is recorded alongside it, with a count
+	 * of how many from each lane are currently in the ring.
+	 */
+	struct {
+		struct partsend bufs[MAX_DRAIN_BUFS];
+		enum mc_lane lanes[MAX_DRAIN_BUFS];
+		unsigned int head;
+		unsigned int count;
+		unsigned int lanecount[MC_NUM_LANES];
+	} sendring;
 
 	/* Callbacks */
 	struct {
@@ -35,16 +148,78 @@ struct msgchan {
 		/* Called on error */
 		mc_err_cb_t err;
 
+		/*
+		 * Optional; called after each run of messages received at
+		 * once (i.e. everything that was available from one read)
+		 * has been passed to 'recv'.  Reset by mc_init().
+		 */
+		mc_recv_done_cb_t recv_done;
+
 		/* Opaque argument passed to callbacks */
 		void* arg;
 	} cb;
 
-	/* Buffer of pending messages to be sent */
+	/*
+	 * If non-NULL, traffic and timing statistics are accumulated here.
+	 * Reset by mc_init().
+	 */
+	struct mcstats* stats;
+
+	/* Buffers of pending messages to be sent, one per lane */
+	struct msgqueue sendqueue[MC_NUM_LANES];
+
+	/*
+	 * If set, a MOVEREL enqueued directly behind another (still-unsent)
+	 * MOVEREL is merged into it instead of being queued separately.
+	 * Reset by mc_init().
+	 */
+	int coalesce_motion;
+
+	/*
+	 * If batch_events is set, runs of consecutive queued input events
+	 * (motion, clicks, keys) are sent as a single EVENTBATCH message.  If
+	 * batch_window is also non-zero, transmission of input events is
+	 * deferred by up to that many microseconds to allow a batch to
+	 * accumulate.  Both reset by mc_init().
+	 */
+	int batch_events;
+	uint64_t batch_window;
+	timer_ctx_t batch_timer;
+
+	/*
+	 * If set (which requires the other end to have agreed to it),
+	 * outbound clipboard streams are zlib-compressed.  Reset by
+	 * mc_init().
+	 */
+	int compress_clipboard;
+
+	/*
+	 * Outbound clipboard text too large to go in a single SETCLIPBOARD,
+	 * streamed out as CLIPBEGIN/CLIPCHUNK.../CLIPEND a piece at a time
+	 * whenever there's nothing else waiting to be sent.  If compressed,
+	 * zs is the deflate state and zbuf holds the chunk being produced.
+	 */
 	struct {
-		struct message* head;
-		struct message* tail;
-		int num_queued;
-	} sendqueue;
+		char* text;
+		size_t len;
+		size_t sent;
+		int begun;
+		struct z_stream_s* zs;
+		char* zbuf;
+	} clipsend;
+
+	/*
+	 * Inbound clipboard text being reassembled from CLIPCHUNKs (via
+	 * inflate state zs if compressed, zdone being set once the
+	 * compressed stream has ended).
+	 */
+	struct {
+		char* text;
+		size_t len;
+		size_t received;
+		struct z_stream_s* zs;
+		int zdone;
+	} cliprecv;
 };
 
 void mc_clear(struct msgchan* mc);
@@ -55,4 +230,10 @@ void mc_init(struct msgchan* mc, int send_fd, int recv_fd,
              mc_recv_cb_t recv_cb, mc_err_cb_t err_cb, void* cb_arg);
 void mc_close(struct msgchan* mc);
 
+void mc_switch_send(struct msgchan* mc, int fd, struct seal* seal);
+int mc_switch_recv(struct msgchan* mc, int fd, struct seal* seal);
+
+void mc_set_motion_send(struct msgchan* mc, int fd, struct seal* seal);
+void mc_set_motion_recv(struct msgchan* mc, int fd, struct seal* seal);
+
 #endif /* MSGCHAN_H */
@@ -20,6 +20,8 @@
 #include "platform.h"
 #include "osx-keycodes.h"
 #include "events.h"
+#include "timerheap.h"
+#include "stats.h"
 
 #if CGFLOAT_IS_DOUBLE
 #define cground lround
@@ -59,13 +61,28 @@ struct gamma_table {
 	uint32_t numents;
 };
 
+/* A display's gamma table scaled for a given (quantized) brightness level */
+struct scaled_gamma {
+	int level;
+	unsigned int lastuse;
+	struct gamma_table table;
+};
+
 struct displayinfo {
 	CGDirectDisplayID id;
 	struct rectangle bounds;
 	struct gamma_table orig_gamma;
-	struct gamma_table alt_gamma;
+
+	/* Brightness level currently applied (-1 if not yet known) */
+	int level;
+
+	/* Recently-used scaled tables (slots not yet used having no entries) */
+	struct scaled_gamma gamma_cache[GAMMA_CACHE_SLOTS];
 };
 
+/* For tracking how recently each cached table was used */
+static unsigned int gamma_cache_clock;
+
 struct displayinfo* displays;
 static uint32_t num_displays;
 
@@ -92,8 +109,8 @@ static void init_display(struct displayinfo* d, CGDirectDisplayID id)
 	CGRect bounds;
 
 	d->id = id;
+	d->level = -1;
 	setup_gamma_table(&d->orig_gamma, CGDisplayGammaTableCapacity(d->id));
-	setup_gamma_table(&d->alt_gamma, d->orig_gamma.numents);
 
 	cgerr = CGGetDisplayTransferByTable(d->id, d->orig_gamma.numents, d->orig_gamma.red,
 	                                    d->orig_gamma.green, d->orig_gamma.blue, &numents);
@@ -101,13 +118,11 @@ static void init_display(struct displayinfo* d, CGDirectDisplayID id)
 		initerr("CGGetDisplayTransferByTable() failed (%d)\n", cgerr);
 		initerr("brightness adjustment will disabled\n");
 		clear_gamma_table(&d->orig_gamma);
-		clear_gamma_table(&d->alt_gamma);
 	} else if (numents != d->orig_gamma.numents) {
 		initerr("CGGetDisplayTransferByTable() behaves strangely: %u != %u\n",
 		        numents, d->orig_gamma.numents);
 		assert(numents < d->orig_gamma.numents);
 		d->orig_gamma.numents = numents;
-		d->alt_gamma.numents = numents;
 	}
 
 	bounds = CGDisplayBounds(d->id);
@@ -169,7 +184,7 @@ int platform_init(struct kvmap* params, mousepos_handler_t* mouse_handler)
 		return -1;
 	}
 
-	displays = xmalloc(num_displays * sizeof(*displays));
+	displays = xcalloc(num_displays * sizeof(*displays));
 
 	/* Initialize to "normal" gamma */
 	CGDisplayRestoreColorSyncSettings();
@@ -186,6 +201,12 @@ int platform_init(struct kvmap* params, mousepos_handler_t* mouse_handler)
 		return -1;
 	}
 
+	evsource = CGEventSourceCreate(kCGEventSourceStateHIDSystemState);
+	if (!evsource) {
+		initerr("CGEventSourceCreate() failed\n");
+		return -1;
+	}
+
 	osx_keycodes_init();
 
 	if (opmode == MASTER)
@@ -199,16 +220,18 @@ int platform_init(struct kvmap* params, mousepos_handler_t* mouse_handler)
 
 void platform_exit(void)
 {
-	uint32_t i;
+	uint32_t i, j;
 
 	osx_keycodes_exit();
 
+	CFRelease(evsource);
 	CFRelease(clipboard);
 	CGDisplayRestoreColorSyncSettings();
 
 	for (i = 0; i < num_displays; i++) {
 		clear_gamma_table(&displays[i].orig_gamma);
-		clear_gamma_table(&displays[i].alt_gamma);
+		for (j = 0; j < GAMMA_CACHE_SLOTS; j++)
+			clear_gamma_table(&displays[i].gamma_cache[j].table);
 	}
 }
 
@@ -245,21 +268,42 @@ struct osxhotkey {
 static struct osxhotkey* hotkeys;
 static unsigned int num_hotkeys;
 
+/* Virtual keycodes all fit in 7 bits */
+#define NUM_CGKEYCODES 128
+
+/*
+ * The modifier flags hotkeys can use happen to be four consecutive bits,
+ * which makes for a conveniently small table index.
+ */
+#define HOTKEY_MODFLAGS (kCGEventFlagMaskShift|kCGEventFlagMaskControl \
+                         |kCGEventFlagMaskAlternate|kCGEventFlagMaskCommand)
+#define HOTKEY_MODSHIFT 17
+
+_Static_assert(HOTKEY_MODFLAGS >> HOTKEY_MODSHIFT == 0xf,
+               "unexpected modifier flag values");
+
+/*
+ * Index (plus one, so zero means none) into 'hotkeys' of the hotkey bound
+ * to each keycode with each combination of modifiers, so that matching a
+ * key event is a couple of array lookups.  (Indices rather than pointers
+ * since 'hotkeys' gets realloc()ed.)
+ */
+static uint16_t hotkey_table[NUM_CGKEYCODES][1U << 4];
+
 struct hotkey_context {
 	uint32_t modmask;
 };
 
 static struct osxhotkey* find_hotkey(uint32_t keycode, uint32_t modmask)
 {
-	struct osxhotkey* hk;
+	unsigned int idx;
 
-	for (hk = hotkeys; hk < hotkeys + num_hotkeys; hk++) {
-		if (hk->keycode == keycode && hk->modmask == modmask) {
-			return hk;
-		}
-	}
+	if (keycode >= NUM_CGKEYCODES || (modmask & ~HOTKEY_MODFLAGS))
+		return NULL;
 
-	return NULL;
+	idx = hotkey_table[keycode][modmask >> HOTKEY_MODSHIFT];
+
+	return idx ? &hotkeys[idx - 1] : NULL;
 }
 
 static struct osxhotkey* do_hotkey(uint32_t keycode, uint32_t modmask)
@@ -317,12 +361,15 @@ int bind_hotkey(const char* keystr, hotkey_callback_t cb, void* arg)
 	if (parse_keystring(keystr, &kc, &modmask))
 		return -1;
 
-	for (hk = hotkeys; hk < hotkeys + num_hotkeys; hk++) {
-		if (hk->modmask == modmask && hk->keycode == kc) {
-			initerr("hotkey '%s' conflicts with an earlier hotkey binding\n",
-			        keystr);
-			return -1;
-		}
+	if (kc >= NUM_CGKEYCODES || (modmask & ~HOTKEY_MODFLAGS)) {
+		initerr("unsupported hotkey '%s'\n", keystr);
+		return -1;
+	}
+
+	if (find_hotkey(kc, modmask)) {
+		initerr("hotkey '%s' conflicts with an earlier hotkey binding\n",
+		        keystr);
+		return -1;
 	}
 
 #ifndef EVENTTAP_HOTKEYS
@@ -344,6 +391,8 @@ int bind_hotkey(const char* keystr, hotkey_callback_t cb, void* arg)
 	hk->callback = cb;
 	hk->arg = arg;
 
+	hotkey_table[kc][modmask >> HOTKEY_MODSHIFT] = num_hotkeys;
+
 #ifndef EVENTTAP_HOTKEYS
 	/*
 	 * NOTE: if this is to be used, hk->modmask will need to be a mask of
@@ -411,13 +460,55 @@ static void scale_gamma_table(const struct gamma_table* from, struct gamma_table
 	}
 }
 
+/*
+ * Return the given display's gamma table scaled to the given brightness
+ * level, from the cache if it's there and otherwise computing it (in place of
+ * the least recently used one if the cache is full).
+ */
+static const struct gamma_table* get_scaled_gamma(struct displayinfo* d, int level)
+{
+	struct scaled_gamma* victim = &d->gamma_cache[0];
+	struct scaled_gamma* sg;
+	int i;
+
+	if (level == BRIGHTNESS_STEPS)
+		return &d->orig_gamma;
+
+	for (i = 0; i < GAMMA_CACHE_SLOTS; i++) {
+		sg = &d->gamma_cache[i];
+		if (sg->table.numents && sg->level == level) {
+			sg->lastuse = ++gamma_cache_clock;
+			return &sg->table;
+		}
+		if (!sg->table.numents
+		    || (victim->table.numents && sg->lastuse < victim->lastuse))
+			victim = sg;
+	}
+
+	if (!victim->table.numents)
+		setup_gamma_table(&victim->table, d->orig_gamma.numents);
+	scale_gamma_table(&d->orig_gamma, &victim->table, (float)level / BRIGHTNESS_STEPS);
+	victim->level = level;
+	victim->lastuse = ++gamma_cache_clock;
+
+	return &victim->table;
+}
+
 void set_display_brightness(float f)
 {
+	int level = quantize_brightness(f);
+	struct displayinfo* d;
 	uint32_t i;
 
 	for (i = 0; i < num_displays; i++) {
-		scale_gamma_table(&displays[i].orig_gamma, &displays[i].alt_gamma, f);
-		set_gamma_table(displays[i].id, &displays[i].alt_gamma);
+		d = &displays[i];
+
+		/* Skip displays already at that level (or with nothing to scale) */
+		if (d->level == level || !d->orig_gamma.numents)
+			continue;
+
+		set_gamma_table(d->id, get_scaled_gamma(d, level));
+		d->level = level;
 	}
 }
 
@@ -431,6 +522,12 @@ static inline uint32_t cgfloat_to_u32(CGFloat f)
 	return cground(f);
 }
 
+/*
+ * Event source for all injected events, created once (instead of per event
+ * by passing NULL).
+ */
+static CGEventSourceRef evsource;
+
 static CGPoint get_mousepos_cgpoint(void)
 {
 	CGPoint cgpt;
@@ -497,7 +594,7 @@ static void post_mouseevent(CGPoint cgpt, CGEventType type, CGMouseButton button
 	if (cgpt.y > CGRectGetMaxY(bounds))
 		cgpt.y = CGRectGetMaxY(bounds) - 0.1;
 
-	ev = CGEventCreateMouseEvent(NULL, type, cgpt, button);
+	ev = CGEventCreateMouseEvent(evsource, type, cgpt, button);
 	if (!ev) {
 		errlog("CGEventCreateMouseEvent failed\n");
 		abort();
@@ -648,9 +745,9 @@ void do_clickevent(mousebutton_t button, pressrel_t pr)
 	}
 
 	if (button == MB_SCROLLUP || button == MB_SCROLLDOWN)
-		ev = CGEventCreateScrollWheelEvent(NULL, kCGScrollEventUnitLine, 1, scrollamt);
+		ev = CGEventCreateScrollWheelEvent(evsource, kCGScrollEventUnitLine, 1, scrollamt);
 	else {
-		ev = CGEventCreateMouseEvent(NULL, cgtype, get_mousepos_cgpoint(), cgbtn);
+		ev = CGEventCreateMouseEvent(evsource, cgtype, get_mousepos_cgpoint(), cgbtn);
 		if (ev)
 			CGEventSetIntegerValueField(ev, kCGMouseEventClickState,
 			                            click_type(button, pr));
@@ -665,6 +762,38 @@ void do_clickevent(mousebutton_t button, pressrel_t pr)
 	CFRelease(ev);
 }
 
+/* Fractional notches left over from the last do_scroll() */
+static int32_t scroll_remainder;
+
+void do_scroll(int32_t amount)
+{
+	int32_t notches;
+	CGEventRef ev;
+
+	/* Ignore absurd amounts (which also keeps the sum below from overflowing) */
+	amount = clamp_scroll(amount);
+
+	/* Don't let leftovers from scrolling one way eat into the other */
+	if ((scroll_remainder < 0) != (amount < 0))
+		scroll_remainder = 0;
+
+	amount += scroll_remainder;
+	notches = amount / SCROLL_NOTCH;
+	scroll_remainder = amount % SCROLL_NOTCH;
+
+	if (!notches)
+		return;
+
+	ev = CGEventCreateScrollWheelEvent(evsource, kCGScrollEventUnitLine, 1, notches);
+	if (!ev) {
+		errlog("CGEventCreateScrollWheelEvent failed\n");
+		abort();
+	}
+	CGEventSetFlags(ev, modflags|kCGEventFlagMaskNonCoalesced);
+	CGEventPost(kCGHIDEventTap, ev);
+	CFRelease(ev);
+}
+
 static CGEventFlags key_eventflag(CGKeyCode cgk)
 {
 	switch (cgk) {
@@ -717,7 +846,7 @@ void do_keyevent(keycode_t key, pressrel_t pr)
 		CFRelease(ev);
 	}
 
-	ev = CGEventCreateKeyboardEvent(NULL, cgkc, pr == PR_PRESS);
+	ev = CGEventCreateKeyboardEvent(evsource, cgkc, pr == PR_PRESS);
 	if (!ev) {
 		errlog("CGEventCreateKeyboardEvent() failed\n");
 		abort();
@@ -732,7 +861,7 @@ void do_keyevent(keycode_t key, pressrel_t pr)
 	CFRelease(ev);
 }
 
-char* get_clipboard_text(void)
+static char* get_clipboard_text(void)
 {
 	OSStatus status;
 	PasteboardItemID itemid;
@@ -770,6 +899,12 @@ char* get_clipboard_text(void)
 	return txt;
 }
 
+/* The pasteboard is always immediately available. */
+void get_clipboard_text_async(clipboard_text_cb_t cb, void* arg)
+{
+	cb(get_clipboard_text(), arg);
+}
+
 int set_clipboard_text(const char* text)
 {
 	OSStatus status;
@@ -802,6 +937,34 @@ int set_clipboard_text(const char* text)
 	return ret;
 }
 
+int set_clipboard_text_owned(char* text)
+{
+	int ret = set_clipboard_text(text);
+
+	explicit_bzero(text, strlen(text));
+	xfree(text);
+
+	return ret;
+}
+
+/*
+ * Other programs read the pasteboard directly rather than asking us for its
+ * contents, so there's no holding them off.
+ */
+void hold_clipboard(void)
+{
+}
+
+void release_clipboard(void)
+{
+}
+
+/* (The pasteboard has no notion of ownership to lose.) */
+int watch_clipboard_ownership(clipboard_lost_handler_t* cb)
+{
+	return 0;
+}
+
 static struct xypoint saved_mousepos;
 
 int grab_inputs(void)
@@ -972,63 +1135,87 @@ void fdmon_unmonitor(struct fdmon_ctx* ctx, uint32_t flags)
 	fdmon_set_enabled_callbacks(ctx);
 }
 
-struct timerinfo {
-	CFRunLoopTimerRef timer;
-	void (*cbfn)(void* arg);
-	void* cbarg;
-};
+/*
+ * All scheduled calls live in a timerheap, with a single run-loop timer kept
+ * armed for the earliest of them (rather than one CFRunLoopTimer apiece).
+ */
+static struct timerheap timers;
+static CFRunLoopTimerRef heap_timer;
+
+/*
+ * Repeat interval of heap_timer (so that it doesn't get invalidated after
+ * firing), and also how far out we set it when no calls are pending.
+ */
+#define HEAP_TIMER_IDLE_INTERVAL (365.0 * 24.0 * 60.0 * 60.0)
 
-static void timer_callback(CFRunLoopTimerRef timer, void* info)
+static void rearm_heap_timer(void)
 {
-	struct timerinfo* ti = info;
+	uint64_t next, now;
+	CFAbsoluteTime delay;
 
-	ti->cbfn(ti->cbarg);
+	if (timerheap_next(&timers, &next)) {
+		now = get_microtime();
+		delay = next > now ? (CFAbsoluteTime)(next - now) / 1000000.0 : 0.0;
+	} else {
+		delay = HEAP_TIMER_IDLE_INTERVAL;
+	}
 
-	CFRunLoopRemoveTimer(CFRunLoopGetMain(), ti->timer, kCFRunLoopCommonModes);
-	CFRelease(ti->timer);
+	CFRunLoopTimerSetNextFireDate(heap_timer, CFAbsoluteTimeGetCurrent() + delay);
+}
 
-	xfree(ti);
+static void heap_timer_callback(CFRunLoopTimerRef timer, void* info)
+{
+	timerheap_run(&timers, get_microtime());
+	rearm_heap_timer();
 }
 
-timer_ctx_t schedule_call(void (*fn)(void* arg), void* arg, uint64_t delay)
+static void init_heap_timer(void)
 {
-	struct timerinfo* ti;
-	CFAbsoluteTime firetime;
-	CFRunLoopTimerContext timer_ctx = {
-		.version = 0,
-		.retain = NULL,
-		.release = NULL,
-		.copyDescription = NULL,
-	};
+	CFAbsoluteTime firetime = CFAbsoluteTimeGetCurrent() + HEAP_TIMER_IDLE_INTERVAL;
+
+	heap_timer = CFRunLoopTimerCreate(kCFAllocatorDefault, firetime,
+	                                  HEAP_TIMER_IDLE_INTERVAL, 0, 0,
+	                                  heap_timer_callback, NULL);
+	if (!heap_timer) {
+		errlog("CFRunLoopTimerCreate() failed\n");
+		abort();
+	}
+
+	CFRunLoopAddTimer(CFRunLoopGetMain(), heap_timer, kCFRunLoopCommonModes);
+}
 
-	firetime = CFAbsoluteTimeGetCurrent() + ((CFAbsoluteTime)delay / 1000000.0);
+/* Earliest pending call time, or UINT64_MAX if there are none */
+static uint64_t next_calltime(void)
+{
+	uint64_t next;
+	return timerheap_next(&timers, &next) ? next : UINT64_MAX;
+}
 
-	ti = xmalloc(sizeof(*ti));
+timer_ctx_t schedule_call(void (*fn)(void* arg), void* arg, uint64_t delay)
+{
+	timer_ctx_t timer;
+	uint64_t calltime = get_microtime() + delay;
+	int new_earliest = calltime < next_calltime();
 
-	timer_ctx.info = ti;
-	ti->cbfn = fn;
-	ti->cbarg = arg;
-	ti->timer = CFRunLoopTimerCreate(kCFAllocatorDefault, firetime, 0, 0, 0,
-	                                 timer_callback, &timer_ctx);
+	if (!heap_timer)
+		init_heap_timer();
 
-	CFRunLoopAddTimer(CFRunLoopGetMain(), ti->timer, kCFRunLoopCommonModes);
+	timer = timerheap_insert(&timers, fn, arg, calltime);
+	if (new_earliest)
+		rearm_heap_timer();
 
-	return ti;
+	return timer;
 }
 
 int cancel_call(timer_ctx_t timer)
 {
-	struct timerinfo* ti = timer;
-	CFStringRef mode = kCFRunLoopCommonModes;
-	CFRunLoopRef loop = CFRunLoopGetMain();
+	uint64_t before = next_calltime();
 
-	if (!CFRunLoopContainsTimer(loop, ti->timer, mode))
+	if (!timerheap_cancel(&timers, timer))
 		return 0;
 
-	CFRunLoopRemoveTimer(loop, ti->timer, mode);
-	CFRelease(ti->timer);
-
-	xfree(ti);
+	if (next_calltime() != before)
+		rearm_heap_timer();
 
 	return 1;
 }
@@ -1082,7 +1269,7 @@ static void handle_keyevent(CGEventRef ev, pressrel_t pr)
 
 	assert(is_remote(focused_node));
 
-	send_keyevent(focused_node->remote, etkc, pr);
+	forward_keyevent(etkc, pr);
 }
 
 static void handle_flagschanged(CGEventFlags oldflags, CGEventFlags newflags)
@@ -1096,7 +1283,7 @@ static void handle_flagschanged(CGEventFlags oldflags, CGEventFlags newflags)
 	for (i = 0; i < osx_modifiers.num; i++) {
 		if (osx_modifiers.keys[i].mask & changed) {
 			pr = (osx_modifiers.keys[i].mask & oldflags) ? PR_RELEASE : PR_PRESS;
-			send_keyevent(focused_node->remote, osx_modifiers.keys[i].etkey, pr);
+			forward_keyevent(osx_modifiers.keys[i].etkey, pr);
 		}
 	}
 }
@@ -1130,18 +1317,22 @@ static void handle_local_mousemove(CGEventRef ev)
  */
 static void handle_scrollevent(CGEventRef ev)
 {
-	mousebutton_t mb;
+	const double max = SCROLL_MAX_NOTCHES * SCROLL_NOTCH;
 	double scroll_units;
+	int32_t amount;
 
+	/*
+	 * In (fractional) lines, i.e. notches; trackpads and smooth-scrolling
+	 * mice produce lots of small ones, which the remote accumulates.
+	 * (Bounded here only so as to fit; send_scroll() clamps it properly.)
+	 */
 	scroll_units = CGEventGetDoubleValueField(ev, kCGScrollWheelEventFixedPtDeltaAxis1);
+	amount = lrint(fmax(-max, fmin(max, scroll_units * SCROLL_NOTCH)));
 
-	if (fabs(scroll_units) < 0.0001)
+	if (!amount)
 		return;
 
-	mb = scroll_units < 0.0 ? MB_SCROLLDOWN : MB_SCROLLUP;
-
-	send_clickevent(focused_node->remote, mb, PR_PRESS);
-	send_clickevent(focused_node->remote, mb, PR_RELEASE);
+	send_scroll(focused_node->remote, amount);
 }
 
 static CFMachPortRef evtapport;
@@ -1258,10 +1449,46 @@ static void setup_event_tap(void)
 	CFRelease(tapsrc);
 }
 
+/*
+ * Run-loop observer for stats collection, timing each pass of the run loop
+ * from its waking up to its next going back to sleep.
+ */
+static void evloop_stats_observer(CFRunLoopObserverRef obs, CFRunLoopActivity act,
+                                  void* info)
+{
+	static uint64_t last_wakeup;
+
+	if (act == kCFRunLoopAfterWaiting)
+		last_wakeup = get_microtime();
+	else if (last_wakeup)
+		hist_record(&evloop_busy, get_microtime() - last_wakeup);
+}
+
+static void setup_stats_observer(void)
+{
+	CFRunLoopObserverRef obs;
+
+	obs = CFRunLoopObserverCreate(kCFAllocatorDefault,
+	                              kCFRunLoopAfterWaiting|kCFRunLoopBeforeWaiting,
+	                              true, 0, evloop_stats_observer, NULL);
+	if (!obs) {
+		errlog("CFRunLoopObserverCreate() failed\n");
+		return;
+	}
+
+	CFRunLoopAddObserver(CFRunLoopGetMain(), obs, kCFRunLoopCommonModes);
+
+	/* As with tapsrc above, the run loop retains it */
+	CFRelease(obs);
+}
+
 void run_event_loop(void)
 {
 	if (opmode == MASTER)
 		setup_event_tap();
 
+	if (stats_enabled)
+		setup_stats_observer();
+
 	CFRunLoopRun();
 }
@@ -14,6 +14,9 @@ void move_mousepos(int32_t dx, int32_t dy);
 void do_clickevent(mousebutton_t button, pressrel_t pr);
 void do_keyevent(keycode_t key, pressrel_t pr);
 
+/* Scroll by the given amount (see struct scroll_body in proto.x). */
+void do_scroll(int32_t amount);
+
 /* An opaque, platform-dependent "context" type associated with a hotkey event. */
 typedef const struct hotkey_context* hotkey_context_t;
 typedef void (*hotkey_callback_t)(hotkey_context_t ctx, void* arg);
@@ -25,9 +28,37 @@ keycode_t* get_current_modifiers(void);
 int grab_inputs(void);
 void ungrab_inputs(int restore_mousepos);
 
-char* get_clipboard_text(void);
+/*
+ * Retrieve the clipboard contents, passing them (and ownership of the string)
+ * to cb when available, which may be either before or after this returns.
+ * Retrieval failure is reported as empty text.
+ */
+typedef void (*clipboard_text_cb_t)(char* text, void* arg);
+void get_clipboard_text_async(clipboard_text_cb_t cb, void* arg);
+
 int set_clipboard_text(const char* text);
 
+/* Like set_clipboard_text(), but takes ownership of (and frees) text. */
+int set_clipboard_text_owned(char* text);
+
+/*
+ * Hold off answering other programs' requests for the clipboard (taking
+ * ownership of it if need be) until the next set_clipboard_text*() or
+ * release_clipboard(), so that a paste made in the meantime gets the new
+ * contents about to be set rather than the current ones.  Platforms that
+ * can't do this implement these as no-ops.
+ */
+void hold_clipboard(void);
+void release_clipboard(void);
+
+/*
+ * Arrange for cb to be called whenever the clipboard changes hands (other
+ * than by a set_clipboard_text*()).  Returns zero if that can't be detected
+ * on this platform.
+ */
+typedef void (clipboard_lost_handler_t)(void);
+int watch_clipboard_ownership(clipboard_lost_handler_t* cb);
+
 void set_display_brightness(float f);
 
 /*
@@ -31,7 +31,21 @@ enum msgtype_t {
 	MT_GETCLIPBOARD,
 	MT_SETCLIPBOARD,
 	MT_LOGMSG,
-	MT_SETBRIGHTNESS
+	MT_SETBRIGHTNESS,
+	MT_EVENTBATCH,
+	MT_CLIPBEGIN,
+	MT_CLIPCHUNK,
+	MT_CLIPEND,
+	MT_CHECKCLIPBOARD,
+	MT_CLIPBOARDUNCHANGED,
+	MT_TRANSPORTSWITCH,
+	MT_MOTION,
+	MT_MOTIONBARRIER,
+	MT_SCROLL,
+	MT_PING,
+	MT_PONG,
+	MT_CLIPPENDING,
+	MT_CLIPBOARDLOST
 };
 
 /* Screen position (e.g. for the mouse pointer), with 0,0 at the top left. */
@@ -74,19 +88,25 @@ struct setup_body {
 /*
  * READY: the first message sent by a newly-alive remote in response to
  * receiving a SETUP from the master.  Informs the master of the remote's
- * display dimensions.
+ * display dimensions, and (via an unstructured kvmap like that of SETUP)
+ * which of the optional features offered in the SETUP it has accepted.
  *
  * No reply expected.
  */
 struct ready_body {
 	rectangle screendim;
+	kvpair params<>;
 };
 
 /*
  * MOVEREL: sent by the master to a remote to instruct it move the mouse
  * pointer relative to its current position.
  *
- * Should trigger a MOUSEPOS in reply.
+ * Should trigger a MOUSEPOS in reply -- unless the SETUP params included an
+ * "edge-mask" (a decimal dirmask_t), in which case a MOUSEPOS need only be
+ * sent when the set of those screen edges the pointer is at changes.  A
+ * run of MOVERELs received together may be answered with a single MOUSEPOS
+ * giving the position after the last of them.
  */
 struct moverel_body {
 	int32_t dx;
@@ -133,6 +153,22 @@ struct keyevent_body {
 	uint32_t pressrel;
 };
 
+/*
+ * SCROLL: sent by the master to a remote to scroll (vertically) by the
+ * given amount, in units of 1/SCROLL_NOTCH of a wheel notch (so as to allow
+ * for smooth scrolling); positive is up, negative down.  The remote
+ * carries any fractional notches over to the next SCROLL, and ignores
+ * anything beyond SCROLL_MAX_NOTCHES notches (either way) in a single one.
+ *
+ * No reply expected.
+ */
+const SCROLL_NOTCH = 120;
+const SCROLL_MAX_NOTCHES = 64;
+
+struct scroll_body {
+	int32_t amount;
+};
+
 /*
  * GETCLIPBOARD: sent by the master to a remote to retrieve the contents of
  * the remote's clipboard.
@@ -153,6 +189,157 @@ struct setclipboard_body {
 	string text<>;
 };
 
+/* Encodings of the data carried by CLIPCHUNKs */
+enum clipencoding_t {
+	CE_NONE = 0,
+	CE_ZLIB
+};
+
+/*
+ * CLIPBEGIN, CLIPCHUNK, CLIPEND: a large SETCLIPBOARD may instead be sent
+ * split up into a CLIPBEGIN giving the total length of the text, a sequence
+ * of CLIPCHUNKs carrying successive pieces of it, and a CLIPEND, so that
+ * other messages can be interleaved with it in transit.  The end result is
+ * exactly equivalent to a SETCLIPBOARD of the concatenated chunks.  A
+ * CLIPBEGIN or SETCLIPBOARD arriving during a transfer supersedes it.
+ *
+ * With CE_ZLIB encoding (which may only be used if both sides have agreed
+ * on it via the SETUP and READY params), the concatenated chunks form a
+ * single zlib stream rather than the raw text; the CLIPBEGIN length is
+ * always that of the raw text.
+ *
+ * CLIPEND messages have no body content.
+ *
+ * No reply expected.
+ */
+struct clipbegin_body {
+	uint32_t length;
+	clipencoding_t encoding;
+};
+
+struct clipchunk_body {
+	opaque data<>;
+};
+
+/*
+ * A cheaply-comparable summary of some clipboard text: its length and 64-bit
+ * FNV-1a hash.
+ */
+struct cliphash {
+	unsigned hyper hash;
+	uint32_t length;
+};
+
+/*
+ * CHECKCLIPBOARD: sent by the master to a remote in place of a GETCLIPBOARD
+ * when the master knows what the remote's clipboard was last set to (or
+ * retrieved as).
+ *
+ * Should trigger a CLIPBOARDUNCHANGED in reply if the remote's clipboard
+ * still matches the given hash, or a SETCLIPBOARD if it doesn't.
+ */
+struct checkclipboard_body {
+	cliphash expect;
+};
+
+/*
+ * CLIPBOARDUNCHANGED: sent by a remote to the master in response to a
+ * CHECKCLIPBOARD when its clipboard matches, or by the master to a remote
+ * after a CLIPPENDING to say that no new contents are coming after all.
+ *
+ * CLIPBOARDUNCHANGED messages have no body content.
+ *
+ * No reply expected.
+ */
+
+/*
+ * CLIPPENDING: sent by the master to a remote it's switching focus to,
+ * ahead of any of the input events that follow, when new clipboard contents
+ * may be on their way to it.  Until they arrive (as a SETCLIPBOARD, possibly
+ * streamed) or a CLIPBOARDUNCHANGED says none are coming, the remote should
+ * hold off answering other programs' requests for its clipboard, so that a
+ * paste made straight away gets the new contents rather than the old.
+ *
+ * CLIPPENDING messages have no body content.
+ *
+ * No reply expected.
+ */
+
+/*
+ * CLIPBOARDLOST: sent by a remote (one that advertised "clipboard-ownership"
+ * in its READY, in response to a "clipboard-hashing" SETUP parameter) to the
+ * master when its clipboard changes hands other than by way of a SETCLIPBOARD,
+ * so that the master stops assuming it knows what the remote's clipboard
+ * holds.
+ *
+ * CLIPBOARDLOST messages have no body content.
+ *
+ * No reply expected.
+ */
+
+/*
+ * TRANSPORTSWITCH: sent by either side as the last message via the ssh
+ * connection when moving over to a direct connection (as negotiated via the
+ * SETUP and READY params); everything the sender sends after it goes via
+ * the direct connection instead.  The master sends it once it has connected
+ * to the address given in the READY params, and the remote in response to
+ * the master's.  The master follows it with a PING (via the direct
+ * connection), since the remote only takes a connection to be the master's
+ * once a frame from it has opened with the master's key, dropping any that
+ * don't.
+ *
+ * TRANSPORTSWITCH messages have no body content.
+ */
+
+/*
+ * MOTION: sent by the master to a remote, only ever as a datagram via the
+ * motion side-channel (as negotiated via the SETUP and READY params, which
+ * requires a direct transport), in place of MOVERELs.  Pointer motion is
+ * divided into epochs; each MOTION gives the total relative motion so far
+ * in the given epoch, so with the remote applying whatever it hasn't yet,
+ * only the latest one received matters and lost datagrams are simply
+ * subsumed by later ones.  Each datagram's sequence number (outside of the
+ * message itself) is greater than that of all previous ones, so stale or
+ * replayed ones can be discarded.
+ *
+ * MOTIONBARRIER: sent by the master via the (reliable) message stream to
+ * end an epoch, giving its final total motion, before anything that needs
+ * to happen at the resulting pointer position (e.g. a click), and after
+ * motion has been idle for a little while.  Subsequent MOTIONs are in the
+ * next epoch.  If 'hold' is set (i.e. the barrier is immediately followed
+ * by such a message), the remote holds off on applying any of that until
+ * after the next interactive message has been processed.
+ *
+ * No reply expected to either, beyond the MOUSEPOS that would follow an
+ * equivalent MOVEREL.
+ */
+struct motion_body {
+	uint32_t epoch;
+	int32_t dx;
+	int32_t dy;
+};
+
+struct motionbarrier_body {
+	uint32_t epoch;
+	int32_t dx;
+	int32_t dy;
+	bool hold;
+};
+
+/*
+ * PING: sent periodically by the master to each connected remote as a
+ * heartbeat, with a sequence number and the master's get_microtime() at the
+ * time of sending.
+ *
+ * Should trigger a PONG in reply, echoing the same body back, from which the
+ * master measures the round-trip time (and by whose absence it detects a
+ * dead connection).
+ */
+struct ping_body {
+	uint32_t seq;
+	unsigned hyper timestamp;
+};
+
 /*
  * LOGMSG: sent by remotes to the master to write a message to the log.
  * Log-level filtering is done on the remotes (so that this already-chatty
@@ -175,6 +362,36 @@ struct setbrightness_body {
 	float brightness;
 };
 
+/*
+ * A single input event as carried in an EVENTBATCH; the bodies are the same
+ * as those of the corresponding standalone messages.
+ */
+union inputevent switch (msgtype_t type) {
+case MT_MOVEREL:
+	moverel_body moverel;
+case MT_MOVEABS:
+	moveabs_body moveabs;
+case MT_CLICKEVENT:
+	clickevent_body clickevent;
+case MT_KEYEVENT:
+	keyevent_body keyevent;
+case MT_SCROLL:
+	scroll_body scroll;
+};
+
+/*
+ * EVENTBATCH: sent by the master to a remote in place of a run of
+ * consecutive MOVEREL, MOVEABS, CLICKEVENT, KEYEVENT and SCROLL messages.  The
+ * events are to be performed in order, exactly as if they had arrived
+ * individually.
+ *
+ * Should trigger a single MOUSEPOS in reply if the batch contained at least
+ * one MOVEREL (reflecting the pointer position after the entire batch).
+ */
+struct eventbatch_body {
+	inputevent events<>;
+};
+
 union msgbody switch (msgtype_t type) {
 case MT_SETUP:
 	setup_body setup;
@@ -198,4 +415,32 @@ case MT_LOGMSG:
 	logmsg_body logmsg;
 case MT_SETBRIGHTNESS:
 	setbrightness_body setbrightness;
+case MT_EVENTBATCH:
+	eventbatch_body eventbatch;
+case MT_CLIPBEGIN:
+	clipbegin_body clipbegin;
+case MT_CLIPCHUNK:
+	clipchunk_body clipchunk;
+case MT_CLIPEND:
+	void;
+case MT_CHECKCLIPBOARD:
+	checkclipboard_body checkclipboard;
+case MT_CLIPBOARDUNCHANGED:
+	void;
+case MT_TRANSPORTSWITCH:
+	void;
+case MT_MOTION:
+	motion_body motion;
+case MT_MOTIONBARRIER:
+	motionbarrier_body motionbarrier;
+case MT_SCROLL:
+	scroll_body scroll;
+case MT_PING:
+	ping_body ping;
+case MT_PONG:
+	ping_body pong;
+case MT_CLIPPENDING:
+	void;
+case MT_CLIPBOARDLOST:
+	void;
 };
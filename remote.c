@@ -1,26 +1,74 @@
 
 #include <string.h>
 #include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include "types.h"
 #include "platform.h"
 #include "misc.h"
+#include "seal.h"
 
 /* msgchan attached to stdin & stdout  */
 struct msgchan stdio_msgchan;
 
 static int initialized = 0;
 
+/*
+ * Persistent-session state (see below): how long (in microseconds) to
+ * linger after losing the connection to the master (zero if not
+ * persisting), the session's ID and token, the socket it's listening for
+ * reattachment on, and the connection from the process whose stdin and
+ * stdout we're currently using in place of our own (-1 if none).  'attached'
+ * is cleared while there's no connection to the master at all.
+ */
+#define SESSION_ID_LEN 8
+#define SESSION_TOKEN_LEN 16
+
+static struct {
+	uint64_t linger;
+	char id[2 * SESSION_ID_LEN + 1];
+	char token[2 * SESSION_TOKEN_LEN + 1];
+	char* path;
+	int listenfd;
+	struct fdmon_ctx* listenmon;
+	int attachfd;
+	int attached;
+	timer_ctx_t linger_timer;
+} session = { .listenfd = -1, .attachfd = -1, .attached = 1, };
+
+static void stop_session(void);
+
 static void shutdown_remote(void)
 {
-	mc_close(&stdio_msgchan);
+	if (session.attached)
+		mc_close(&stdio_msgchan);
+
+	stop_session();
 
 	if (initialized)
 		platform_exit();
 }
 
+/* Whether there's currently a connection to the master to send anything on */
+int remote_attached(void)
+{
+	return session.attached;
+}
+
 static void enqueue_message(struct message* msg)
 {
+	/* Nobody to tell while detached; the master gets a fresh READY */
+	if (!session.attached) {
+		free_message(msg);
+		return;
+	}
+
 	if (mc_enqueue_message(&stdio_msgchan, msg)) {
 		/* This isn't likely to actually get anywhere, but... */
 		errlog("failed to enqueue message\n");
@@ -28,16 +76,571 @@ static void enqueue_message(struct message* msg)
 	}
 }
 
-static void handle_message(const struct message* msg)
+/*
+ * If set (via the "edge-mask" SETUP parameter), the master only wants to
+ * hear about pointer movement that changes which of the screen edges in
+ * edge_filter.mask the pointer is at.
+ */
+static struct {
+	int enabled;
+	dirmask_t mask;
+	dirmask_t last;
+	struct rectangle screen;
+} edge_filter;
+
+#ifdef HAVE_OPENSSL
+/*
+ * A connection accepted on the direct-transport socket, which may or may not
+ * be from the master: it's only taken to be once its first frame opens with
+ * the master's key.  Until then, 'got' bytes of that frame (header included)
+ * have been read into 'frame' (allocated once the header's complete).
+ */
+struct direct_conn {
+	int fd;
+	struct fdmon_ctx* mon;
+	struct seal* seal;
+	char hdr[MSGHDR_SIZE];
+	char* frame;
+	uint32_t framelen;
+	size_t got;
+	struct direct_conn* next;
+};
+
+/*
+ * Direct-transport state (see the description in main.c): the sockets the
+ * master is to connect and send motion datagrams to (motionfd being -1 if
+ * the motion side-channel isn't in use), and the keys it sent.  Connections
+ * to listenfd are accepted (onto 'conns') as they arrive; the master's,
+ * once found, is set aside in 'conn' along with its (decoded) first
+ * message until its TRANSPORTSWITCH has arrived via ssh ('switching').
+ */
+static struct {
+	int listenfd;
+	struct fdmon_ctx* listenmon;
+	struct direct_conn* conns;
+	unsigned int numconns;
+
+	struct direct_conn* conn;
+	struct message first;
+
+	int switching;
+	timer_ctx_t timer;
+
+	int motionfd;
+	unsigned char masterkey[SEAL_KEY_LEN];
+	unsigned char remotekey[SEAL_KEY_LEN];
+	unsigned char motionkey[SEAL_KEY_LEN];
+} direct = { .listenfd = -1, .motionfd = -1, };
+
+/*
+ * How long to wait for the master's connection to show up and identify
+ * itself after its TRANSPORTSWITCH arrives (it sends that only once its
+ * connect() has completed, and follows it with a PING via the new
+ * connection, so normally no time at all).
+ */
+#define DIRECT_SWITCH_TIMEOUT_US (5 * 1000 * 1000)
+
+/* Most not-yet-identified connections to hold open at once */
+#define DIRECT_MAX_CONNS 8
+
+/* Largest first frame we'll read from a not-yet-identified connection */
+#define DIRECT_FIRST_FRAME_MAX (64 * 1024)
+
+/*
+ * Create a socket of the given type bound to an ephemeral port on the given
+ * (numeric) address, listening if it's a stream socket, and write the port
+ * it got to 'port'.  Returns the socket, or negative on failure.
+ */
+static int bind_direct_socket(const char* addr, int socktype, char* port,
+                              size_t portlen)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV|AI_PASSIVE,
+		.ai_socktype = socktype,
+	};
+	struct addrinfo* ai;
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	int fd;
+
+	if (getaddrinfo(addr, "0", &hints, &ai)) {
+		warn("can't parse address '%s'\n", addr);
+		return -1;
+	}
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0) {
+		warn("socket: %s\n", strerror(errno));
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen)
+	    || (socktype == SOCK_STREAM && listen(fd, 1))
+	    || getsockname(fd, (struct sockaddr*)&sa, &salen)
+	    || getnameinfo((struct sockaddr*)&sa, salen, NULL, 0, port, portlen,
+	                   NI_NUMERICSERV)) {
+		warn("failed to set up direct-transport socket: %s\n", strerror(errno));
+		freeaddrinfo(ai);
+		close(fd);
+		return -1;
+	}
+	freeaddrinfo(ai);
+
+	set_fd_cloexec(fd, 1);
+
+	return fd;
+}
+
+static void free_direct_conn(struct direct_conn* dc)
+{
+	fdmon_unregister(dc->mon);
+	close(dc->fd);
+	free_seal(dc->seal);
+	if (dc->frame) {
+		explicit_bzero(dc->frame, dc->got);
+		xfree(dc->frame);
+	}
+	xfree(dc);
+}
+
+/* Close the listening socket and any connections accepted on it. */
+static void close_direct_conns(void)
+{
+	struct direct_conn* dc;
+
+	if (direct.listenfd >= 0) {
+		fdmon_unregister(direct.listenmon);
+		close(direct.listenfd);
+		direct.listenfd = -1;
+	}
+
+	while (direct.conns) {
+		dc = direct.conns;
+		direct.conns = dc->next;
+		free_direct_conn(dc);
+	}
+	direct.numconns = 0;
+}
+
+/* Drop all direct-transport state not (yet) handed over to the msgchan. */
+static void clear_direct_transport(void)
+{
+	close_direct_conns();
+
+	if (direct.conn) {
+		free_direct_conn(direct.conn);
+		direct.conn = NULL;
+		free_msgbody(&direct.first);
+	}
+
+	if (direct.timer) {
+		cancel_call(direct.timer);
+		direct.timer = NULL;
+	}
+	direct.switching = 0;
+
+	if (direct.motionfd >= 0) {
+		close(direct.motionfd);
+		direct.motionfd = -1;
+	}
+
+	explicit_bzero(&direct.masterkey, sizeof(direct.masterkey));
+	explicit_bzero(&direct.remotekey, sizeof(direct.remotekey));
+	explicit_bzero(&direct.motionkey, sizeof(direct.motionkey));
+}
+
+static void direct_read_cb(struct fdmon_ctx* ctx, void* arg);
+
+static void direct_accept_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	struct direct_conn* dc;
+	struct direct_conn** p;
+	int fd = accept(direct.listenfd, NULL, NULL);
+
+	if (fd < 0)
+		return;
+
+	/* Make room if need be by dropping the longest-standing one */
+	if (direct.numconns >= DIRECT_MAX_CONNS) {
+		for (p = &direct.conns; (*p)->next; p = &(*p)->next)
+			;
+		free_direct_conn(*p);
+		*p = NULL;
+		direct.numconns -= 1;
+	}
+
+	dc = xcalloc(sizeof(*dc));
+	dc->fd = fd;
+	dc->seal = new_seal(direct.masterkey);
+	if (!dc->seal) {
+		errlog("failed to set up direct-transport seal\n");
+		close(fd);
+		xfree(dc);
+		return;
+	}
+
+	set_fd_nonblock(fd, 1);
+	set_fd_cloexec(fd, 1);
+	set_tcp_nodelay(fd);
+
+	dc->mon = fdmon_register_fd(fd, direct_read_cb, NULL, dc);
+	fdmon_monitor(dc->mon, FM_READ);
+
+	dc->next = direct.conns;
+	direct.conns = dc;
+	direct.numconns += 1;
+}
+
+/*
+ * Read (more of) the first frame from the given connection.  Returns positive
+ * once it's all arrived, zero if there's more to come, or negative if the
+ * connection's failed or is clearly not the master's.  Reads no further than
+ * the end of that frame, leaving the rest for the msgchan.
+ */
+static int read_direct_frame(struct direct_conn* dc)
+{
+	ssize_t status;
+	uint32_t len;
+
+	for (;;) {
+		if (dc->got < MSGHDR_SIZE)
+			status = read(dc->fd, dc->hdr + dc->got, MSGHDR_SIZE - dc->got);
+		else if (dc->got < MSGHDR_SIZE + dc->framelen)
+			status = read(dc->fd, dc->frame + dc->got,
+			              MSGHDR_SIZE + dc->framelen - dc->got);
+		else
+			return 1;
+
+		if (status < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		else if (status == 0)
+			return -1;
+
+		if (dc->got < MSGHDR_SIZE) {
+			dc->got += status;
+			if (dc->got < MSGHDR_SIZE)
+				continue;
+
+			memcpy(&len, dc->hdr, sizeof(len));
+			dc->framelen = ntohl(len);
+			if (dc->framelen > DIRECT_FIRST_FRAME_MAX)
+				return -1;
+			dc->frame = xmalloc(MSGHDR_SIZE + dc->framelen);
+			memcpy(dc->frame, dc->hdr, MSGHDR_SIZE);
+		} else {
+			dc->got += status;
+		}
+	}
+}
+
+static void mc_recv_done_cb(struct msgchan* mc, void* arg);
+static void handle_message(struct message* msg);
+
+/*
+ * With both the master's connection identified and its TRANSPORTSWITCH
+ * received, move the msgchan over onto the connection and act on the first
+ * message that came via it.
+ */
+static void finish_switch_transport(void)
+{
+	struct direct_conn* dc = direct.conn;
+	struct seal* out;
+	struct seal* in;
+
+	cancel_call(direct.timer);
+	direct.timer = NULL;
+	direct.switching = 0;
+	direct.conn = NULL;
+
+	fdmon_unregister(dc->mon);
+
+	out = new_seal(direct.remotekey);
+	explicit_bzero(direct.masterkey, sizeof(direct.masterkey));
+	explicit_bzero(direct.remotekey, sizeof(direct.remotekey));
+
+	/* The msgchan takes over the fd and the seal (already past one frame) */
+	if (!out || mc_switch_recv(&stdio_msgchan, dc->fd, dc->seal)) {
+		errlog("failed to switch to direct transport\n");
+		shutdown_remote();
+		exit(1);
+	}
+
+	mc_switch_send(&stdio_msgchan, dc->fd, out);
+	xfree(dc);
+
+	if (direct.motionfd >= 0) {
+		in = new_seal(direct.motionkey);
+		explicit_bzero(direct.motionkey, sizeof(direct.motionkey));
+		/* The master will be counting on it, so this is fatal too */
+		if (!in) {
+			errlog("failed to set up motion channel\n");
+			shutdown_remote();
+			exit(1);
+		}
+		mc_set_motion_recv(&stdio_msgchan, direct.motionfd, in);
+		direct.motionfd = -1;
+	}
+
+	vinfo("switched to direct transport\n");
+
+	handle_message(&direct.first);
+	free_msgbody(&direct.first);
+	mc_recv_done_cb(&stdio_msgchan, NULL);
+}
+
+/*
+ * fdmon callback for a connection accepted on the direct-transport socket:
+ * see whether its first frame is from the master, dropping it if not.
+ */
+static void direct_read_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	struct direct_conn* dc = arg;
+	struct direct_conn** p;
+	uint32_t bodylen;
+	int status = read_direct_frame(dc);
+
+	if (!status)
+		return;
+
+	for (p = &direct.conns; *p != dc; p = &(*p)->next)
+		;
+	*p = dc->next;
+	direct.numconns -= 1;
+
+	bodylen = dc->framelen;
+	if (status < 0 || open_frame(dc->seal, dc->frame, &bodylen)) {
+		vinfo("dropping unauthenticated direct-transport connection\n");
+		free_direct_conn(dc);
+		return;
+	}
+
+	/* See comment in mc_read_cb() in msgchan.c */
+	memset(&direct.first.body, 0, sizeof(direct.first.body));
+	if (decode_message(dc->frame + MSGHDR_SIZE, bodylen, &direct.first)) {
+		errlog("invalid message via direct transport\n");
+		shutdown_remote();
+		exit(1);
+	}
+	explicit_bzero(dc->frame, MSGHDR_SIZE + dc->framelen);
+	xfree(dc->frame);
+	dc->frame = NULL;
+
+	/* It's the one; nobody else gets a look in */
+	fdmon_unmonitor(dc->mon, FM_READ);
+	direct.conn = dc;
+	close_direct_conns();
+
+	if (direct.switching)
+		finish_switch_transport();
+}
+
+static void direct_timeout_cb(void* arg)
+{
+	direct.timer = NULL;
+	errlog("master's direct-transport connection never arrived\n");
+	shutdown_remote();
+	exit(1);
+}
+
+/*
+ * Set up the sockets for the master to connect (and possibly send motion
+ * datagrams) to, on the address ssh reached us at, and record their
+ * addresses in the READY params (unless that fails, in which case we just
+ * stay on ssh).
+ */
+static void offer_direct_transport(const struct kvmap* params,
+                                   struct kvmap* readyparams)
+{
+	const char* masterkey = kvmap_get(params, "direct-key-master");
+	const char* remotekey = kvmap_get(params, "direct-key-remote");
+	const char* motion = kvmap_get(params, "direct-motion");
+	const char* motionkey = kvmap_get(params, "direct-key-motion");
+	const char* sshconn = getenv("SSH_CONNECTION");
+	char addr[64], port[NI_MAXSERV], motionport[NI_MAXSERV];
+
+	if (!masterkey || !remotekey || seal_key_from_hex(masterkey, direct.masterkey)
+	    || seal_key_from_hex(remotekey, direct.remotekey)) {
+		warn("invalid direct-transport keys\n");
+		return;
+	}
+
+	/* "client-addr client-port server-addr server-port" */
+	if (!sshconn || sscanf(sshconn, "%*s %*s %63s", addr) != 1) {
+		vinfo("SSH_CONNECTION not set, declining direct transport\n");
+		goto fail;
+	}
+
+	direct.listenfd = bind_direct_socket(addr, SOCK_STREAM, port, sizeof(port));
+	if (direct.listenfd < 0)
+		goto fail;
+	set_fd_nonblock(direct.listenfd, 1);
+	direct.listenmon = fdmon_register_fd(direct.listenfd, direct_accept_cb,
+	                                     NULL, NULL);
+	fdmon_monitor(direct.listenmon, FM_READ);
+
+	kvmap_put(readyparams, "direct-transport", "tcp");
+	kvmap_put(readyparams, "direct-transport-addr", addr);
+	kvmap_put(readyparams, "direct-transport-port", port);
+
+	if (!motion || strcmp(motion, "udp") || !motionkey
+	    || seal_key_from_hex(motionkey, direct.motionkey))
+		return;
+
+	direct.motionfd = bind_direct_socket(addr, SOCK_DGRAM, motionport,
+	                                     sizeof(motionport));
+	if (direct.motionfd >= 0)
+		kvmap_put(readyparams, "direct-motion-port", motionport);
+
+	return;
+
+fail:
+	explicit_bzero(direct.masterkey, sizeof(direct.masterkey));
+	explicit_bzero(direct.remotekey, sizeof(direct.remotekey));
+}
+
+/*
+ * Handle the master's TRANSPORTSWITCH: once its connection has identified
+ * itself (possibly already), move the msgchan over onto it.
+ */
+static void switch_transport(void)
+{
+	if ((direct.listenfd < 0 && !direct.conn) || direct.switching) {
+		errlog("unexpected TRANSPORTSWITCH\n");
+		shutdown_remote();
+		exit(1);
+	}
+
+	direct.switching = 1;
+	direct.timer = schedule_call(direct_timeout_cb, NULL, DIRECT_SWITCH_TIMEOUT_US);
+
+	if (direct.conn)
+		finish_switch_transport();
+}
+#endif
+
+/* Set when relative motion has been applied but not yet reported */
+static int mousepos_pending;
+
+/*
+ * Whether the platform is reporting clipboard changes (see clipboard_lost_cb()),
+ * how many clipboard retrievals for the master are in progress, and whether
+ * the clipboard has changed during one (see send_clipboard_cb()).
+ */
+static int clipboard_watched;
+static unsigned int clipboard_fetches;
+static int clipboard_lost_midfetch;
+
+/* Report the pointer position to the master after a relative movement. */
+static void send_mousepos(void)
+{
+	struct message* msg;
+	struct xypoint pt = get_mousepos();
+	dirmask_t edges;
+
+	if (edge_filter.enabled) {
+		edges = point_edgemask(pt, &edge_filter.screen) & edge_filter.mask;
+		if (edges == edge_filter.last)
+			return;
+		edge_filter.last = edges;
+	}
+
+	msg = new_message(MT_MOUSEPOS);
+	MB(msg, mousepos).pt = pt;
+	enqueue_message(msg);
+}
+
+/*
+ * Perform a single input event from an EVENTBATCH, returning non-zero if it
+ * was a relative pointer movement.
+ */
+static int replay_inputevent(const struct inputevent* ev)
 {
+	switch (ev->type) {
+	case MT_MOVEREL:
+		move_mousepos(ev->inputevent_u.moverel.dx,
+		              ev->inputevent_u.moverel.dy);
+		return 1;
+
+	case MT_MOVEABS:
+		set_mousepos(ev->inputevent_u.moveabs.pt);
+		break;
+
+	case MT_CLICKEVENT:
+		do_clickevent(ev->inputevent_u.clickevent.button,
+		              ev->inputevent_u.clickevent.pressrel);
+		break;
+
+	case MT_KEYEVENT:
+		do_keyevent(ev->inputevent_u.keyevent.keycode,
+		            ev->inputevent_u.keyevent.pressrel);
+		break;
+
+	case MT_SCROLL:
+		do_scroll(ev->inputevent_u.scroll.amount);
+		break;
+
+	default:
+		errlog("unexpected event type in batch: %u\n", ev->type);
+		shutdown_remote();
+		exit(1);
+	}
+
+	return 0;
+}
+
+/*
+ * Completion callback for retrieving the clipboard in response to a
+ * GETCLIPBOARD (arg being NULL) or CHECKCLIPBOARD (arg pointing to the
+ * expected cliphash, which we free).
+ */
+static void send_clipboard_cb(char* text, void* arg)
+{
+	struct cliphash* expect = arg;
+	struct cliphash ch;
 	struct message* resp;
 
+	if (expect) {
+		hash_clipboard(text, &ch);
+		if (cliphash_eq(&ch, expect)) {
+			explicit_bzero(text, ch.length);
+			xfree(text);
+			text = NULL;
+		}
+		xfree(expect);
+	}
+
+	if (text) {
+		resp = new_message(MT_SETCLIPBOARD);
+		MB(resp, setclipboard).text = text;
+	} else {
+		resp = new_message(MT_CLIPBOARDUNCHANGED);
+	}
+
+	enqueue_message(resp);
+
+	/*
+	 * A change reported while this was being retrieved went out ahead of
+	 * it, but may not be reflected in it, so repeat it afterward.
+	 */
+	clipboard_fetches -= 1;
+	if (clipboard_lost_midfetch) {
+		enqueue_message(new_message(MT_CLIPBOARDLOST));
+		clipboard_lost_midfetch = !!clipboard_fetches;
+	}
+}
+
+static void handle_message(struct message* msg)
+{
+	struct cliphash* expect;
+	struct message* resp;
+	unsigned int i;
+	int moved;
+
 	switch (msg->body.type) {
 	case MT_MOVEREL:
 		move_mousepos(MB(msg, moverel).dx, MB(msg, moverel).dy);
-		resp = new_message(MT_MOUSEPOS);
-		MB(resp, mousepos).pt = get_mousepos();
-		enqueue_message(resp);
+		mousepos_pending = 1;
 		break;
 
 	case MT_MOVEABS:
@@ -53,20 +656,61 @@ static void handle_message(const struct message* msg)
 		do_keyevent(MB(msg, keyevent).keycode, MB(msg, keyevent).pressrel);
 		break;
 
+	case MT_SCROLL:
+		do_scroll(MB(msg, scroll).amount);
+		break;
+
 	case MT_GETCLIPBOARD:
-		resp = new_message(MT_SETCLIPBOARD);
-		MB(resp, setclipboard).text = get_clipboard_text();
-		enqueue_message(resp);
+		clipboard_fetches += 1;
+		get_clipboard_text_async(send_clipboard_cb, NULL);
+		break;
+
+	case MT_CHECKCLIPBOARD:
+		expect = xmalloc(sizeof(*expect));
+		*expect = MB(msg, checkclipboard).expect;
+		clipboard_fetches += 1;
+		get_clipboard_text_async(send_clipboard_cb, expect);
 		break;
 
 	case MT_SETCLIPBOARD:
-		set_clipboard_text(MB(msg, setclipboard).text);
+		set_clipboard_text_owned(MB(msg, setclipboard).text);
+		MB(msg, setclipboard).text = NULL;
 		break;
 
 	case MT_SETBRIGHTNESS:
 		set_display_brightness(MB(msg, setbrightness).brightness);
 		break;
 
+	case MT_CLIPPENDING:
+		/* Ended by the SETCLIPBOARD that follows (or this) */
+		hold_clipboard();
+		break;
+
+	case MT_CLIPBOARDUNCHANGED:
+		release_clipboard();
+		break;
+
+	case MT_PING:
+		resp = new_message(MT_PONG);
+		MB(resp, pong) = MB(msg, ping);
+		enqueue_message(resp);
+		break;
+
+	case MT_EVENTBATCH:
+		moved = 0;
+		for (i = 0; i < MB(msg, eventbatch).events.events_len; i++)
+			moved |= replay_inputevent(&MB(msg, eventbatch).events.events_val[i]);
+		/* One position update for the whole batch suffices */
+		if (moved)
+			mousepos_pending = 1;
+		break;
+
+#ifdef HAVE_OPENSSL
+	case MT_TRANSPORTSWITCH:
+		switch_transport();
+		break;
+#endif
+
 	default:
 		errlog("unhandled message type: %u\n", msg->body.type);
 		shutdown_remote();
@@ -74,43 +718,532 @@ static void handle_message(const struct message* msg)
 	}
 }
 
-/* Initialize the remote after receiving a SETUP message */
-static void handle_setup_msg(const struct message* msg)
+/*
+ * Persistent sessions
+ * ===================
+ *
+ * If the master asks for it (via a "persist" SETUP parameter giving a time
+ * in microseconds), the remote outlives the loss of its connection by up to
+ * that long, listening on a UNIX socket in a private per-user directory for
+ * the next connection to be handed over to it.  The socket is named for a
+ * session ID reported to the master in the READY along with a secret token.
+ *
+ * When the master reconnects it sends these back in its SETUP
+ * ("resume-session" and "resume-token").  The freshly-started remote
+ * connects to the session's socket and passes it the token, the SETUP and
+ * (via SCM_RIGHTS) its stdin and stdout, then simply waits (keeping the ssh
+ * session alive) until the persistent remote is done with them.  The
+ * persistent remote carries on using them, skipping platform
+ * initialization and replying with the screen dimensions it already has.
+ * If there's no session to resume, the new remote just starts up in the
+ * normal way.
+ */
+
+/* Sent (with the file descriptors) by a remote attaching to a session */
+struct session_attach {
+	char token[2 * SESSION_TOKEN_LEN];
+	uint32_t setuplen;
+};
+
+/* Upper bound on the size of a SETUP handed over with a session_attach */
+#define SESSION_SETUP_MAX (64 * 1024)
+
+/* How long to wait on the other end of a session socket connection */
+#define SESSION_IO_TIMEOUT_S 2
+
+/*
+ * A connection to the session socket whose session_attach (and SETUP, and
+ * the file descriptors that come with them) is still arriving.  'got' counts
+ * bytes of the session_attach and then the SETUP body following it.
+ */
+static struct {
+	int fd;
+	struct fdmon_ctx* mon;
+	timer_ctx_t timer;
+	struct session_attach att;
+	char* body;
+	size_t got;
+	int fds[2];
+} handshake = { .fd = -1, .fds = { -1, -1, }, };
+
+/* Forget the current handshake (without closing any of its FDs). */
+static void clear_handshake(void)
+{
+	fdmon_unregister(handshake.mon);
+	handshake.mon = NULL;
+	if (handshake.timer) {
+		cancel_call(handshake.timer);
+		handshake.timer = NULL;
+	}
+	explicit_bzero(&handshake.att, sizeof(handshake.att));
+	xfree(handshake.body);
+	handshake.body = NULL;
+	handshake.got = 0;
+	handshake.fd = -1;
+	handshake.fds[0] = handshake.fds[1] = -1;
+}
+
+/* Turn away the remote at the other end of the current handshake. */
+static void refuse_handshake(void)
+{
+	char reply = 'n';
+
+	if (write(handshake.fd, &reply, 1) < 0)
+		debug("failed to refuse session attach: %s\n", strerror(errno));
+
+	close(handshake.fd);
+	if (handshake.fds[0] >= 0) {
+		close(handshake.fds[0]);
+		close(handshake.fds[1]);
+	}
+	clear_handshake();
+}
+
+static void handshake_timeout_cb(void* arg)
+{
+	handshake.timer = NULL;
+	warn("timed out waiting for session attach\n");
+	refuse_handshake();
+}
+
+static int get_random_bytes(void* buf, size_t len)
+{
+	ssize_t status;
+	size_t done = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	while (done < len) {
+		status = read(fd, (char*)buf + done, len - done);
+		if (status < 0 && errno == EINTR)
+			continue;
+		else if (status <= 0)
+			break;
+		done += status;
+	}
+	close(fd);
+
+	return done == len ? 0 : -1;
+}
+
+/* Fill in a random hex string of 2*len characters (plus a NUL) */
+static int random_hex(char* hex, size_t len)
+{
+	unsigned char buf[SESSION_TOKEN_LEN];
+	size_t i;
+
+	assert(len <= sizeof(buf));
+
+	if (get_random_bytes(buf, len))
+		return -1;
+
+	for (i = 0; i < len; i++)
+		snprintf(hex + 2 * i, 3, "%02x", buf[i]);
+	explicit_bzero(buf, sizeof(buf));
+
+	return 0;
+}
+
+/* Compare two n-byte strings without leaking where they differ via timing */
+static int token_eq(const char* a, const char* b, size_t n)
+{
+	unsigned char diff = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		diff |= a[i] ^ b[i];
+
+	return !diff;
+}
+
+/*
+ * Return a newly-allocated path for the socket of the session with the
+ * given ID, creating the directory it goes in if need be, or NULL if that
+ * directory can't be used safely.
+ */
+static char* session_path(const char* id)
+{
+	const char* base = getenv("XDG_RUNTIME_DIR");
+	char* dir;
+	char* path;
+	struct stat st;
+
+	if (!base || !*base)
+		base = "/tmp";
+
+	dir = xasprintf("%s/enthrall-%u", base, (unsigned int)getuid());
+
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		warn("mkdir(%s): %s\n", dir, strerror(errno));
+		xfree(dir);
+		return NULL;
+	}
+
+	if (lstat(dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid()
+	    || (st.st_mode & (S_IRWXG|S_IRWXO))) {
+		warn("%s has bad type, ownership or permissions\n", dir);
+		xfree(dir);
+		return NULL;
+	}
+
+	path = xasprintf("%s/session-%s", dir, id);
+	xfree(dir);
+
+	if (strlen(path) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) {
+		warn("session socket path %s too long\n", path);
+		xfree(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+static void set_sock_timeout(int fd, int secs)
+{
+	struct timeval tv = { .tv_sec = secs, .tv_usec = 0, };
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))
+	    || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)))
+		warn("failed to set session socket timeout: %s\n", strerror(errno));
+}
+
+/*
+ * Try to hand our stdin and stdout, along with the given SETUP, over to the
+ * session with the given ID.  If the session takes them, this never returns
+ * (exiting when the session has finished with them); if there's no such
+ * session (or it refuses), it returns and we carry on as a new one.
+ */
+static void resume_session(const struct message* setup, const char* id,
+                           const char* token)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, };
+	struct session_attach att;
+	struct partsend ps;
+	struct iovec iov[2];
+	struct msghdr mh = { .msg_iov = iov, .msg_iovlen = ARR_LEN(iov), };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} cmsg;
+	struct cmsghdr* cm;
+	int fds[2] = { STDIN_FILENO, STDOUT_FILENO, };
+	char* path;
+	ssize_t status;
+	char reply, c;
+	int fd, nullfd;
+
+	if (strlen(token) != sizeof(att.token)
+	    || strspn(id, "0123456789abcdef") != 2 * SESSION_ID_LEN || id[2 * SESSION_ID_LEN])
+		return;
+
+	path = session_path(id);
+	if (!path)
+		return;
+	strcpy(sun.sun_path, path);
+	xfree(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return;
+
+	if (connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+		vinfo("no session %s to resume (%s)\n", id, strerror(errno));
+		close(fd);
+		return;
+	}
+	set_sock_timeout(fd, SESSION_IO_TIMEOUT_S);
+
+	unparse_message(setup, &ps);
+	memcpy(att.token, token, sizeof(att.token));
+	att.setuplen = ps.len - MSGHDR_SIZE;
+
+	iov[0].iov_base = &att;
+	iov[0].iov_len = sizeof(att);
+	iov[1].iov_base = ps.buf + MSGHDR_SIZE;
+	iov[1].iov_len = att.setuplen;
+
+	memset(&cmsg, 0, sizeof(cmsg));
+	mh.msg_control = cmsg.buf;
+	mh.msg_controllen = sizeof(cmsg.buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	status = sendmsg(fd, &mh, 0);
+	explicit_bzero(&att, sizeof(att));
+	clear_msgbuf(&ps);
+	if (status != sizeof(att) + iov[1].iov_len) {
+		vinfo("failed to hand over to session %s\n", id);
+		close(fd);
+		return;
+	}
+
+	status = read(fd, &reply, 1);
+	if (status == 0 || (status == 1 && reply != 'y')) {
+		vinfo("session %s declined to resume\n", id);
+		close(fd);
+		return;
+	} else if (status < 0) {
+		/* Can't tell whether it took them or not, so bow out. */
+		exit(1);
+	}
+
+	/*
+	 * The session has them now; don't hold our copies open but stick
+	 * around (for ssh's sake) until it closes its end.
+	 */
+	session.attached = 0;
+	nullfd = open("/dev/null", O_RDWR);
+	if (nullfd >= 0) {
+		dup2(nullfd, STDIN_FILENO);
+		dup2(nullfd, STDOUT_FILENO);
+		close(nullfd);
+	}
+
+	set_sock_timeout(fd, 0);
+	do {
+		status = read(fd, &c, 1);
+	} while (status > 0 || (status < 0 && errno == EINTR));
+
+	exit(0);
+}
+
+static void session_accept_cb(struct fdmon_ctx* ctx, void* arg);
+
+/*
+ * Start a new persistent session, lingering for the given time after losing
+ * the connection.  Returns zero on success, negative on failure.
+ */
+static int start_session(uint64_t linger)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, };
+
+	if (random_hex(session.id, SESSION_ID_LEN)
+	    || random_hex(session.token, SESSION_TOKEN_LEN)) {
+		warn("failed to generate session ID/token\n");
+		return -1;
+	}
+
+	session.path = session_path(session.id);
+	if (!session.path)
+		return -1;
+	strcpy(sun.sun_path, session.path);
+
+	session.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (session.listenfd < 0) {
+		warn("socket: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	unlink(session.path);
+	if (bind(session.listenfd, (struct sockaddr*)&sun, sizeof(sun))
+	    || listen(session.listenfd, 4)) {
+		warn("failed to set up session socket %s: %s\n", session.path,
+		     strerror(errno));
+		goto fail;
+	}
+
+	set_fd_nonblock(session.listenfd, 1);
+	set_fd_cloexec(session.listenfd, 1);
+	session.listenmon = fdmon_register_fd(session.listenfd, session_accept_cb,
+	                                      NULL, NULL);
+	fdmon_monitor(session.listenmon, FM_READ);
+
+	/* From here on losing the connection mustn't be the end of us */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+
+	session.linger = linger;
+
+	return 0;
+
+fail:
+	if (session.listenfd >= 0) {
+		close(session.listenfd);
+		session.listenfd = -1;
+	}
+	xfree(session.path);
+	session.path = NULL;
+	return -1;
+}
+
+static void stop_session(void)
+{
+	if (handshake.fd >= 0)
+		refuse_handshake();
+
+	if (session.listenfd >= 0) {
+		fdmon_unregister(session.listenmon);
+		close(session.listenfd);
+		unlink(session.path);
+		session.listenfd = -1;
+	}
+	xfree(session.path);
+	session.path = NULL;
+
+	if (session.attachfd >= 0) {
+		close(session.attachfd);
+		session.attachfd = -1;
+	}
+
+	if (session.linger_timer) {
+		cancel_call(session.linger_timer);
+		session.linger_timer = NULL;
+	}
+
+	session.linger = 0;
+	explicit_bzero(session.token, sizeof(session.token));
+}
+
+/*
+ * Decide which of the optional features offered in the SETUP params to
+ * accept, recording the acceptances in the params for the READY reply.
+ */
+static void accept_setup_features(const struct kvmap* params,
+                                  struct kvmap* readyparams)
+{
+#ifdef HAVE_ZLIB
+	const char* compression = kvmap_get(params, "clipboard-compression");
+#endif
+#ifdef HAVE_OPENSSL
+	const char* transport = kvmap_get(params, "direct-transport");
+#endif
+
+#ifdef HAVE_ZLIB
+	if (compression && !strcmp(compression, "zlib")) {
+		stdio_msgchan.compress_clipboard = 1;
+		kvmap_put(readyparams, "clipboard-compression", "zlib");
+	}
+#endif
+
+#ifdef HAVE_OPENSSL
+	if (transport && !strcmp(transport, "tcp"))
+		offer_direct_transport(params, readyparams);
+#endif
+}
+
+/*
+ * Check a SETUP message's validity, returning its parameters (or NULL if
+ * it's not one we can accept).
+ */
+static struct kvmap* check_setup_msg(const struct message* msg)
 {
-	struct message* readymsg;
 	struct kvmap* params;
 
 	if (msg->body.type != MT_SETUP) {
 		errlog("unexpected message type %u instead of SETUP\n", msg->body.type);
-		exit(1);
+		return NULL;
 	}
 
 	if (MB(msg, setup).prot_vers != PROT_VERSION) {
 		errlog("unsupported protocol version %d\n", MB(msg, setup).prot_vers);
-		exit(1);
+		return NULL;
 	}
 
-	set_loglevel(MB(msg, setup).loglevel);
-
 	params = unflatten_kvmap(MB(msg, setup).params.params_val,
 	                         MB(msg, setup).params.params_len);
-	if (!params) {
+	if (!params)
 		errlog("failed to unflatted remote-params kvmap\n");
-		exit(1);
-	}
 
-	if (platform_init(params, NULL) < 0) {
-		errlog("platform_init() failed\n");
-		exit(1);
+	return params;
+}
+
+/* Platform callback for the clipboard changing hands. */
+static void clipboard_lost_cb(void)
+{
+	if (clipboard_fetches)
+		clipboard_lost_midfetch = 1;
+	enqueue_message(new_message(MT_CLIPBOARDLOST));
+}
+
+/*
+ * Act on the parameters of a SETUP (once the platform is initialized) and
+ * reply with a READY, 'resumed' indicating whether the SETUP came via an
+ * existing session being reattached to.
+ */
+static void finish_setup(const struct message* msg, struct kvmap* params,
+                         int resumed)
+{
+	struct message* readymsg;
+	struct kvmap* readyparams;
+	const char* edgemask;
+	const char* persist;
+	uint64_t linger;
+
+	edgemask = kvmap_get(params, "edge-mask");
+	edge_filter.enabled = !!edgemask;
+	edge_filter.last = 0;
+	if (edgemask)
+		edge_filter.mask = strtoul(edgemask, NULL, 10) & ALLDIRS_MASK;
+
+	readyparams = new_kvmap();
+	accept_setup_features(params, readyparams);
+
+	/* (Only worth the trouble if the master's hashing clipboards.) */
+	if (kvmap_get(params, "clipboard-hashing") && !clipboard_watched)
+		clipboard_watched = watch_clipboard_ownership(clipboard_lost_cb);
+	if (clipboard_watched)
+		kvmap_put(readyparams, "clipboard-ownership", "1");
+
+	persist = kvmap_get(params, "persist");
+	linger = persist ? strtoull(persist, NULL, 10) : 0;
+	if (resumed && !linger)
+		stop_session();
+	else if (resumed)
+		session.linger = linger;
+	else if (linger && start_session(linger))
+		warn("failed to set up persistent session\n");
+
+	if (session.linger) {
+		kvmap_put(readyparams, "session-id", session.id);
+		kvmap_put(readyparams, "session-token", session.token);
+		if (resumed)
+			kvmap_put(readyparams, "resumed", "1");
 	}
 
 	destroy_kvmap(params);
 
 	readymsg = new_message(MT_READY);
-	get_screen_dimensions(&MB(readymsg, ready).screendim);
+	/* (A resumed session already knows its screen dimensions) */
+	if (!resumed)
+		get_screen_dimensions(&edge_filter.screen);
+	MB(readymsg, ready).screendim = edge_filter.screen;
+	MB(readymsg, ready).params.params_val =
+		flatten_kvmap(readyparams, &MB(readymsg, ready).params.params_len);
+	destroy_kvmap(readyparams);
 	enqueue_message(readymsg);
 }
 
+/* Initialize the remote after receiving a SETUP message */
+static void handle_setup_msg(const struct message* msg)
+{
+	struct kvmap* params;
+	const char* resume_id;
+	const char* resume_token;
+
+	params = check_setup_msg(msg);
+	if (!params)
+		exit(1);
+
+	set_loglevel(MB(msg, setup).loglevel);
+
+	resume_id = kvmap_get(params, "resume-session");
+	resume_token = kvmap_get(params, "resume-token");
+	if (resume_id && resume_token)
+		resume_session(msg, resume_id, resume_token);
+
+	if (platform_init(params, NULL) < 0) {
+		errlog("platform_init() failed\n");
+		exit(1);
+	}
+
+	finish_setup(msg, params, 0);
+}
+
 /* msgchan callback to handle received messages */
 static void mc_read_cb(struct msgchan* mc, struct message* msg, void* arg)
 {
@@ -125,17 +1258,240 @@ static void mc_read_cb(struct msgchan* mc, struct message* msg, void* arg)
 	}
 }
 
-static void mc_err_cb(struct msgchan* mc, void* arg)
+/*
+ * msgchan callback for the end of a run of received messages: now that
+ * they've all been handled, send back the resulting pointer position (if
+ * needed).  The injected events themselves get flushed out to the window
+ * system by its event-loop hook before we next block.
+ */
+static void mc_recv_done_cb(struct msgchan* mc, void* arg)
+{
+	if (mousepos_pending) {
+		mousepos_pending = 0;
+		send_mousepos();
+	}
+}
+
+static void session_linger_cb(void* arg)
 {
-	errlog("msgchan error, remote terminating\n");
+	session.linger_timer = NULL;
 	shutdown_remote();
-	exit(1);
+	exit(0);
+}
+
+/* Drop whatever's left of the current connection to the master. */
+static void detach_session(void)
+{
+	mc_close(&stdio_msgchan);
+
+	if (session.attachfd >= 0) {
+		close(session.attachfd);
+		session.attachfd = -1;
+	}
+
+#ifdef HAVE_OPENSSL
+	/* Any direct transport not yet switched to is for the old connection */
+	clear_direct_transport();
+#endif
+
+	mousepos_pending = 0;
+	session.attached = 0;
+}
+
+static void mc_err_cb(struct msgchan* mc, void* arg)
+{
+	if (!session.linger) {
+		errlog("msgchan error, remote terminating\n");
+		shutdown_remote();
+		exit(1);
+	}
+
+	detach_session();
+	session.linger_timer = schedule_call(session_linger_cb, NULL, session.linger);
+}
+
+/* Finish initializing the stdio msgchan for a (new) connection's FDs. */
+static void init_stdio_msgchan(int send_fd, int recv_fd)
+{
+	mc_init(&stdio_msgchan, send_fd, recv_fd, mc_read_cb, mc_err_cb, NULL);
+	stdio_msgchan.cb.recv_done = mc_recv_done_cb;
+}
+
+/*
+ * Read (some more of) the session_attach and the accompanying SETUP and file
+ * descriptors (stdin, stdout) from the connection being handshaken with.
+ * Returns positive once it's all arrived, zero if there's more still to
+ * come, and negative on failure.
+ */
+static int read_session_attach(void)
+{
+	struct session_attach* att = &handshake.att;
+	struct iovec iov;
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} cmsg;
+	struct cmsghdr* cm;
+	size_t bodygot;
+	ssize_t status;
+
+	if (handshake.got < sizeof(*att)) {
+		iov.iov_base = (char*)att + handshake.got;
+		iov.iov_len = sizeof(*att) - handshake.got;
+
+		/* The FDs come along with the first byte */
+		if (handshake.fds[0] < 0) {
+			mh.msg_control = cmsg.buf;
+			mh.msg_controllen = sizeof(cmsg.buf);
+		}
+
+		status = recvmsg(handshake.fd, &mh, 0);
+		if (status < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		else if (status == 0)
+			return -1;
+
+		if (handshake.fds[0] < 0) {
+			cm = CMSG_FIRSTHDR(&mh);
+			if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+			    || cm->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+				return -1;
+			memcpy(handshake.fds, CMSG_DATA(cm), 2 * sizeof(int));
+			set_fd_cloexec(handshake.fds[0], 1);
+			set_fd_cloexec(handshake.fds[1], 1);
+		}
+
+		if (mh.msg_flags & (MSG_TRUNC|MSG_CTRUNC))
+			return -1;
+
+		handshake.got += status;
+		if (handshake.got < sizeof(*att))
+			return 0;
+
+		if (!token_eq(att->token, session.token, sizeof(att->token))
+		    || att->setuplen > SESSION_SETUP_MAX) {
+			warn("rejecting invalid session attach\n");
+			return -1;
+		}
+
+		handshake.body = xmalloc(att->setuplen);
+	}
+
+	for (bodygot = handshake.got - sizeof(*att); bodygot < att->setuplen;
+	     bodygot += status) {
+		status = read(handshake.fd, handshake.body + bodygot,
+		              att->setuplen - bodygot);
+		if (status < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		else if (status == 0)
+			return -1;
+		handshake.got += status;
+	}
+
+	return 1;
+}
+
+/*
+ * fdmon callback for a connection to the session socket: another remote
+ * handing us a new connection from the master.
+ */
+static void session_handshake_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	struct message setup;
+	struct kvmap* params;
+	int status, fd, fds[2];
+	char reply;
+
+	status = read_session_attach();
+	if (!status)
+		return;
+	else if (status < 0) {
+		refuse_handshake();
+		return;
+	}
+
+	/* See comment in mc_read_cb() in msgchan.c */
+	memset(&setup.body, 0, sizeof(setup.body));
+	if (decode_message(handshake.body, handshake.att.setuplen, &setup)) {
+		refuse_handshake();
+		return;
+	}
+
+	params = check_setup_msg(&setup);
+	if (!params) {
+		free_msgbody(&setup);
+		refuse_handshake();
+		return;
+	}
+
+	/* The handshake's done; everything from here on is ours to close */
+	fd = handshake.fd;
+	memcpy(fds, handshake.fds, sizeof(fds));
+	clear_handshake();
+
+	/* (A single byte on an otherwise idle socket won't block.) */
+	reply = 'y';
+	if (write(fd, &reply, 1) != 1) {
+		/* It'll either start afresh or give up */
+		free_msgbody(&setup);
+		destroy_kvmap(params);
+		close(fds[0]);
+		close(fds[1]);
+		close(fd);
+		return;
+	}
+
+	/* A new connection supersedes any we might still think we have */
+	if (session.attached)
+		detach_session();
+
+	if (session.linger_timer) {
+		cancel_call(session.linger_timer);
+		session.linger_timer = NULL;
+	}
+
+	init_stdio_msgchan(fds[1], fds[0]);
+	session.attachfd = fd;
+	session.attached = 1;
+
+	set_loglevel(MB(&setup, setup).loglevel);
+	finish_setup(&setup, params, 1);
+	free_msgbody(&setup);
+
+	vinfo("resumed session %s\n", session.id);
+}
+
+/*
+ * fdmon callback for the session socket's listening socket: accept the
+ * connection and start reading the handshake from it.
+ */
+static void session_accept_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	int fd = accept(session.listenfd, NULL, NULL);
+
+	if (fd < 0)
+		return;
+
+	/* Only one at a time; the newest is presumably the one that matters */
+	if (handshake.fd >= 0) {
+		warn("abandoning unfinished session attach\n");
+		refuse_handshake();
+	}
+
+	set_fd_cloexec(fd, 1);
+	set_fd_nonblock(fd, 1);
+
+	handshake.fd = fd;
+	handshake.mon = fdmon_register_fd(fd, session_handshake_cb, NULL, NULL);
+	fdmon_monitor(handshake.mon, FM_READ);
+	handshake.timer = schedule_call(handshake_timeout_cb, NULL,
+	                                SESSION_IO_TIMEOUT_S * 1000000ULL);
 }
 
 void run_remote(void)
 {
-	mc_init(&stdio_msgchan, STDOUT_FILENO, STDIN_FILENO,
-	        mc_read_cb, mc_err_cb, NULL);
+	init_stdio_msgchan(STDOUT_FILENO, STDIN_FILENO);
 
 	run_event_loop();
 }
@@ -0,0 +1,258 @@
+#ifdef HAVE_OPENSSL
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "misc.h"
+#include "seal.h"
+
+#define SEAL_NONCE_LEN 12
+
+struct seal {
+	EVP_CIPHER_CTX* ctx;
+
+	/* Number of frames sealed/opened so far, used as the nonce */
+	uint64_t counter;
+};
+
+/*
+ * Create a new seal (for one direction of a connection) with the given key
+ * (SEAL_KEY_LEN bytes).  Returns NULL on failure.
+ */
+struct seal* new_seal(const unsigned char* key)
+{
+	struct seal* s = xmalloc(sizeof(*s));
+
+	s->counter = 0;
+	s->ctx = EVP_CIPHER_CTX_new();
+	if (!s->ctx) {
+		xfree(s);
+		return NULL;
+	}
+
+	/*
+	 * The direction (encrypt vs. decrypt) gets set anew for each frame;
+	 * here we just load the cipher and key.
+	 */
+	if (EVP_CipherInit_ex(s->ctx, EVP_chacha20_poly1305(), NULL, key, NULL, -1) != 1) {
+		free_seal(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void free_seal(struct seal* s)
+{
+	if (!s)
+		return;
+
+	/* (EVP_CIPHER_CTX_free() wipes the key schedule) */
+	EVP_CIPHER_CTX_free(s->ctx);
+	xfree(s);
+}
+
+/* Store a u64 in network byte order at a (possibly unaligned) address. */
+static void put_u64(unsigned char* p, uint64_t v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static uint64_t get_u64(const unsigned char* p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+/* Prepare the given seal to process a frame or datagram with the given number. */
+static int seal_start(struct seal* s, uint64_t num, int enc)
+{
+	unsigned char nonce[SEAL_NONCE_LEN] = { 0, };
+
+	put_u64(nonce + SEAL_NONCE_LEN - 8, num);
+
+	return EVP_CipherInit_ex(s->ctx, NULL, NULL, NULL, nonce, enc) == 1 ? 0 : -1;
+}
+
+/* Prepare the given seal to process its next frame. */
+static inline int seal_start_frame(struct seal* s, int enc)
+{
+	return seal_start(s, s->counter++, enc);
+}
+
+/*
+ * Replace the (complete, not yet sent) frame in the given partsend buffer
+ * with a sealed version of itself: the same frame with its body encrypted
+ * and an authentication tag appended, the length header (which covers the
+ * tag) being authenticated too.  Returns zero on success, negative on
+ * failure.
+ */
+int seal_msgbuf(struct seal* s, struct partsend* ps)
+{
+	size_t bodylen = ps->len - MSGHDR_SIZE;
+	size_t newlen = ps->len + SEAL_TAG_LEN;
+	uint32_t hdr = htonl(bodylen + SEAL_TAG_LEN);
+	char* newbuf;
+	int outlen;
+
+	newbuf = alloc_msgbuf(newlen);
+	if (!newbuf)
+		return -ENOMEM;
+	memcpy(newbuf, &hdr, MSGHDR_SIZE);
+
+	if (seal_start_frame(s, 1)
+	    || EVP_CipherUpdate(s->ctx, NULL, &outlen, (unsigned char*)newbuf,
+	                        MSGHDR_SIZE) != 1
+	    || EVP_CipherUpdate(s->ctx, (unsigned char*)newbuf + MSGHDR_SIZE, &outlen,
+	                        (unsigned char*)ps->buf + MSGHDR_SIZE, bodylen) != 1
+	    || EVP_CipherFinal_ex(s->ctx, NULL, &outlen) != 1
+	    || EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG_LEN,
+	                           newbuf + MSGHDR_SIZE + bodylen) != 1) {
+		release_msgbuf(newbuf, newlen);
+		return -EINVAL;
+	}
+
+	clear_msgbuf(ps);
+	ps->buf = newbuf;
+	ps->bufsize = newlen;
+	ps->len = newlen;
+
+	return 0;
+}
+
+/*
+ * Open (verify and decrypt, in place) the sealed frame at 'frame', whose
+ * length header gives its body length as *len.  On success returns zero and
+ * updates *len to the length of the decrypted body; returns negative if the
+ * frame fails authentication.
+ */
+int open_frame(struct seal* s, char* frame, uint32_t* len)
+{
+	unsigned char* body = (unsigned char*)frame + MSGHDR_SIZE;
+	uint32_t bodylen;
+	int outlen;
+
+	if (*len < SEAL_TAG_LEN)
+		return -EINVAL;
+	bodylen = *len - SEAL_TAG_LEN;
+
+	if (seal_start_frame(s, 0)
+	    || EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_AEAD_SET_TAG, SEAL_TAG_LEN,
+	                           body + bodylen) != 1
+	    || EVP_CipherUpdate(s->ctx, NULL, &outlen, (unsigned char*)frame,
+	                        MSGHDR_SIZE) != 1
+	    || EVP_CipherUpdate(s->ctx, body, &outlen, body, bodylen) != 1
+	    || EVP_CipherFinal_ex(s->ctx, NULL, &outlen) != 1)
+		return -EINVAL;
+
+	*len = bodylen;
+
+	return 0;
+}
+
+/*
+ * Seal len bytes at 'in' as a datagram numbered 'seq', writing the result
+ * (len + SEAL_DGRAM_OVERHEAD bytes: the sequence number, the encrypted data
+ * and the authentication tag) to 'out'.  Returns the length written, or zero
+ * on failure.
+ */
+size_t seal_dgram(struct seal* s, uint64_t seq, const void* in, size_t len, void* out)
+{
+	unsigned char* p = out;
+	int outlen;
+
+	put_u64(p, seq);
+
+	if (seal_start(s, seq, 1)
+	    || EVP_CipherUpdate(s->ctx, NULL, &outlen, p, SEAL_DGRAM_SEQ_LEN) != 1
+	    || EVP_CipherUpdate(s->ctx, p + SEAL_DGRAM_SEQ_LEN, &outlen, in, len) != 1
+	    || EVP_CipherFinal_ex(s->ctx, NULL, &outlen) != 1
+	    || EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG_LEN,
+	                           p + SEAL_DGRAM_SEQ_LEN + len) != 1)
+		return 0;
+
+	return len + SEAL_DGRAM_OVERHEAD;
+}
+
+/*
+ * Open a datagram of len bytes produced by seal_dgram(), writing its
+ * content (len - SEAL_DGRAM_OVERHEAD bytes) to 'out' and its sequence
+ * number to *seq.  Returns zero on success, negative if the datagram fails
+ * authentication.  Detecting replays is up to the caller.
+ */
+int open_dgram(struct seal* s, const void* in, size_t len, uint64_t* seq, void* out)
+{
+	const unsigned char* p = in;
+	size_t datalen;
+	int outlen;
+
+	if (len < SEAL_DGRAM_OVERHEAD)
+		return -EINVAL;
+	datalen = len - SEAL_DGRAM_OVERHEAD;
+
+	*seq = get_u64(p);
+
+	if (seal_start(s, *seq, 0)
+	    || EVP_CIPHER_CTX_ctrl(s->ctx, EVP_CTRL_AEAD_SET_TAG, SEAL_TAG_LEN,
+	                           (void*)(p + SEAL_DGRAM_SEQ_LEN + datalen)) != 1
+	    || EVP_CipherUpdate(s->ctx, NULL, &outlen, p, SEAL_DGRAM_SEQ_LEN) != 1
+	    || EVP_CipherUpdate(s->ctx, out, &outlen, p + SEAL_DGRAM_SEQ_LEN, datalen) != 1
+	    || EVP_CipherFinal_ex(s->ctx, NULL, &outlen) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Fill in a fresh random key.  Returns zero on success, negative on failure. */
+int gen_seal_key(unsigned char* key)
+{
+	return RAND_bytes(key, SEAL_KEY_LEN) == 1 ? 0 : -1;
+}
+
+/* Return a newly-allocated hex encoding of the given key. */
+char* seal_key_to_hex(const unsigned char* key)
+{
+	char* hex = xmalloc(2 * SEAL_KEY_LEN + 1);
+	int i;
+
+	for (i = 0; i < SEAL_KEY_LEN; i++)
+		snprintf(hex + 2 * i, 3, "%02x", key[i]);
+
+	return hex;
+}
+
+/*
+ * Decode a hex-encoded key (as produced by seal_key_to_hex()).  Returns zero
+ * on success, negative if the string isn't a valid key.
+ */
+int seal_key_from_hex(const char* hex, unsigned char* key)
+{
+	unsigned int byte;
+	int i;
+
+	if (strlen(hex) != 2 * SEAL_KEY_LEN
+	    || strspn(hex, "0123456789abcdefABCDEF") != 2 * SEAL_KEY_LEN)
+		return -1;
+
+	for (i = 0; i < SEAL_KEY_LEN; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return -1;
+		key[i] = byte;
+	}
+
+	return 0;
+}
+
+#endif /* HAVE_OPENSSL */
@@ -0,0 +1,44 @@
+/*
+ * Authenticated encryption of message frames, for transports (e.g. a direct
+ * TCP connection) that aren't already protected by ssh.
+ *
+ * Each direction of a connection gets its own key and seal; frames are
+ * numbered implicitly (the nonce being a per-seal counter), so any dropped,
+ * reordered, replayed or modified frame fails to open.  Datagrams, which
+ * may legitimately be lost or reordered, are instead numbered explicitly by
+ * the caller (each number being used at most once per key).
+ */
+
+#ifndef SEAL_H
+#define SEAL_H
+
+#include <stdint.h>
+
+#include "message.h"
+
+#define SEAL_KEY_LEN 32
+#define SEAL_TAG_LEN 16
+
+/* Opaque outside of seal.c */
+struct seal;
+
+struct seal* new_seal(const unsigned char* key);
+void free_seal(struct seal* s);
+
+int seal_msgbuf(struct seal* s, struct partsend* ps);
+int open_frame(struct seal* s, char* frame, uint32_t* len);
+
+/* Size of the sequence number at the start of each datagram */
+#define SEAL_DGRAM_SEQ_LEN 8
+
+/* Overhead added by seal_dgram() */
+#define SEAL_DGRAM_OVERHEAD (SEAL_DGRAM_SEQ_LEN + SEAL_TAG_LEN)
+
+size_t seal_dgram(struct seal* s, uint64_t seq, const void* in, size_t len, void* out);
+int open_dgram(struct seal* s, const void* in, size_t len, uint64_t* seq, void* out);
+
+int gen_seal_key(unsigned char* key);
+char* seal_key_to_hex(const unsigned char* key);
+int seal_key_from_hex(const char* hex, unsigned char* key);
+
+#endif /* SEAL_H */
@@ -0,0 +1,89 @@
+#include <inttypes.h>
+
+#include "misc.h"
+#include "msgchan.h"
+#include "stats.h"
+
+int stats_enabled = 0;
+
+struct histogram evloop_busy;
+
+void hist_record(struct histogram* h, uint64_t us)
+{
+	unsigned int b = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+
+	h->buckets[b] += 1;
+	h->count += 1;
+	h->sum += us;
+	if (us > h->max)
+		h->max = us;
+}
+
+/*
+ * Estimate the given percentile of a histogram's samples, as the upper bound
+ * of the bucket it falls in (capped at the largest sample seen).
+ */
+static uint64_t hist_percentile(const struct histogram* h, unsigned int pct)
+{
+	uint64_t seen = 0, target = (h->count * pct + 99) / 100;
+	uint64_t bound;
+	unsigned int b;
+
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		seen += h->buckets[b];
+		if (seen >= target)
+			break;
+	}
+
+	bound = b < HIST_BUCKETS - 1 ? (uint64_t)1 << b : h->max;
+	return bound < h->max ? bound : h->max;
+}
+
+void dump_histogram(stats_out_fn out, const char* prefix, const char* name,
+                    const struct histogram* h)
+{
+	if (!h->count) {
+		out("%s%s: no samples\n", prefix, name);
+		return;
+	}
+
+	out("%s%s: n=%"PRIu64" mean=%"PRIu64"us p50<=%"PRIu64"us p90<=%"PRIu64"us "
+	    "p99<=%"PRIu64"us max=%"PRIu64"us\n", prefix, name, h->count,
+	    h->sum / h->count, hist_percentile(h, 50), hist_percentile(h, 90),
+	    hist_percentile(h, 99), h->max);
+}
+
+void dump_mcstats(stats_out_fn out, const char* prefix, const struct mcstats* st)
+{
+	struct msgcount sent = { 0, 0, }, recvd = { 0, 0, };
+	msgtype_t type;
+
+	for (type = 0; type < NUM_MSGTYPES; type++) {
+		if (!st->sent[type].msgs && !st->recvd[type].msgs)
+			continue;
+
+		out("%s%s: sent %"PRIu64" (%"PRIu64" bytes), received %"PRIu64
+		    " (%"PRIu64" bytes)\n", prefix, msgtype_name(type),
+		    st->sent[type].msgs, st->sent[type].bytes,
+		    st->recvd[type].msgs, st->recvd[type].bytes);
+
+		sent.msgs += st->sent[type].msgs;
+		sent.bytes += st->sent[type].bytes;
+		recvd.msgs += st->recvd[type].msgs;
+		recvd.bytes += st->recvd[type].bytes;
+	}
+
+	out("%stotal: sent %"PRIu64" (%"PRIu64" bytes), received %"PRIu64
+	    " (%"PRIu64" bytes)\n", prefix, sent.msgs, sent.bytes, recvd.msgs,
+	    recvd.bytes);
+	out("%ssend backlog high-water mark: %u of %d\n", prefix, st->queue_hwm,
+	    MAX_SEND_BACKLOG);
+
+	dump_histogram(out, prefix, "drain time", &st->drain_time);
+	dump_histogram(out, prefix, "fill time", &st->fill_time);
+	dump_histogram(out, prefix, "pointer RTT", &st->rtt);
+	dump_histogram(out, prefix, "heartbeat RTT", &st->ping_rtt);
+}
@@ -0,0 +1,73 @@
+/*
+ * Traffic and latency statistics, collected (when enabled via the 'stats'
+ * config option) for dumping on request to help diagnose sluggish remotes.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "message.h"
+
+/*
+ * Number of buckets in a latency histogram; bucket i counts samples of less
+ * than 2^i microseconds (and at least 2^(i-1)), the last one catching
+ * everything beyond.
+ */
+#define HIST_BUCKETS 24
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_record(struct histogram* h, uint64_t us);
+
+struct msgcount {
+	uint64_t msgs;
+	uint64_t bytes;
+};
+
+static inline void count_msg(struct msgcount* counts, msgtype_t type, size_t bytes)
+{
+	if (type < NUM_MSGTYPES) {
+		counts[type].msgs += 1;
+		counts[type].bytes += bytes;
+	}
+}
+
+/* Statistics for one msgchan (i.e. one remote connection) */
+struct mcstats {
+	/* Messages and (on-the-wire) bytes sent and received, by type */
+	struct msgcount sent[NUM_MSGTYPES], recvd[NUM_MSGTYPES];
+
+	/* Deepest either lane's send backlog has ever been */
+	unsigned int queue_hwm;
+
+	/* Time spent in each drain_msgbufs()/fill_msgbuf() call */
+	struct histogram drain_time, fill_time;
+
+	/* MOVEREL-to-following-MOUSEPOS and PING-to-PONG round-trip times */
+	struct histogram rtt, ping_rtt;
+};
+
+/*
+ * Set if statistics are being collected.  Checked (before touching any of
+ * the above) by code that records them, so that collection costs next to
+ * nothing when disabled.
+ */
+extern int stats_enabled;
+
+/* How long each event-loop iteration spends between waits */
+extern struct histogram evloop_busy;
+
+typedef void (*stats_out_fn)(const char* fmt, ...);
+
+void dump_histogram(stats_out_fn out, const char* prefix, const char* name,
+                    const struct histogram* h);
+void dump_mcstats(stats_out_fn out, const char* prefix, const struct mcstats* st);
+
+#endif /* STATS_H */
@@ -0,0 +1,157 @@
+/*
+ * Timer queue implemented as a binary min-heap keyed on call time, giving
+ * O(log n) insertion and cancellation.  Each entry records its own position
+ * in the heap so that cancellation doesn't need to search for it.
+ */
+
+#include "misc.h"
+#include "timerheap.h"
+
+struct scheduled_call {
+	void (*fn)(void* arg);
+	void* arg;
+	uint64_t calltime;
+	uint64_t seq;
+
+	/* Index of this entry in the heap array */
+	unsigned int idx;
+};
+
+static inline int call_before(const struct scheduled_call* a,
+                              const struct scheduled_call* b)
+{
+	return a->calltime < b->calltime
+		|| (a->calltime == b->calltime && a->seq < b->seq);
+}
+
+static inline void heap_set(struct timerheap* th, unsigned int idx,
+                            struct scheduled_call* call)
+{
+	th->ents[idx] = call;
+	call->idx = idx;
+}
+
+static void sift_up(struct timerheap* th, unsigned int idx)
+{
+	struct scheduled_call* call = th->ents[idx];
+	unsigned int parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (!call_before(call, th->ents[parent]))
+			break;
+		heap_set(th, idx, th->ents[parent]);
+		idx = parent;
+	}
+
+	heap_set(th, idx, call);
+}
+
+static void sift_down(struct timerheap* th, unsigned int idx)
+{
+	struct scheduled_call* call = th->ents[idx];
+	unsigned int child;
+
+	for (;;) {
+		child = (2 * idx) + 1;
+		if (child >= th->num)
+			break;
+		if (child + 1 < th->num && call_before(th->ents[child + 1], th->ents[child]))
+			child += 1;
+		if (!call_before(th->ents[child], call))
+			break;
+		heap_set(th, idx, th->ents[child]);
+		idx = child;
+	}
+
+	heap_set(th, idx, call);
+}
+
+/* Remove the entry at the given index from the heap (without freeing it). */
+static void heap_remove(struct timerheap* th, unsigned int idx)
+{
+	struct scheduled_call* last;
+
+	th->num -= 1;
+	if (idx == th->num)
+		return;
+
+	last = th->ents[th->num];
+	heap_set(th, idx, last);
+
+	if (idx > 0 && call_before(last, th->ents[(idx - 1) / 2]))
+		sift_up(th, idx);
+	else
+		sift_down(th, idx);
+}
+
+/* Add a call to fn(arg) at the given (get_microtime()-based) time. */
+timer_ctx_t timerheap_insert(struct timerheap* th, void (*fn)(void* arg),
+                             void* arg, uint64_t calltime)
+{
+	struct scheduled_call* call = xmalloc(sizeof(*call));
+
+	call->fn = fn;
+	call->arg = arg;
+	call->calltime = calltime;
+	call->seq = th->next_seq++;
+
+	if (th->num == th->cap) {
+		th->cap = th->cap ? th->cap * 2 : 16;
+		th->ents = xrealloc(th->ents, th->cap * sizeof(*th->ents));
+	}
+
+	th->ents[th->num] = call;
+	th->num += 1;
+	sift_up(th, th->num - 1);
+
+	return call;
+}
+
+/*
+ * Cancel a pending call, returning 1 if it was removed and 0 if it wasn't
+ * found.  The timer must not already have fired (callers are expected to
+ * forget their handles when their callbacks run).
+ */
+int timerheap_cancel(struct timerheap* th, timer_ctx_t timer)
+{
+	struct scheduled_call* call = timer;
+
+	if (call->idx >= th->num || th->ents[call->idx] != call)
+		return 0;
+
+	heap_remove(th, call->idx);
+	xfree(call);
+
+	return 1;
+}
+
+/*
+ * Retrieve the time of the earliest pending call, returning zero if there
+ * are none.
+ */
+int timerheap_next(const struct timerheap* th, uint64_t* calltime)
+{
+	if (!th->num)
+		return 0;
+
+	*calltime = th->ents[0]->calltime;
+	return 1;
+}
+
+/*
+ * Run all calls due at or before the given time.  Each is removed from the
+ * heap before being called, so callbacks are free to schedule and cancel
+ * other calls.
+ */
+void timerheap_run(struct timerheap* th, uint64_t now)
+{
+	struct scheduled_call* call;
+
+	while (th->num && th->ents[0]->calltime <= now) {
+		call = th->ents[0];
+		heap_remove(th, 0);
+		call->fn(call->arg);
+		xfree(call);
+	}
+}
@@ -0,0 +1,30 @@
+/*
+ * Binary min-heap of scheduled calls, for use by event-loop implementations
+ * of schedule_call() and cancel_call().
+ */
+
+#ifndef TIMERHEAP_H
+#define TIMERHEAP_H
+
+#include <stdint.h>
+
+#include "events.h"
+
+struct scheduled_call;
+
+struct timerheap {
+	struct scheduled_call** ents;
+	unsigned int num;
+	unsigned int cap;
+
+	/* For firing calls scheduled for the same time in FIFO order */
+	uint64_t next_seq;
+};
+
+timer_ctx_t timerheap_insert(struct timerheap* th, void (*fn)(void* arg),
+                             void* arg, uint64_t calltime);
+int timerheap_cancel(struct timerheap* th, timer_ctx_t timer);
+int timerheap_next(const struct timerheap* th, uint64_t* calltime);
+void timerheap_run(struct timerheap* th, uint64_t now);
+
+#endif /* TIMERHEAP_H */
@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "types.h"
+#include "trace.h"
+
+/* Per-record header: u32 time delta, u16 remote, u8 kind, u32 length */
+#define TRACE_RECHDR_SIZE (4 + 2 + 1 + 4)
+
+/*
+ * Recording
+ * =========
+ *
+ * Records are appended to a ring allocated up front (so recording involves
+ * no syscalls), which gets written out to the trace file from a timer --
+ * after TRACE_FLUSH_INTERVAL, or as soon as the event loop next gets around
+ * to it if the ring's more than half full -- TRACE_FLUSH_CHUNK bytes at a
+ * time, so as not to hold up everything else.  If it fills up anyway,
+ * records are dropped (and warned about) rather than blocking.
+ *
+ * Recording a message requires its wire encoding.  The fixed-size types
+ * (nearly all the traffic) are cheap to encode into a stack buffer; anything
+ * else is encoded into an encmsg that's then sent in place of the original
+ * message, so it doesn't get encoded again on its way out.
+ */
+
+static struct {
+	int fd;
+	char* ring;
+
+	/* Start of the data yet to be written out, and how much there is */
+	size_t head, len;
+
+	/* Timestamp of the last record */
+	uint64_t last;
+
+	/* Pending flush (if any), and whether it's an immediate one */
+	timer_ctx_t flush_timer;
+	int flush_soon;
+
+	uint64_t dropped, dropped_reported;
+} tracer = { .fd = -1, };
+
+static inline char* put_u16(char* p, uint16_t v)
+{
+	v = htons(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static inline char* put_u32(char* p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static inline uint32_t get_u32(const char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+/* Write out everything given, returning non-zero on failure. */
+static int write_all(int fd, const void* buf, size_t len)
+{
+	ssize_t status;
+
+	while (len) {
+		status = write(fd, buf, len);
+		if (status < 0 && errno == EINTR)
+			continue;
+		else if (status < 0)
+			return -1;
+		buf = (const char*)buf + status;
+		len -= status;
+	}
+
+	return 0;
+}
+
+static void trace_flush_cb(void* arg);
+
+/* Arrange for the ring to be flushed, sooner rather than later if 'soon'. */
+static void schedule_flush(int soon)
+{
+	if (tracer.flush_timer) {
+		if (!soon || tracer.flush_soon)
+			return;
+		cancel_call(tracer.flush_timer);
+	}
+
+	tracer.flush_soon = soon;
+	tracer.flush_timer = schedule_call(trace_flush_cb, NULL,
+	                                soon ? 0 : TRACE_FLUSH_INTERVAL);
+}
+
+/*
+ * Write out up to 'max' bytes of what's in the ring, returning non-zero on
+ * failure.
+ */
+static int flush_ring(size_t max)
+{
+	size_t chunk;
+
+	while (tracer.len && max) {
+		chunk = tracer.len;
+		if (chunk > TRACE_RING_SIZE - tracer.head)
+			chunk = TRACE_RING_SIZE - tracer.head;
+		if (chunk > max)
+			chunk = max;
+
+		if (write_all(tracer.fd, tracer.ring + tracer.head, chunk))
+			return -1;
+
+		/* It may hold keystrokes */
+		explicit_bzero(tracer.ring + tracer.head, chunk);
+
+		tracer.head = (tracer.head + chunk) % TRACE_RING_SIZE;
+		tracer.len -= chunk;
+		max -= chunk;
+	}
+
+	if (!tracer.len)
+		tracer.head = 0;
+
+	return 0;
+}
+
+static void trace_flush_cb(void* arg)
+{
+	tracer.flush_timer = NULL;
+
+	if (flush_ring(TRACE_FLUSH_CHUNK)) {
+		errlog("failed to write trace file (%s), stopping trace\n",
+		       strerror(errno));
+		trace_stop();
+		return;
+	}
+
+	/* Come back for the rest once everything else has had a turn */
+	if (tracer.len)
+		schedule_flush(1);
+
+	if (tracer.dropped != tracer.dropped_reported) {
+		warn("trace buffer full, %"PRIu64" records dropped\n",
+		     tracer.dropped - tracer.dropped_reported);
+		tracer.dropped_reported = tracer.dropped;
+	}
+}
+
+/* Append data to the ring (which the caller has checked has room for it). */
+static void ring_put(const void* data, size_t len)
+{
+	size_t tail = (tracer.head + tracer.len) % TRACE_RING_SIZE;
+	size_t first = len < TRACE_RING_SIZE - tail ? len : TRACE_RING_SIZE - tail;
+
+	memcpy(tracer.ring + tail, data, first);
+	memcpy(tracer.ring, (const char*)data + first, len - first);
+	tracer.len += len;
+}
+
+/*
+ * Start recording a trace to the given file, of messages sent to the given
+ * list of remotes.  Returns zero on success, negative on failure.
+ */
+int trace_start(const char* path, struct remote* remotes)
+{
+	struct remote* rmt;
+	unsigned int num = 0;
+	size_t hdrlen = TRACE_MAGIC_LEN + 2 * sizeof(uint32_t);
+	char* hdr;
+	char* p;
+	int status;
+
+	for (rmt = remotes; rmt; rmt = rmt->next) {
+		hdrlen += sizeof(uint32_t) + strlen(rmt->node.name);
+		num += 1;
+	}
+
+	tracer.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (tracer.fd < 0) {
+		errlog("failed to open trace file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	p = hdr = xmalloc(hdrlen);
+	memcpy(p, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	p = put_u32(p + TRACE_MAGIC_LEN, TRACE_VERSION);
+	p = put_u32(p, num);
+
+	num = 0;
+	for (rmt = remotes; rmt; rmt = rmt->next) {
+		rmt->trace_id = num++;
+		p = put_u32(p, strlen(rmt->node.name));
+		memcpy(p, rmt->node.name, strlen(rmt->node.name));
+		p += strlen(rmt->node.name);
+	}
+
+	status = write_all(tracer.fd, hdr, hdrlen);
+	xfree(hdr);
+	if (status) {
+		errlog("failed to write trace file %s: %s\n", path, strerror(errno));
+		close(tracer.fd);
+		tracer.fd = -1;
+		return -1;
+	}
+
+	tracer.ring = xmalloc(TRACE_RING_SIZE);
+	tracer.head = tracer.len = 0;
+	tracer.last = get_microtime();
+
+	return 0;
+}
+
+/*
+ * Record a message about to be sent to the given remote (if tracing).
+ * Returns the message to send in its place (which is either msg itself or,
+ * msg having been freed, an equivalent shared one).
+ */
+struct message* trace_message(const struct remote* rmt, struct message* msg)
+{
+	char hdr[TRACE_RECHDR_SIZE];
+	struct partsend ps = { .shared = NULL, };
+	struct encmsg* em;
+	const struct partsend* frame = NULL;
+	msgtype_t type = msg->encoded ? msg->encoded->type : msg->body.type;
+	uint64_t now, delta;
+	uint32_t len;
+	char* p;
+
+	if (tracer.fd < 0 || type == MT_SETUP)
+		return msg;
+
+	if (type == MT_SETCLIPBOARD) {
+		/*
+		 * Record only the length, which in a pre-encoded one is the
+		 * XDR string length following the message type.
+		 */
+		if (!msg->encoded)
+			len = strlen(MB(msg, setclipboard).text);
+		else if (msg->encoded->ps.len >= MSGHDR_SIZE + 2 * sizeof(uint32_t))
+			len = get_u32((const char*)msg->encoded->ps.buf + MSGHDR_SIZE
+			              + sizeof(uint32_t));
+		else
+			return msg;
+	} else if (msg->encoded) {
+		frame = &msg->encoded->ps;
+	} else if (unparse_fixed_message(msg, &ps)) {
+		frame = &ps;
+	} else {
+		em = encode_message(msg);
+		free_message(msg);
+		msg = share_message(em);
+		encmsg_unref(em);
+		frame = &msg->encoded->ps;
+	}
+
+	if (frame)
+		len = frame->len - MSGHDR_SIZE;
+
+	if ((frame ? len : 0) + TRACE_RECHDR_SIZE > TRACE_RING_SIZE - tracer.len) {
+		tracer.dropped += 1;
+		schedule_flush(1);
+		goto out;
+	}
+
+	/* (Gaps too long to represent, ~71 minutes, just get shortened.) */
+	now = get_microtime();
+	delta = now - tracer.last;
+	tracer.last = now;
+
+	p = put_u32(hdr, delta > UINT32_MAX ? UINT32_MAX : delta);
+	p = put_u16(p, rmt->trace_id);
+	*p++ = frame ? TR_FRAME : TR_CLIPBOARD;
+	put_u32(p, len);
+
+	ring_put(hdr, sizeof(hdr));
+	if (frame)
+		ring_put((const char*)frame->buf + MSGHDR_SIZE, len);
+
+	schedule_flush(tracer.len > TRACE_RING_SIZE / 2);
+
+out:
+	if (frame == &ps)
+		clear_msgbuf(&ps);
+
+	return msg;
+}
+
+/* Write out any remaining buffered records and stop tracing. */
+void trace_stop(void)
+{
+	if (tracer.fd < 0)
+		return;
+
+	if (tracer.flush_timer) {
+		cancel_call(tracer.flush_timer);
+		tracer.flush_timer = NULL;
+	}
+
+	if (flush_ring(SIZE_MAX))
+		errlog("failed to write trace file: %s\n", strerror(errno));
+
+	if (tracer.dropped)
+		warn("%"PRIu64" trace records dropped (trace buffer full)\n",
+		     tracer.dropped);
+
+	close(tracer.fd);
+	tracer.fd = -1;
+
+	explicit_bzero(tracer.ring, TRACE_RING_SIZE);
+	xfree(tracer.ring);
+	tracer.ring = NULL;
+}
+
+/*
+ * Replaying
+ * =========
+ */
+
+static inline uint16_t get_u16(const char* p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohs(v);
+}
+
+/* Whether at least len more bytes remain in the trace. */
+static inline int have_bytes(const struct trace* tr, size_t len)
+{
+	return tr->len - tr->pos >= len;
+}
+
+/*
+ * Read the given trace file into memory and parse its header, returning zero
+ * on success or negative on failure (with an error logged).
+ */
+int load_trace(const char* path, struct trace* tr)
+{
+	struct stat st;
+	uint32_t namelen;
+	unsigned int i;
+	int fd;
+	ssize_t status;
+
+	memset(tr, 0, sizeof(*tr));
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		errlog("%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	tr->buf = xmalloc(st.st_size ? st.st_size : 1);
+	while (tr->len < st.st_size) {
+		status = read(fd, tr->buf + tr->len, st.st_size - tr->len);
+		if (status < 0 && errno == EINTR)
+			continue;
+		else if (status <= 0)
+			break;
+		tr->len += status;
+	}
+	close(fd);
+
+	if (!have_bytes(tr, TRACE_MAGIC_LEN + 2 * sizeof(uint32_t))
+	    || memcmp(tr->buf, TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+		errlog("%s: not a trace file\n", path);
+		goto fail;
+	}
+	tr->pos = TRACE_MAGIC_LEN;
+
+	if (get_u32(tr->buf + tr->pos) != TRACE_VERSION) {
+		errlog("%s: unsupported trace version %u\n", path,
+		       get_u32(tr->buf + tr->pos));
+		goto fail;
+	}
+	tr->num_remotes = get_u32(tr->buf + tr->pos + sizeof(uint32_t));
+	tr->pos += 2 * sizeof(uint32_t);
+
+	if (tr->num_remotes > UINT16_MAX + 1) {
+		errlog("%s: corrupt trace header\n", path);
+		goto fail;
+	}
+
+	tr->remotes = xcalloc(tr->num_remotes * sizeof(*tr->remotes));
+	for (i = 0; i < tr->num_remotes; i++) {
+		if (!have_bytes(tr, sizeof(uint32_t))
+		    || !have_bytes(tr, sizeof(uint32_t) + (namelen = get_u32(tr->buf + tr->pos)))) {
+			errlog("%s: truncated trace header\n", path);
+			goto fail;
+		}
+		tr->pos += sizeof(uint32_t);
+		tr->remotes[i] = xmalloc(namelen + 1);
+		memcpy(tr->remotes[i], tr->buf + tr->pos, namelen);
+		tr->remotes[i][namelen] = '\0';
+		tr->pos += namelen;
+	}
+
+	return 0;
+
+fail:
+	free_trace(tr);
+	return -1;
+}
+
+/*
+ * Fetch the next record from a loaded trace, returning 1 if one was read, 0
+ * at the end of the trace, and negative if it's corrupt (or truncated, as
+ * can happen with a trace from a master that didn't exit cleanly).
+ */
+int next_trace_record(struct trace* tr, struct trace_record* rec)
+{
+	const char* p = tr->buf + tr->pos;
+
+	if (tr->pos == tr->len)
+		return 0;
+
+	if (!have_bytes(tr, TRACE_RECHDR_SIZE))
+		return -1;
+
+	tr->when += get_u32(p);
+	rec->when = tr->when;
+	rec->remote = get_u16(p + 4);
+	rec->kind = (unsigned char)p[6];
+	rec->len = get_u32(p + 7);
+
+	if (rec->remote >= tr->num_remotes
+	    || (rec->kind != TR_FRAME && rec->kind != TR_CLIPBOARD))
+		return -1;
+
+	if (rec->kind == TR_FRAME) {
+		if (!have_bytes(tr, TRACE_RECHDR_SIZE + rec->len))
+			return -1;
+		rec->data = tr->buf + tr->pos + TRACE_RECHDR_SIZE;
+		tr->pos += rec->len;
+	} else {
+		rec->data = NULL;
+	}
+
+	tr->pos += TRACE_RECHDR_SIZE;
+
+	return 1;
+}
+
+void free_trace(struct trace* tr)
+{
+	unsigned int i;
+
+	if (tr->remotes) {
+		for (i = 0; i < tr->num_remotes; i++)
+			xfree(tr->remotes[i]);
+		xfree(tr->remotes);
+	}
+
+	if (tr->buf)
+		explicit_bzero(tr->buf, tr->len);
+	xfree(tr->buf);
+
+	memset(tr, 0, sizeof(*tr));
+}
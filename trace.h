@@ -0,0 +1,84 @@
+/*
+ * Input traces: recordings (made by the master when the 'trace-file' config
+ * option is set) of the timestamped stream of messages sent to each remote,
+ * for replaying later (e.g. via enthrall-bench's -t option) to reproduce
+ * and profile sluggishness.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "message.h"
+
+/*
+ * Trace file format (all integers big-endian):
+ *
+ *   header:  TRACE_MAGIC, u32 TRACE_VERSION, u32 number of remotes, then
+ *            for each remote a u32 length followed by its name.
+ *
+ *   records: u32 microseconds since the previous record (or the start of
+ *            the trace), u16 remote (index into the header's list), u8 kind,
+ *            u32 length, and then for TR_FRAME records that many bytes of
+ *            XDR-encoded message (i.e. a frame as it goes out on the wire,
+ *            before any sealing).  TR_CLIPBOARD records stand in for
+ *            SETCLIPBOARD messages, giving only the text's length rather
+ *            than its contents.
+ *
+ * SETUP messages (which may carry session tokens) aren't recorded.
+ */
+#define TRACE_MAGIC "ENTHTRC\0"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_VERSION 1
+
+enum trace_kind {
+	TR_FRAME = 0,
+	TR_CLIPBOARD,
+};
+
+/* Size of the in-memory ring records are buffered in on their way out */
+#define TRACE_RING_SIZE (4 * 1024 * 1024)
+
+/* How long records may sit in the ring before being written out */
+#define TRACE_FLUSH_INTERVAL (250 * 1000)
+
+/* Most that's written out of the ring per pass through the event loop */
+#define TRACE_FLUSH_CHUNK (64 * 1024)
+
+struct remote;
+
+/* Recording (from the master) */
+int trace_start(const char* path, struct remote* remotes);
+struct message* trace_message(const struct remote* rmt, struct message* msg);
+void trace_stop(void);
+
+/* A trace file read into memory for replaying */
+struct trace {
+	char* buf;
+	size_t len;
+	size_t pos;
+
+	unsigned int num_remotes;
+	char** remotes;
+
+	uint64_t when;
+};
+
+struct trace_record {
+	/* Microseconds since the start of the trace */
+	uint64_t when;
+
+	unsigned int remote;
+	enum trace_kind kind;
+
+	/* The encoded message body (TR_FRAME) or clipboard length (TR_CLIPBOARD) */
+	char* data;
+	uint32_t len;
+};
+
+int load_trace(const char* path, struct trace* tr);
+int next_trace_record(struct trace* tr, struct trace_record* rec);
+void free_trace(struct trace* tr);
+
+#endif /* TRACE_H */
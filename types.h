@@ -85,8 +85,29 @@ struct edge_state {
 	unsigned int evidx;
 };
 
+/*
+ * State of a node's display-brightness fade.  There's at most one fade (and
+ * hence one pending timer) per node at a time; when a new one is started
+ * while another is in progress the old one is simply retargeted.
+ */
+struct brightness_fade {
+	/* Pending timer for the next step (NULL if no fade is in progress) */
+	timer_ctx_t timer;
+
+	/* Last brightness level actually applied (valid only if 'known') */
+	float level;
+	int known;
+
+	/* Where the current fade started and where it's headed */
+	float start, target;
+
+	int step, steps;
+	uint64_t duration;
+};
+
 #include "msgchan.h"
 #include "message.h"
+#include "stats.h"
 #include "kvmap.h"
 
 struct node {
@@ -104,6 +125,9 @@ struct node {
 	/* Bitmask of which screen edges the mouse pointer is currently at */
 	dirmask_t edgemask;
 
+	/* Focus-hint brightness fade state */
+	struct brightness_fade fade;
+
 	/* Pointer to the remote info for this node (NULL for master) */
 	struct remote* remote;
 };
@@ -128,6 +152,9 @@ struct remote {
 	/* pid of the ssh process we're connected via */
 	pid_t sshpid;
 
+	/* when the current connection attempt was initiated */
+	uint64_t setup_start;
+
 	/*
 	 * How many times (since the last successful one) this remote's
 	 * connection has failed.
@@ -140,9 +167,84 @@ struct remote {
 	/* multiplier for scroll-wheel events (some systems scroll "slower" than others) */
 	int scrollmult;
 
+	/* whether this remote is in the broadcast-input group */
+	int broadcast;
+
+	/* index identifying this remote in the trace file (if tracing) */
+	unsigned int trace_id;
+
+	/*
+	 * What the master last knew this remote's clipboard to hold (if
+	 * clipboard_known is set), i.e. what it was last sent or retrieved.
+	 */
+	struct cliphash clipboard;
+	int clipboard_known;
+
+	/*
+	 * Whether the remote reports (via CLIPBOARDLOST) its clipboard
+	 * changing hands, without which clipboard_known can't be
+	 * trusted to still hold by the time we'd push to it.
+	 */
+	int clipboard_watched;
+
+	/*
+	 * Whether it's been sent a CLIPPENDING not yet followed by new
+	 * contents (or word that none are coming).
+	 */
+	int clipboard_pending;
+
+	/* The remote's persistent session (if it has one; see remote.c) */
+	struct {
+		char* id;
+		char* token;
+	} session;
+
 	/* msgchan by which the master exchanges messages with this remote */
 	struct msgchan msgchan;
 
+	/*
+	 * Traffic statistics (if enabled), and when the earliest MOVEREL
+	 * not yet answered by a MOUSEPOS was sent (zero if there's none),
+	 * for measuring the round-trip time.
+	 */
+	struct mcstats stats;
+	uint64_t moverel_sent;
+
+	/*
+	 * Heartbeat state: the timer for sending the next PING, the sequence
+	 * numbers of the last PING sent and PONG received, how many heartbeat
+	 * intervals have passed with no PONG, and the smoothed round-trip
+	 * time in microseconds (zero until measured).
+	 */
+	struct {
+		timer_ctx_t timer;
+		uint32_t seq, acked;
+		int missed;
+		uint64_t srtt;
+	} heartbeat;
+
+	/*
+	 * Direct-transport state: the seals for each direction (created when
+	 * offering it in the SETUP), and the connection to the remote while
+	 * it's being established and switched over to, plus likewise for the
+	 * motion side-channel (motionfd being -1 when there's none pending).
+	 */
+	struct {
+		enum {
+			DT_NONE = 0,
+			DT_OFFERED,
+			DT_CONNECTING,
+			DT_SWITCHING,
+			DT_ACTIVE,
+		} state;
+		int fd;
+		struct fdmon_ctx* mon;
+		struct seal* sendseal;
+		struct seal* recvseal;
+		int motionfd;
+		struct seal* motionseal;
+	} direct;
+
 	/* for linking into a list of remotes */
 	struct remote* next;
 };
@@ -185,6 +287,7 @@ struct action {
 		AT_RECONNECT,
 		AT_HALT_RECONNECTS,
 		AT_QUIT,
+		AT_BROADCAST_INPUT,
 	} type;
 	union {
 		struct focus_target target;
@@ -276,6 +379,49 @@ struct config {
 	struct ssh_config ssh_defaults;
 	int use_private_ssh_agent;
 
+	/* share ssh connections via ControlMaster sockets */
+	struct {
+		int enabled;
+		uint64_t persist;
+	} ssh_multiplex;
+
+	/* merge queued-up mouse motion when a remote's link backs up */
+	int coalesce_motion;
+
+	/* have remotes report pointer position only on edge changes */
+	int remote_edge_detection;
+
+	/* skip clipboard transfers to/from nodes that already have it */
+	int clipboard_hashing;
+
+	/* offer to compress large clipboard transfers */
+	int clipboard_compression;
+
+	/* offer to move remote connections off ssh onto direct TCP */
+	int direct_transport;
+
+	/* with direct_transport, send pointer motion via UDP too */
+	int udp_motion;
+
+	/* send runs of input events to remotes as EVENTBATCH messages */
+	int event_batching;
+	uint64_t event_batch_window;
+
+	/* collect traffic/latency statistics, dumped on SIGUSR1 */
+	int stats;
+
+	/* have remotes linger this long after disconnection for resuming */
+	uint64_t remote_persist;
+
+	/* record messages sent to remotes to this file (if set) */
+	char* trace_file;
+
+	/* PING remotes this often (zero to disable), failing after max_missed */
+	struct {
+		uint64_t interval;
+		int max_missed;
+	} heartbeat;
+
 	struct node master;
 };
 
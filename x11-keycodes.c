@@ -216,6 +216,12 @@ static struct {
 	unsigned int numents;
 } basic_tokeysym;
 
+/*
+ * Direct keycode_t -> X KeyCode translations for the current server keymap
+ * (same size as basic_tokeysym), filled in by x11_keycodes_refresh().
+ */
+static KeyCode* xkeycodes;
+
 void x11_keycodes_init(void)
 {
 	int i;
@@ -237,11 +243,30 @@ void x11_keycodes_init(void)
 		if (basic_fromkeysym[i])
 			basic_tokeysym.table[basic_fromkeysym[i]] = i;
 	}
+
+	xkeycodes = xcalloc(basic_tokeysym.numents * sizeof(*xkeycodes));
 }
 
 void x11_keycodes_exit(void)
 {
 	xfree(basic_tokeysym.table);
+	xfree(xkeycodes);
+}
+
+/*
+ * (Re-)build the keycode_t -> KeyCode table from the given display's
+ * keymap; to be called once it's open and again whenever the mapping
+ * changes.
+ */
+void x11_keycodes_refresh(Display* disp)
+{
+	unsigned int i;
+	KeySym sym;
+
+	for (i = 0; i < basic_tokeysym.numents; i++) {
+		sym = basic_tokeysym.table[i];
+		xkeycodes[i] = sym ? XKeysymToKeycode(disp, sym) : 0;
+	}
 }
 
 keycode_t keysym_to_keycode(KeySym sym)
@@ -252,13 +277,10 @@ keycode_t keysym_to_keycode(KeySym sym)
 		return basic_fromkeysym[sym];
 }
 
-KeyCode keycode_to_xkeycode(Display* disp, keycode_t kc)
+KeyCode keycode_to_xkeycode(keycode_t kc)
 {
-	KeySym sym;
-
 	if (kc >= basic_tokeysym.numents)
 		return 0;
 
-	sym = basic_tokeysym.table[kc];
-	return XKeysymToKeycode(disp, sym);
+	return xkeycodes[kc];
 }
@@ -10,8 +10,9 @@
 
 void x11_keycodes_init(void);
 void x11_keycodes_exit(void);
+void x11_keycodes_refresh(Display* disp);
 
 keycode_t keysym_to_keycode(KeySym sym);
-KeyCode keycode_to_xkeycode(Display* disp, keycode_t kc);
+KeyCode keycode_to_xkeycode(keycode_t kc);
 
 #endif /* X11_KEYCODES_H */
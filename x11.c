@@ -13,10 +13,12 @@
 #include <X11/extensions/XTest.h>
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/XInput2.h>
+#include <X11/extensions/Xfixes.h>
 
 #include "types.h"
 #include "misc.h"
 #include "platform.h"
+#include "evloop.h"
 #include "x11-keycodes.h"
 
 static Display* xdisp = NULL;
@@ -28,14 +30,30 @@ static Cursor xcursor_blank;
 static Atom et_selection_data;
 static Atom utf8_string_atom;
 static Atom targets_atom;
+static Atom incr_atom;
 
 static Time last_xevent_time;
 
+/* A CRTC's gamma table scaled for a given (quantized) brightness level */
+struct scaled_gamma {
+	int level;
+	unsigned int lastuse;
+	XRRCrtcGamma* ramp;
+};
+
 struct crtc_gamma {
 	XRRCrtcGamma* orig;
-	XRRCrtcGamma* alt;
+
+	/* Brightness level currently applied (-1 if not yet known) */
+	int level;
+
+	/* Recently-used scaled tables (slots not yet used having a NULL ramp) */
+	struct scaled_gamma cache[GAMMA_CACHE_SLOTS];
 };
 
+/* For tracking how recently each cached table was used */
+static unsigned int gamma_cache_clock;
+
 static struct {
 	XRRScreenConfiguration* config;
 	XRRScreenResources* resources;
@@ -48,25 +66,123 @@ static struct {
 	int evbase;
 } xi2;
 
+static struct {
+	int evbase;
+	int errbase;
+} xfixes;
+
+/*
+ * The selections we set and serve clipboard_text via, and since when we've
+ * owned each (zero if not).  Losing one doesn't affect the other, and
+ * clipboard_text is kept as long as we still own either.
+ */
 static struct {
 	const char* name;
 	Atom atom;
+	Time owned_since;
 } clipboard_xatoms[] = {
 	{ "PRIMARY", XA_PRIMARY, },
 	{ "CLIPBOARD", None, }, /* filled in in platform_init() */
 };
 
 static char* clipboard_text;
-static Time xselection_owned_since;
+
+/* Called on changes of ownership of the selection we read (see below) */
+static clipboard_lost_handler_t* clipboard_lost_cb;
+
+/* A SelectionRequest whose answer is being held back by hold_clipboard() */
+struct held_selreq {
+	XSelectionRequestEvent req;
+	struct held_selreq* next;
+};
+
+/*
+ * How long (and for how many requests) to hold back answering SelectionRequests
+ * for contents we've been told are on their way before giving up on them
+ */
+#define CLIPBOARD_HOLD_TIMEOUT_US (5 * 1000 * 1000)
+#define CLIPBOARD_HOLD_MAX 32
+
+static struct {
+	int active;
+	timer_ctx_t timer;
+	struct held_selreq* reqs;
+	struct held_selreq** tail;
+	unsigned int num;
+} clipboard_hold;
+
+/*
+ * An in-progress INCR transfer of our selection to another client (ICCCM
+ * sec. 2.7.2), advanced a chunk at a time as the requestor deletes the
+ * property we've written each previous chunk to.
+ */
+struct incr_send {
+	Window requestor;
+	Atom property;
+	Atom target;
+
+	/* Private copy, in case the selection changes mid-transfer */
+	char* data;
+	size_t len;
+	size_t sent;
+
+	uint64_t last_progress;
+
+	struct incr_send* next;
+};
+
+static struct incr_send* incr_sends;
+
+/* A caller of get_clipboard_text_async() awaiting the selection */
+struct selection_waiter {
+	clipboard_text_cb_t cb;
+	void* arg;
+	struct selection_waiter* next;
+};
+
+/* State of a retrieval of the selection from its (other) owner */
+static struct {
+	/* Awaiting SelectionNotify or (if incr is set) further INCR chunks */
+	int active;
+	int incr;
+
+	/* Data received so far */
+	char* buf;
+	size_t len;
+	size_t size;
+
+	uint64_t last_progress;
+	timer_ctx_t timer;
+
+	/* Who to hand the result to when done */
+	struct selection_waiter* waiters;
+	struct selection_waiter** waiters_tail;
+} selfetch;
 
 /* Clipboard contents are potentially sensitive, so wipe before freeing. */
 static void clear_clipboard_cache(void)
 {
+	int i;
+
 	if (clipboard_text)
 		explicit_bzero(clipboard_text, strlen(clipboard_text));
 	xfree(clipboard_text);
 	clipboard_text = NULL;
-	xselection_owned_since = 0;
+
+	for (i = 0; i < ARR_LEN(clipboard_xatoms); i++)
+		clipboard_xatoms[i].owned_since = 0;
+}
+
+static int owns_any_selection(void)
+{
+	int i;
+
+	for (i = 0; i < ARR_LEN(clipboard_xatoms); i++) {
+		if (clipboard_xatoms[i].owned_since)
+			return 1;
+	}
+
+	return 0;
 }
 
 /* Mask combining currently-applied modifiers and mouse buttons */
@@ -82,16 +198,18 @@ struct xypoint screen_center;
 /* Handler to fire when mouse position changes (in master mode) */
 static mousepos_handler_t* mousepos_handler;
 
-struct scheduled_call {
-	void (*fn)(void* arg);
-	void* arg;
-	uint64_t calltime;
-	struct scheduled_call* next;
-};
+/* Event-loop monitor for the X connection's file descriptor */
+static struct fdmon_ctx* xfd_mon;
 
-static struct scheduled_call* scheduled_calls;
+static void xfd_read_cb(struct fdmon_ctx* ctx, void* arg);
+static void x11_prepoll(void);
+static void selection_exit(void);
 
 struct xhotkey {
+	/* As given to bind_hotkey(), for re-resolving on keymap changes */
+	char* keystr;
+
+	/* Zero if the key isn't available in the current keymap */
 	KeyCode key;
 	unsigned int modmask;
 
@@ -103,6 +221,23 @@ struct xhotkey {
 
 static struct xhotkey* xhotkeys = NULL;
 
+/* (X KeyCodes are 8 bits, as are all the core modifier masks.) */
+#define NUM_XKEYCODES 256
+#define NUM_MODSTATES 256
+
+/*
+ * Bound hotkeys indexed by KeyCode and then by (relevant) modifier state,
+ * so that matching a key event is a couple of array lookups.  Second-level
+ * tables are only allocated for keys that have hotkeys bound.
+ */
+static struct xhotkey** hotkey_table[NUM_XKEYCODES];
+
+/*
+ * The modifier mask (if any) of each KeyCode in the current keymap, for
+ * tracking xstate when injecting key events.
+ */
+static unsigned int xkc_modmasks[NUM_XKEYCODES];
+
 static const struct {
 	const char* name;
 	unsigned int mask;
@@ -117,9 +252,11 @@ static const struct {
 	[Mod5MapIndex]    = { "mod5",     Mod5Mask,    },
 };
 
+#define ALL_MODS_MASK \
+	(ShiftMask|ControlMask|Mod1Mask|Mod2Mask|Mod3Mask|Mod4Mask|Mod5Mask)
+
 /* Some of these may get removed to account for NumLock, etc. */
-static unsigned int relevant_modmask = \
-	(ShiftMask|ControlMask|Mod1Mask|Mod2Mask|Mod3Mask|Mod4Mask|Mod5Mask);
+static unsigned int relevant_modmask = ALL_MODS_MASK;
 
 static unsigned int get_mod_mask(KeySym modsym)
 {
@@ -197,22 +334,36 @@ static int grab_key(KeyCode kc, unsigned int modmask)
 	return status;
 }
 
-static inline int match_hotkey(const struct xhotkey* hk, const XKeyEvent* kev)
+static const struct xhotkey* find_hotkey(const XKeyEvent* kev)
 {
-	return kev->keycode == hk->key &&
-		(kev->state & relevant_modmask) == (hk->modmask & relevant_modmask);
+	struct xhotkey** modtable;
+
+	if (kev->keycode >= NUM_XKEYCODES)
+		return NULL;
+
+	modtable = hotkey_table[kev->keycode];
+
+	return modtable ? modtable[kev->state & relevant_modmask] : NULL;
 }
 
-static const struct xhotkey* find_hotkey(const XKeyEvent* kev)
+static void insert_hotkey(struct xhotkey* hk)
 {
-	const struct xhotkey* k;
+	struct xhotkey*** modtable = &hotkey_table[hk->key];
 
-	for (k = xhotkeys; k; k = k->next) {
-		if (match_hotkey(k, kev))
-			return k;
-	}
+	if (!*modtable)
+		*modtable = xcalloc(NUM_MODSTATES * sizeof(**modtable));
 
-	return NULL;
+	(*modtable)[hk->modmask & relevant_modmask] = hk;
+}
+
+static void clear_hotkey_table(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_XKEYCODES; i++) {
+		xfree(hotkey_table[i]);
+		hotkey_table[i] = NULL;
+	}
 }
 
 #define XKEYMAP_SIZE 32
@@ -378,6 +529,7 @@ int bind_hotkey(const char* keystr, hotkey_callback_t cb, void* arg)
 	}
 
 	k = xmalloc(sizeof(*k));
+	k->keystr = xstrdup(keystr);
 	k->key = kc;
 	k->modmask = modmask;
 	k->callback = cb;
@@ -385,6 +537,7 @@ int bind_hotkey(const char* keystr, hotkey_callback_t cb, void* arg)
 	k->next = xhotkeys;
 
 	xhotkeys = k;
+	insert_hotkey(k);
 
 	status = grab_key(kc, modmask);
 
@@ -410,6 +563,71 @@ int bind_hotkey(const char* keystr, hotkey_callback_t cb, void* arg)
 	return status ? -1 : 0;
 }
 
+static void refresh_modmasks(void)
+{
+	int kc, minkc, maxkc, i;
+	KeyCode symkc;
+	KeySym sym;
+	XModifierKeymap* modmap = XGetModifierMapping(xdisp);
+
+	memset(xkc_modmasks, 0, sizeof(xkc_modmasks));
+	XDisplayKeycodes(xdisp, &minkc, &maxkc);
+
+	for (kc = minkc; kc <= maxkc && kc < NUM_XKEYCODES; kc++) {
+		sym = XkbKeycodeToKeysym(xdisp, kc, 0, 0);
+		if (!IsModifierKey(sym))
+			continue;
+
+		/* (Same as get_mod_mask(sym), minus refetching modmap.) */
+		symkc = XKeysymToKeycode(xdisp, sym);
+		for (i = 0; i < 8 * modmap->max_keypermod; i++) {
+			if (modmap->modifiermap[i] == symkc) {
+				xkc_modmasks[kc] = xmodifiers[i / modmap->max_keypermod].mask;
+				break;
+			}
+		}
+	}
+
+	XFreeModifiermap(modmap);
+}
+
+/*
+ * (Re-)build everything derived from the server's keyboard mapping: the
+ * key translation tables and modifier masks, and the hotkey table and
+ * grabs, whose keys have to be looked up anew.
+ */
+static void refresh_keymap(void)
+{
+	struct xhotkey* hk;
+
+	x11_keycodes_refresh(xdisp);
+	refresh_modmasks();
+
+	/*
+	 * Remove scroll lock and num lock from the set of modifiers we pay
+	 * attention to in matching hotkey bindings
+	 */
+	relevant_modmask = ALL_MODS_MASK & ~(get_mod_mask(XK_Scroll_Lock)
+	                                     | get_mod_mask(XK_Num_Lock));
+
+	if (!xhotkeys)
+		return;
+
+	XUngrabKey(xdisp, AnyKey, AnyModifier, xrootwin);
+	clear_hotkey_table();
+
+	for (hk = xhotkeys; hk; hk = hk->next) {
+		if (parse_keystring(hk->keystr, &hk->key, &hk->modmask)
+		    || find_hotkey(&(XKeyEvent){ .keycode = hk->key, .state = hk->modmask, })
+		    || grab_key(hk->key, hk->modmask)) {
+			warn("hotkey '%s' unavailable with new keymap\n", hk->keystr);
+			hk->key = 0;
+			continue;
+		}
+		insert_hotkey(hk);
+	}
+}
+
 static int xrr_init(void)
 {
 	int i;
@@ -430,11 +648,11 @@ static int xrr_init(void)
 		return -1;
 	}
 
-	xrr.crtc_gammas = xmalloc(xrr.resources->ncrtc * sizeof(*xrr.crtc_gammas));
+	xrr.crtc_gammas = xcalloc(xrr.resources->ncrtc * sizeof(*xrr.crtc_gammas));
 
 	for (i = 0; i < xrr.resources->ncrtc; i++) {
 		xrr.crtc_gammas[i].orig = XRRGetCrtcGamma(xdisp, xrr.resources->crtcs[i]);
-		xrr.crtc_gammas[i].alt = XRRAllocGamma(xrr.crtc_gammas[i].orig->size);
+		xrr.crtc_gammas[i].level = -1;
 	}
 
 	return 0;
@@ -442,31 +660,28 @@ static int xrr_init(void)
 
 static void xrr_exit(void)
 {
-	int i;
-	struct scheduled_call* sc;
+	int i, j;
 
 	for (i = 0; i < xrr.resources->ncrtc; i++) {
 		XRRFreeGamma(xrr.crtc_gammas[i].orig);
-		XRRFreeGamma(xrr.crtc_gammas[i].alt);
+		for (j = 0; j < GAMMA_CACHE_SLOTS; j++) {
+			if (xrr.crtc_gammas[i].cache[j].ramp)
+				XRRFreeGamma(xrr.crtc_gammas[i].cache[j].ramp);
+		}
 	}
 	xfree(xrr.crtc_gammas);
 
 	XRRFreeScreenResources(xrr.resources);
 	XRRFreeScreenConfigInfo(xrr.config);
-
-	while (scheduled_calls) {
-		sc = scheduled_calls;
-		scheduled_calls = sc->next;
-		xfree(sc);
-	}
 }
 
 static int xi2_init(void)
 {
 	Status status;
 	unsigned char rawmask[XIMaskLen(XI_LASTEVENT)];
+	unsigned char hiermask[XIMaskLen(XI_LASTEVENT)];
 	int maj = 2, min = 0;
-	XIEventMask ximask;
+	XIEventMask ximask[2];
 
 	if (!XQueryExtension(xdisp, "XInputExtension", &xi2.opcode, &xi2.evbase,
 	                     &xi2.errbase)) {
@@ -518,17 +733,31 @@ static int xi2_init(void)
 	 * to open-loop re-create the X server's logic in tracking the
 	 * effective logical absolute pointer position by summing up all the
 	 * little deltas the raw events give us (and probably doing a crappy
-	 * job of it), we instead just (inefficiently) call XQueryPointer() to
-	 * see what the server thinks every time we get one.  Sigh.  Ugly, but
-	 * at least it works, and doesn't seem to screw up other clients.
+	 * job of it), we instead call XQueryPointer() to see what the server
+	 * thinks whenever it might matter.  Sigh.  Ugly, but at least it
+	 * works, and doesn't seem to screw up other clients.  Since doing so
+	 * on every event is a synchronous round-trip in the hottest path we
+	 * have, we do keep a rough running estimate from the deltas, but only
+	 * use it to decide when the pointer is far enough from any screen edge
+	 * that a query can be skipped (see the ptrack code).
+	 *
+	 * Hierarchy events just tell us when input devices come and go, so
+	 * that the tracker re-checks which ones report relative motion.
 	 */
 
 	memset(rawmask, 0, sizeof(rawmask));
-	ximask.mask = rawmask;
-	ximask.mask_len = sizeof(rawmask);
-	ximask.deviceid = XIAllMasterDevices;
-	XISetMask(ximask.mask, XI_RawMotion);
-	status = XISelectEvents(xdisp, xrootwin, &ximask, 1);
+	ximask[0].mask = rawmask;
+	ximask[0].mask_len = sizeof(rawmask);
+	ximask[0].deviceid = XIAllMasterDevices;
+	XISetMask(ximask[0].mask, XI_RawMotion);
+
+	memset(hiermask, 0, sizeof(hiermask));
+	ximask[1].mask = hiermask;
+	ximask[1].mask_len = sizeof(hiermask);
+	ximask[1].deviceid = XIAllDevices;
+	XISetMask(ximask[1].mask, XI_HierarchyChanged);
+
+	status = XISelectEvents(xdisp, xrootwin, ximask, ARR_LEN(ximask));
 
 	return status ? -1 : 0;
 }
@@ -603,6 +832,10 @@ int platform_init(struct kvmap* params, mousepos_handler_t* mouse_handler)
 	et_selection_data = XInternAtom(xdisp, "ET_SELECTION_DATA", False);
 	utf8_string_atom = XInternAtom(xdisp, "UTF8_STRING", False);
 	targets_atom = XInternAtom(xdisp, "TARGETS", False);
+	incr_atom = XInternAtom(xdisp, "INCR", False);
+
+	/* For INCR selection transfers to us */
+	XSelectInput(xdisp, xwin, PropertyChangeMask);
 
 	for (i = 0; i < ARR_LEN(clipboard_xatoms); i++) {
 		if (clipboard_xatoms[i].atom == None) {
@@ -619,15 +852,14 @@ int platform_init(struct kvmap* params, mousepos_handler_t* mouse_handler)
 	/* Clear any key grabs (not that any should exist, really...) */
 	XUngrabKey(xdisp, AnyKey, AnyModifier, xrootwin);
 
-	/*
-	 * Remove scroll lock and num lock from the set of modifiers we pay
-	 * attention to in matching hotkey bindings
-	 */
-	relevant_modmask &= ~(get_mod_mask(XK_Scroll_Lock)
-	                      | get_mod_mask(XK_Num_Lock));
+	refresh_keymap();
 
 	mousepos_handler = mouse_handler;
 
+	xfd_mon = fdmon_register_fd(XConnectionNumber(xdisp), xfd_read_cb, NULL, NULL);
+	fdmon_monitor(xfd_mon, FM_READ);
+	evloop_set_prepoll_hook(x11_prepoll);
+
 	status = xrr_init();
 	if (!status)
 		status = xi2_init();
@@ -643,46 +875,163 @@ void platform_exit(void)
 
 	set_display_brightness(1.0);
 
+	evloop_set_prepoll_hook(NULL);
+	fdmon_unregister(xfd_mon);
+	xfd_mon = NULL;
+
+	selection_exit();
 	xrr_exit();
 	XFreeCursor(xdisp, xcursor_blank);
 	XFreePixmap(xdisp, cursor_pixmap);
+	release_clipboard();
+
 	XDestroyWindow(xdisp, xwin);
 	XCloseDisplay(xdisp);
 	x11_keycodes_exit();
 
+	clear_hotkey_table();
 	while (xhotkeys) {
 		hk = xhotkeys;
 		xhotkeys = hk->next;
+		xfree(hk->keystr);
 		xfree(hk);
 	}
 
 	clear_clipboard_cache();
 }
 
-#if defined(CLOCK_MONOTONIC_RAW)
-#define CGT_CLOCK CLOCK_MONOTONIC_RAW
-#elif defined(CLOCK_UPTIME_PRECISE)
-#define CGT_CLOCK CLOCK_UPTIME_PRECISE
-#else
-#error no CGT_CLOCK!
-#endif
+void get_screen_dimensions(struct rectangle* d)
+{
+	*d = screen_dimensions;
+}
+
+/*
+ * Pointer-position tracking, to avoid querying the X server for the pointer
+ * position more than we need to.  'pos' is where we last knew the pointer
+ * to be, plus any motion since then that we know about (our own warps and
+ * RawMotion deltas from relative devices), and is trusted when 'valid',
+ * sufficiently recently synced with the server, and not within
+ * PTRACK_EDGE_MARGIN pixels of a screen edge (where the server's clamping
+ * and acceleration make the difference between an estimate and the real
+ * thing matter).  Anything we can't account for (e.g. events from an
+ * absolute device like a tablet) just clears 'valid'.
+ *
+ * 'near_edge' is whether the position last passed to mousepos_handler was
+ * near an edge, so that we know to keep querying (and reporting) until it
+ * has properly moved away from it.
+ */
+#define PTRACK_EDGE_MARGIN 64
+#define PTRACK_RESYNC_US (100 * 1000)
+
+/* Device IDs beyond this aren't cached (and are treated as absolute) */
+#define PTRACK_MAX_DEVID 128
+
+static struct {
+	struct xypoint pos;
+	double frac_x, frac_y;
+	int valid;
+	uint64_t synced;
+	int near_edge;
+
+	/* Per-device: zero if unknown, 1 if relative, -1 if not */
+	signed char devmode[PTRACK_MAX_DEVID];
+} ptrack;
 
-uint64_t get_microtime(void)
+static inline int32_t clamp_coord(int64_t v, const struct range* r)
 {
-	struct timespec ts;
-	if (clock_gettime(CGT_CLOCK, &ts)) {
-		perror("clock_gettime");
-		abort();
+	return v < r->min ? r->min : v > r->max ? r->max : v;
+}
+
+/* Is the given point close enough to a screen edge to warrant a query? */
+static int near_screen_edge(struct xypoint pt)
+{
+	return pt.x - screen_dimensions.x.min < PTRACK_EDGE_MARGIN
+		|| screen_dimensions.x.max - pt.x < PTRACK_EDGE_MARGIN
+		|| pt.y - screen_dimensions.y.min < PTRACK_EDGE_MARGIN
+		|| screen_dimensions.y.max - pt.y < PTRACK_EDGE_MARGIN;
+}
+
+static void ptrack_set(struct xypoint pt)
+{
+	ptrack.pos = pt;
+	ptrack.frac_x = ptrack.frac_y = 0.0;
+}
+
+static void ptrack_move(double dx, double dy)
+{
+	double x = ptrack.pos.x + ptrack.frac_x + dx;
+	double y = ptrack.pos.y + ptrack.frac_y + dy;
+
+	ptrack.pos.x = clamp_coord(floor(x), &screen_dimensions.x);
+	ptrack.pos.y = clamp_coord(floor(y), &screen_dimensions.y);
+	ptrack.frac_x = x - floor(x);
+	ptrack.frac_y = y - floor(y);
+}
+
+static inline int ptrack_trusted(void)
+{
+	return ptrack.valid && !near_screen_edge(ptrack.pos)
+		&& (get_microtime() - ptrack.synced) < PTRACK_RESYNC_US;
+}
+
+/* Does the given (slave) device report its X and Y axes as relative motion? */
+static int device_is_relative(int devid)
+{
+	XIDeviceInfo* info;
+	XIValuatorClassInfo* vc;
+	int i, n, relaxes = 0;
+
+	if (devid < 0 || devid >= PTRACK_MAX_DEVID)
+		return 0;
+
+	if (!ptrack.devmode[devid]) {
+		ptrack.devmode[devid] = -1;
+		info = XIQueryDevice(xdisp, devid, &n);
+		for (i = 0; info && i < info->num_classes; i++) {
+			if (info->classes[i]->type != XIValuatorClass)
+				continue;
+			vc = (XIValuatorClassInfo*)info->classes[i];
+			if ((vc->number == 0 || vc->number == 1) && vc->mode == XIModeRelative)
+				relaxes += 1;
+		}
+		if (relaxes == 2)
+			ptrack.devmode[devid] = 1;
+		if (info)
+			XIFreeDeviceInfo(info);
 	}
-	return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+	return ptrack.devmode[devid] > 0;
 }
 
-void get_screen_dimensions(struct rectangle* d)
+/* Update the tracked position from a RawMotion event's (accelerated) deltas. */
+static void ptrack_rawmotion(XIRawEvent* rev)
 {
-	*d = screen_dimensions;
+	const double* val = rev->valuators.values;
+	double dx = 0.0, dy = 0.0;
+	int i;
+
+	if (!ptrack.valid)
+		return;
+
+	if (!device_is_relative(rev->sourceid)) {
+		ptrack.valid = 0;
+		return;
+	}
+
+	for (i = 0; i < rev->valuators.mask_len * 8 && i < 2; i++) {
+		if (!XIMaskIsSet(rev->valuators.mask, i))
+			continue;
+		if (i == 0)
+			dx = *val;
+		else
+			dy = *val;
+		val++;
+	}
+
+	ptrack_move(dx, dy);
 }
 
-static struct xypoint get_mousepos_and_mask(unsigned int* mask)
+static struct xypoint query_mousepos(unsigned int* mask)
 {
 	Window xchildwin, root_ret;
 	int child_x, child_y, tmp_x, tmp_y;
@@ -702,25 +1051,39 @@ static struct xypoint get_mousepos_and_mask(unsigned int* mask)
 
 	*mask &= relevant_modmask;
 
+	ptrack_set(pt);
+	ptrack.valid = 1;
+	ptrack.synced = get_microtime();
+
 	return pt;
 }
 
 struct xypoint get_mousepos(void)
 {
 	unsigned int tmpmask;
-	return get_mousepos_and_mask(&tmpmask);
+
+	if (ptrack_trusted())
+		return ptrack.pos;
+
+	return query_mousepos(&tmpmask);
 }
 
 void set_mousepos(struct xypoint pt)
 {
 	XWarpPointer(xdisp, None, xrootwin, 0, 0, 0, 0, pt.x, pt.y);
-	XFlush(xdisp);
+
+	ptrack_set((struct xypoint){
+		.x = clamp_coord(pt.x, &screen_dimensions.x),
+		.y = clamp_coord(pt.y, &screen_dimensions.y),
+	});
 }
 
 void move_mousepos(int32_t dx, int32_t dy)
 {
 	XWarpPointer(xdisp, None, None, 0, 0, 0, 0, dx, dy);
-	XFlush(xdisp);
+
+	ptrack_move(dx, dy);
+
 	if (mousepos_handler)
 		mousepos_handler(get_mousepos());
 }
@@ -747,7 +1110,6 @@ void do_clickevent(mousebutton_t button, pressrel_t pr)
 {
 	XTestFakeButtonEvent(xdisp, LOOKUP(button, x11_mousebuttons).button,
 	                     pr == PR_PRESS, CurrentTime);
-	XFlush(xdisp);
 
 	/* Update modifier/mousebutton state */
 	if (pr == PR_PRESS)
@@ -756,25 +1118,43 @@ void do_clickevent(mousebutton_t button, pressrel_t pr)
 		xstate &= ~LOOKUP(button, x11_mousebuttons).mask;
 }
 
-static unsigned int modmask_for_xkeycode(KeyCode xkc)
+/* Fractional notches left over from the last do_scroll() */
+static int32_t scroll_remainder;
+
+void do_scroll(int32_t amount)
 {
-	KeySym sym = XkbKeycodeToKeysym(xdisp, xkc, 0, 0);
+	int32_t notches;
+	unsigned int i, button;
+	mousebutton_t mb;
 
-	if (!IsModifierKey(sym))
-		return 0;
-	else
-		return get_mod_mask(sym);
+	/* Ignore absurd amounts (which also keeps the sum below from overflowing) */
+	amount = clamp_scroll(amount);
+
+	/* Don't let leftovers from scrolling one way eat into the other */
+	if ((scroll_remainder < 0) != (amount < 0))
+		scroll_remainder = 0;
+
+	amount += scroll_remainder;
+	notches = amount / SCROLL_NOTCH;
+	scroll_remainder = amount % SCROLL_NOTCH;
+
+	mb = notches < 0 ? MB_SCROLLDOWN : MB_SCROLLUP;
+	button = LOOKUP(mb, x11_mousebuttons).button;
+
+	for (i = 0; i < abs(notches); i++) {
+		XTestFakeButtonEvent(xdisp, button, True, CurrentTime);
+		XTestFakeButtonEvent(xdisp, button, False, CurrentTime);
+	}
 }
 
 void do_keyevent(keycode_t key, pressrel_t pr)
 {
 	unsigned int modmask;
-	KeyCode xkc = keycode_to_xkeycode(xdisp, key);
+	KeyCode xkc = keycode_to_xkeycode(key);
 
 	XTestFakeKeyEvent(xdisp, xkc, pr == PR_PRESS, CurrentTime);
-	XFlush(xdisp);
 
-	modmask = modmask_for_xkeycode(xkc);
+	modmask = xkc_modmasks[xkc];
 	if (modmask) {
 		if (pr == PR_PRESS)
 			xstate |= modmask;
@@ -877,139 +1257,677 @@ static Status send_selection_notify(const XSelectionRequestEvent* req, Atom prop
 	return XSendEvent(xdisp, req->requestor, False, 0, &ev);
 }
 
-static int is_known_clipboard_xatom(Atom atom)
+/* Index in clipboard_xatoms of the given selection, or -1 if it's not one */
+static int clipboard_xatom_index(Atom atom)
 {
 	int i;
 
 	if (atom == None)
-		return 0;
+		return -1;
 
 	for (i = 0; i < ARR_LEN(clipboard_xatoms); i++) {
 		if (clipboard_xatoms[i].atom == atom)
-			return 1;
+			return i;
 	}
 
-	return 0;
+	return -1;
 }
 
-static void handle_selection_request(const XSelectionRequestEvent* req)
+static int is_known_clipboard_xatom(Atom atom)
 {
-	Atom property;
-	Atom supported_targets[] = { targets_atom, XA_STRING,  };
-
-	/*
-	 * ICCCM sec. 2.2:
-	 *
-	 * "If the specified property is None , the requestor is an obsolete
-	 *  client. Owners are encouraged to support these clients by using
-	 *  the specified target atom as the property name to be used for the
-	 *  reply."
-	 */
-	property = (req->property == None) ? req->target : req->property;
+	return clipboard_xatom_index(atom) >= 0;
+}
 
-	if (!clipboard_text
-	    || (req->time != CurrentTime && req->time < xselection_owned_since)
-	    || req->owner != xwin || !is_known_clipboard_xatom(req->selection)) {
-		property = None;
-	} else if (req->target == targets_atom) {
-		/* Tell the requesting client what selection formats we support */
-		XChangeProperty(xdisp, req->requestor, property, XA_ATOM, 32,
-		                PropModeReplace, (unsigned char*)supported_targets,
-		                ARR_LEN(supported_targets));
-	} else if (req->target == XA_STRING) {
-		/* Send the requested data back to the requesting window */
-		XChangeProperty(xdisp, req->requestor, property, req->target, 8,
-		                PropModeReplace, (unsigned char*)clipboard_text,
-		                strlen(clipboard_text));
-	} else {
-		property = None;
-	}
+/*
+ * Between trap_xerrors() and untrap_xerrors(), X errors (e.g. from a client
+ * window we're writing to vanishing underneath us) are recorded instead of
+ * being fatal; untrap_xerrors() returns the first one seen (or zero).
+ */
+static int trapped_xerr;
+static int (*pretrap_errhandler)(Display*, XErrorEvent*);
 
-	/* Acknowledge that the transfer has been made (or failed) */
-	if (!send_selection_notify(req, property))
-		errlog("Failed to send SelectionNotify to requestor\n");
+static int xerr_trap(Display* d, XErrorEvent* xev)
+{
+	if (!trapped_xerr)
+		trapped_xerr = xev->error_code;
+	return 0;
 }
 
-static void handle_keyevent(XKeyEvent* kev, pressrel_t pr)
+static void trap_xerrors(void)
 {
-	KeySym sym;
-	keycode_t kc;
+	XSync(xdisp, False);
+	trapped_xerr = 0;
+	pretrap_errhandler = XSetErrorHandler(xerr_trap);
+}
 
-	sym = XLookupKeysym(kev, 0);
-	kc = keysym_to_keycode(sym);
+static int untrap_xerrors(void)
+{
+	XSync(xdisp, False);
+	XSetErrorHandler(pretrap_errhandler);
+	return trapped_xerr;
+}
 
-	if (kc == ET_null) {
-		warn("No mapping for keysym %lu (%s)\n", sym, XKeysymToString(sym));
-		return;
-	}
+/*
+ * Largest amount of selection data we'll put in a single property (beyond
+ * which we switch to INCR), derived from the server's maximum request size
+ * with some slack for the rest of the ChangeProperty request.
+ */
+static size_t selection_chunk_size(void)
+{
+	return XMaxRequestSize(xdisp) * 4 - 64;
+}
 
-	if (!is_remote(focused_node)) {
-		vinfo("keyevent (%s %s, modmask=%#x) with no focused remote\n",
-		      XKeysymToString(sym), pr == PR_PRESS ? "pressed" : "released",
-		      kev->state);
-		return;
-	}
+/* Give up on an INCR transfer that hasn't progressed for this long */
+#define INCR_SEND_TIMEOUT_US (10 * 1000 * 1000)
 
-	send_keyevent(focused_node->remote, kc, pr);
+static void free_incr_send(struct incr_send* is)
+{
+	explicit_bzero(is->data, is->len);
+	xfree(is->data);
+	xfree(is);
 }
 
-static inline void update_last_mousepos(XMotionEvent* mev)
+/*
+ * Unlink and free the given INCR transfer (or, if NULL, any that have
+ * stalled, e.g. because the requestor went away), optionally also
+ * unselecting PropertyNotify events on its requestor window.
+ */
+static void reap_incr_sends(struct incr_send* target)
 {
-	last_seen_mousepos = (struct xypoint){ .x = mev->x_root, .y = mev->y_root, };
+	struct incr_send** p;
+	struct incr_send* is;
+	uint64_t now = get_microtime();
+
+	for (p = &incr_sends; *p;) {
+		is = *p;
+		if (is == target
+		    || (!target && now - is->last_progress > INCR_SEND_TIMEOUT_US)) {
+			if (!target)
+				warn("abandoning stalled INCR selection transfer\n");
+			trap_xerrors();
+			XSelectInput(xdisp, is->requestor, NoEventMask);
+			untrap_xerrors();
+			*p = is->next;
+			free_incr_send(is);
+		} else {
+			p = &is->next;
+		}
+	}
 }
 
-static void handle_grabbed_mousemove(XMotionEvent* mev)
+/*
+ * Begin an INCR transfer of our selection in response to the given request,
+ * writing the INCR property to the requestor's window.  Returns zero on
+ * success, non-zero on failure.
+ */
+static int start_incr_send(const XSelectionRequestEvent* req, Atom property)
 {
-	if (mev->x_root == screen_center.x
-	    && mev->y_root == screen_center.y)
-		return;
+	struct incr_send* is;
+	long len = strlen(clipboard_text);
 
-	send_moverel(focused_node->remote, mev->x_root - last_seen_mousepos.x,
-	             mev->y_root - last_seen_mousepos.y);
+	reap_incr_sends(NULL);
 
-	if (abs(mev->x_root - screen_center.x) > 1
-	    || abs(mev->y_root - screen_center.y) > 1) {
-		set_mousepos(screen_center);
-		last_seen_mousepos = screen_center;
-	} else {
-		update_last_mousepos(mev);
+	trap_xerrors();
+	XSelectInput(xdisp, req->requestor, PropertyChangeMask);
+	XChangeProperty(xdisp, req->requestor, property, incr_atom, 32,
+	                PropModeReplace, (unsigned char*)&len, 1);
+	if (untrap_xerrors()) {
+		warn("failed to initiate INCR selection transfer\n");
+		return -1;
 	}
-}
 
-static void handle_local_mousemove(XMotionEvent* mev)
-{
-	/* Only trigger edge events when no mouse buttons are held */
-	if (mousepos_handler && !(mev->state & MouseButtonMask))
-		mousepos_handler((struct xypoint){ .x = mev->x_root, .y = mev->y_root, });
+	is = xmalloc(sizeof(*is));
+	is->requestor = req->requestor;
+	is->property = property;
+	is->target = req->target;
+	is->data = xstrdup(clipboard_text);
+	is->len = len;
+	is->sent = 0;
+	is->last_progress = get_microtime();
+	is->next = incr_sends;
+	incr_sends = is;
 
-	update_last_mousepos(mev);
+	return 0;
 }
 
-static void handle_rawmotion(XIRawEvent* rev)
+/*
+ * Continue an INCR transfer after the requestor has deleted the property
+ * (having read the previous chunk): write the next chunk, or a zero-length
+ * one to terminate the transfer if all the data's been sent.
+ */
+static void continue_incr_send(struct incr_send* is)
+{
+	size_t n = is->len - is->sent;
+
+	if (n > selection_chunk_size())
+		n = selection_chunk_size();
+
+	trap_xerrors();
+	XChangeProperty(xdisp, is->requestor, is->property, is->target, 8,
+	                PropModeReplace, (unsigned char*)is->data + is->sent, n);
+	if (untrap_xerrors()) {
+		warn("INCR selection transfer failed\n");
+		reap_incr_sends(is);
+		return;
+	}
+
+	is->sent += n;
+	is->last_progress = get_microtime();
+
+	if (!n)
+		reap_incr_sends(is);
+}
+
+static struct incr_send* find_incr_send(Window requestor, Atom property)
+{
+	struct incr_send* is;
+
+	for (is = incr_sends; is; is = is->next) {
+		if (is->requestor == requestor && is->property == property)
+			return is;
+	}
+
+	return NULL;
+}
+
+/* Append data to the selection-retrieval buffer, growing it as needed. */
+static void selfetch_append(const unsigned char* data, size_t len)
+{
+	char* newbuf;
+	size_t newsize;
+
+	/* Always leave room for a NUL terminator */
+	if (selfetch.len + len + 1 > selfetch.size) {
+		newsize = selfetch.size ? selfetch.size : 4096;
+		while (newsize < selfetch.len + len + 1)
+			newsize *= 2;
+		/* Not just xrealloc(), so the old copy can be wiped */
+		newbuf = xmalloc(newsize);
+		if (selfetch.buf) {
+			memcpy(newbuf, selfetch.buf, selfetch.len);
+			explicit_bzero(selfetch.buf, selfetch.len);
+			xfree(selfetch.buf);
+		}
+		selfetch.buf = newbuf;
+		selfetch.size = newsize;
+	}
+
+	memcpy(selfetch.buf + selfetch.len, data, len);
+	selfetch.len += len;
+}
+
+/*
+ * Finish a selection retrieval, successfully (with the data received so
+ * far) or otherwise (with empty text), passing the result on to everyone
+ * waiting for it.
+ */
+static void finish_selection_fetch(int ok)
+{
+	struct selection_waiter* waiters = selfetch.waiters;
+	struct selection_waiter* w;
+	char* text;
+
+	if (!ok && selfetch.buf) {
+		explicit_bzero(selfetch.buf, selfetch.len);
+		selfetch.len = 0;
+	}
+
+	if (!selfetch.buf)
+		selfetch_append((const unsigned char*)"", 0);
+	selfetch.buf[selfetch.len] = '\0';
+	text = selfetch.buf;
+
+	if (selfetch.timer) {
+		cancel_call(selfetch.timer);
+		selfetch.timer = NULL;
+	}
+
+	/*
+	 * Reset everything before calling out, since a callback may well
+	 * start another retrieval.
+	 */
+	selfetch.buf = NULL;
+	selfetch.len = selfetch.size = 0;
+	selfetch.active = selfetch.incr = 0;
+	selfetch.waiters = NULL;
+	selfetch.waiters_tail = &selfetch.waiters;
+
+	if (!waiters) {
+		explicit_bzero(text, strlen(text));
+		xfree(text);
+		return;
+	}
+
+	while (waiters) {
+		w = waiters;
+		waiters = w->next;
+		w->cb(w->next ? xstrdup(text) : text, w->arg);
+		xfree(w);
+	}
+}
+
+/* How much of a selection property to read per XGetWindowProperty() call */
+#define SELPROP_READ_LONGS (1L << 16)
+
+/*
+ * Read (and delete) the entire contents of the selection-data property on
+ * our window, appending them to the retrieval buffer.  Returns the number of
+ * bytes read, or negative on error.
+ */
+static ssize_t read_selection_property(void)
+{
+	Atom proptype;
+	int propformat;
+	unsigned long nitems, bytes_remaining;
+	unsigned char* prop;
+	size_t total = 0;
+
+	do {
+		if (XGetWindowProperty(xdisp, xwin, et_selection_data,
+		                       total / 4, SELPROP_READ_LONGS, True,
+		                       AnyPropertyType, &proptype, &propformat,
+		                       &nitems, &bytes_remaining, &prop) != Success) {
+			warn("failed to read selection window property\n");
+			return -1;
+		}
+
+		if (proptype == None)
+			return total;
+
+		if (proptype != XA_STRING && proptype != utf8_string_atom)
+			warn("selection window property has unexpected type\n");
+		if (propformat != 8) {
+			warn("selection window property has unexpected format (%d)\n",
+			     propformat);
+			XFree(prop);
+			return -1;
+		}
+
+		selfetch_append(prop, nitems);
+		total += nitems;
+		XFree(prop);
+	} while (bytes_remaining);
+
+	return total;
+}
+
+/*
+ * The longest we'll wait for the selection owner to respond (to the initial
+ * request, or with each chunk of an INCR transfer) before giving up.
+ */
+#define SELECTION_TIMEOUT_US 100000
+
+static void selfetch_timeout_cb(void* arg)
+{
+	uint64_t idle = get_microtime() - selfetch.last_progress;
+
+	selfetch.timer = NULL;
+
+	if (idle >= SELECTION_TIMEOUT_US) {
+		errlog("timed out waiting for selection\n");
+		finish_selection_fetch(0);
+	} else {
+		selfetch.timer = schedule_call(selfetch_timeout_cb, NULL,
+		                               SELECTION_TIMEOUT_US - idle);
+	}
+}
+
+/* Request conversion of the selection into a property on our window. */
+static void start_selection_fetch(void)
+{
+	Atom selection_atom = clipboard_xatoms[0].atom;
+
+	if (selfetch.active)
+		return;
+
+	selfetch.active = 1;
+	selfetch.incr = 0;
+	selfetch.last_progress = get_microtime();
+	selfetch.timer = schedule_call(selfetch_timeout_cb, NULL,
+	                               SELECTION_TIMEOUT_US);
+
+	/* Make sure any stale property doesn't get mistaken for the reply */
+	XDeleteProperty(xdisp, xwin, et_selection_data);
+	XConvertSelection(xdisp, selection_atom, XA_STRING, et_selection_data,
+	                  xwin, last_xevent_time);
+	XFlush(xdisp);
+}
+
+static void handle_selection_notify(const XSelectionEvent* sev)
+{
+	Atom proptype;
+	int propformat;
+	unsigned long nitems, bytes_remaining;
+	unsigned char* prop;
+
+	if (!selfetch.active || selfetch.incr || sev->requestor != xwin) {
+		vinfo("unexpected SelectionNotify event\n");
+		return;
+	}
+
+	if (sev->property == None) {
+		finish_selection_fetch(1);
+		return;
+	}
+
+	if (sev->selection != clipboard_xatoms[0].atom)
+		warn("unexpected selection in SelectionNotify event\n");
+	if (sev->property != et_selection_data)
+		warn("unexpected property in SelectionNotify event\n");
+	if (sev->target != XA_STRING)
+		warn("unexpected target in SelectionNotify event\n");
+
+	/* Peek at the property type to see if we're getting it via INCR */
+	if (XGetWindowProperty(xdisp, xwin, et_selection_data, 0, 0, False,
+	                       AnyPropertyType, &proptype, &propformat, &nitems,
+	                       &bytes_remaining, &prop) == Success) {
+		XFree(prop);
+		if (proptype == incr_atom) {
+			/* Deleting the INCR property starts the transfer */
+			selfetch.incr = 1;
+			selfetch.last_progress = get_microtime();
+			XDeleteProperty(xdisp, xwin, et_selection_data);
+			XFlush(xdisp);
+			return;
+		}
+	}
+
+	finish_selection_fetch(read_selection_property() >= 0);
+}
+
+static void handle_property_notify(const XPropertyEvent* pev)
+{
+	struct incr_send* is;
+	ssize_t status;
+
+	if (pev->window == xwin) {
+		/* The next chunk of an INCR transfer to us has arrived */
+		if (!selfetch.incr || pev->atom != et_selection_data
+		    || pev->state != PropertyNewValue)
+			return;
+
+		status = read_selection_property();
+		selfetch.last_progress = get_microtime();
+
+		/* A zero-length chunk signals the end of the transfer */
+		if (status <= 0)
+			finish_selection_fetch(status == 0);
+		else
+			XFlush(xdisp);
+	} else if (pev->state == PropertyDelete) {
+		/* A requestor is ready for the next chunk of an INCR transfer */
+		is = find_incr_send(pev->window, pev->atom);
+		if (is)
+			continue_incr_send(is);
+	}
+}
+
+/* Abandon any selection transfers in progress in either direction. */
+static void selection_exit(void)
+{
+	struct selection_waiter* w;
+
+	while (incr_sends)
+		reap_incr_sends(incr_sends);
+
+	/* Nobody's going to be around to use the result */
+	while (selfetch.waiters) {
+		w = selfetch.waiters;
+		selfetch.waiters = w->next;
+		xfree(w);
+	}
+	selfetch.waiters_tail = &selfetch.waiters;
+
+	if (selfetch.active)
+		finish_selection_fetch(0);
+}
+
+/*
+ * Answer a request for our selection; 'held' indicates it was made during a
+ * hold_clipboard() (and hence while we owned the selection, even if it now
+ * predates our current ownership of it).
+ */
+static void answer_selection_request(const XSelectionRequestEvent* req, int held)
+{
+	Atom property;
+	Atom supported_targets[] = { targets_atom, XA_STRING,  };
+	int sel = clipboard_xatom_index(req->selection);
+
+	/*
+	 * ICCCM sec. 2.2:
+	 *
+	 * "If the specified property is None , the requestor is an obsolete
+	 *  client. Owners are encouraged to support these clients by using
+	 *  the specified target atom as the property name to be used for the
+	 *  reply."
+	 */
+	property = (req->property == None) ? req->target : req->property;
+
+	if (!clipboard_text || sel < 0 || !clipboard_xatoms[sel].owned_since
+	    || (!held && req->time != CurrentTime
+	        && req->time < clipboard_xatoms[sel].owned_since)
+	    || req->owner != xwin) {
+		property = None;
+	} else if (req->target == targets_atom) {
+		/* Tell the requesting client what selection formats we support */
+		XChangeProperty(xdisp, req->requestor, property, XA_ATOM, 32,
+		                PropModeReplace, (unsigned char*)supported_targets,
+		                ARR_LEN(supported_targets));
+	} else if (req->target == XA_STRING) {
+		/* Send the data back directly if it fits, or else via INCR */
+		if (strlen(clipboard_text) <= selection_chunk_size())
+			XChangeProperty(xdisp, req->requestor, property, req->target,
+			                8, PropModeReplace,
+			                (unsigned char*)clipboard_text,
+			                strlen(clipboard_text));
+		else if (start_incr_send(req, property))
+			property = None;
+	} else {
+		property = None;
+	}
+
+	/* Acknowledge that the transfer has been made (or failed) */
+	if (!send_selection_notify(req, property))
+		errlog("Failed to send SelectionNotify to requestor\n");
+}
+
+static void handle_selection_request(const XSelectionRequestEvent* req)
+{
+	struct held_selreq* h;
+
+	/* (Our own requests can't wait on ourselves.) */
+	if (!clipboard_hold.active || req->owner != xwin || req->requestor == xwin
+	    || !is_known_clipboard_xatom(req->selection)) {
+		answer_selection_request(req, 0);
+		return;
+	}
+
+	if (clipboard_hold.num >= CLIPBOARD_HOLD_MAX) {
+		vinfo("too many held selection requests, refusing\n");
+		if (!send_selection_notify(req, None))
+			errlog("Failed to send SelectionNotify to requestor\n");
+		return;
+	}
+
+	h = xmalloc(sizeof(*h));
+	h->req = *req;
+	h->next = NULL;
+	*clipboard_hold.tail = h;
+	clipboard_hold.tail = &h->next;
+	clipboard_hold.num += 1;
+}
+
+static void clipboard_hold_timeout_cb(void* arg)
+{
+	clipboard_hold.timer = NULL;
+	warn("timed out waiting for clipboard contents\n");
+	release_clipboard();
+}
+
+void hold_clipboard(void)
+{
+	int i;
+	Atom atom;
+
+	if (clipboard_hold.active) {
+		cancel_call(clipboard_hold.timer);
+	} else {
+		/* Requests have to come to us to be held */
+		for (i = 0; i < ARR_LEN(clipboard_xatoms); i++) {
+			if (clipboard_xatoms[i].owned_since)
+				continue;
+			atom = clipboard_xatoms[i].atom;
+			XSetSelectionOwner(xdisp, atom, xwin, last_xevent_time);
+			if (XGetSelectionOwner(xdisp, atom) != xwin) {
+				errlog("failed to take ownership of X selection\n");
+				return;
+			}
+			clipboard_xatoms[i].owned_since = last_xevent_time;
+		}
+
+		clipboard_hold.active = 1;
+		clipboard_hold.reqs = NULL;
+		clipboard_hold.tail = &clipboard_hold.reqs;
+		clipboard_hold.num = 0;
+	}
+
+	clipboard_hold.timer = schedule_call(clipboard_hold_timeout_cb, NULL,
+	                                     CLIPBOARD_HOLD_TIMEOUT_US);
+}
+
+void release_clipboard(void)
+{
+	struct held_selreq* h;
+
+	if (!clipboard_hold.active)
+		return;
+
+	clipboard_hold.active = 0;
+	if (clipboard_hold.timer) {
+		cancel_call(clipboard_hold.timer);
+		clipboard_hold.timer = NULL;
+	}
+
+	while (clipboard_hold.reqs) {
+		h = clipboard_hold.reqs;
+		clipboard_hold.reqs = h->next;
+		answer_selection_request(&h->req, 1);
+		xfree(h);
+	}
+	clipboard_hold.tail = NULL;
+	clipboard_hold.num = 0;
+
+	XFlush(xdisp);
+}
+
+static void handle_keyevent(XKeyEvent* kev, pressrel_t pr)
+{
+	KeySym sym;
+	keycode_t kc;
+
+	sym = XLookupKeysym(kev, 0);
+	kc = keysym_to_keycode(sym);
+
+	if (kc == ET_null) {
+		warn("No mapping for keysym %lu (%s)\n", sym, XKeysymToString(sym));
+		return;
+	}
+
+	if (!is_remote(focused_node)) {
+		vinfo("keyevent (%s %s, modmask=%#x) with no focused remote\n",
+		      XKeysymToString(sym), pr == PR_PRESS ? "pressed" : "released",
+		      kev->state);
+		return;
+	}
+
+	forward_keyevent(kc, pr);
+}
+
+static inline void update_last_mousepos(XMotionEvent* mev)
+{
+	last_seen_mousepos = (struct xypoint){ .x = mev->x_root, .y = mev->y_root, };
+	ptrack_set(last_seen_mousepos);
+}
+
+static void handle_grabbed_mousemove(XMotionEvent* mev)
+{
+	if (mev->x_root == screen_center.x
+	    && mev->y_root == screen_center.y)
+		return;
+
+	send_moverel(focused_node->remote, mev->x_root - last_seen_mousepos.x,
+	             mev->y_root - last_seen_mousepos.y);
+
+	if (abs(mev->x_root - screen_center.x) > 1
+	    || abs(mev->y_root - screen_center.y) > 1) {
+		set_mousepos(screen_center);
+		last_seen_mousepos = screen_center;
+	} else {
+		update_last_mousepos(mev);
+	}
+}
+
+static void handle_local_mousemove(XMotionEvent* mev)
+{
+	/* Only trigger edge events when no mouse buttons are held */
+	if (mousepos_handler && !(mev->state & MouseButtonMask))
+		mousepos_handler((struct xypoint){ .x = mev->x_root, .y = mev->y_root, });
+
+	update_last_mousepos(mev);
+}
+
+static void handle_rawmotion(XIRawEvent* rev)
 {
 	unsigned int mask;
 	struct xypoint pt;
 
+	ptrack_rawmotion(rev);
+
 	if (mousepos_handler) {
 		/*
 		 * It's kind of sad that we're querying the server to retrieve
-		 * the mouse position every time we receive a motion event,
-		 * but every other approach I've tried has problems.  See the
-		 * lengthy comment in xi2_init() for details.
+		 * the mouse position for motion events, but every other
+		 * approach I've tried has problems.  See the lengthy comment
+		 * in xi2_init() for details.  The handler only cares about
+		 * screen edges though, so as long as the pointer is (and was)
+		 * well away from all of them we can skip it.
 		 *
 		 * FIXME: should also avoid calling the handler if some other
 		 * client has a keyboard or pointer grab -- unfortunately, I
 		 * don't see a simple way of determining whether or not that's
 		 * the case short of just trying to grab them...
 		 */
-		pt = get_mousepos_and_mask(&mask);
+		if (!ptrack.near_edge && ptrack_trusted())
+			return;
+
+		pt = query_mousepos(&mask);
+		ptrack.near_edge = near_screen_edge(pt);
 		if (!mask)
 			mousepos_handler(pt);
 	}
 }
 
+/*
+ * The selection we read has changed hands (or its owner has gone away), so
+ * its contents may well have changed -- unless it's us taking it over, in
+ * which case it holds what we were given to put there.
+ */
+static void handle_xfixes_selection_notify(const XFixesSelectionNotifyEvent* sev)
+{
+	if (sev->subtype == XFixesSetSelectionOwnerNotify && sev->owner == xwin)
+		return;
+
+	clipboard_lost_cb();
+}
+
 static void handle_event(XEvent* ev)
 {
+	int sel;
+
+	if (clipboard_lost_cb && ev->type == xfixes.evbase + XFixesSelectionNotify) {
+		handle_xfixes_selection_notify((XFixesSelectionNotifyEvent*)ev);
+		return;
+	}
 
 	switch (ev->type) {
 	case MotionNotify:
@@ -1052,14 +1970,21 @@ static void handle_event(XEvent* ev)
 		break;
 
 	case SelectionClear:
-		if (ev->xselectionclear.window == xwin
-		    && is_known_clipboard_xatom(ev->xselectionclear.selection)) {
-			clear_clipboard_cache();
+		sel = clipboard_xatom_index(ev->xselectionclear.selection);
+		if (ev->xselectionclear.window == xwin && sel >= 0) {
+			/* The other one (if still ours) keeps serving the text */
+			clipboard_xatoms[sel].owned_since = 0;
+			if (!owns_any_selection())
+				clear_clipboard_cache();
 		}
 		break;
 
 	case SelectionNotify:
-		vinfo("unexpected SelectionNotify event\n");
+		handle_selection_notify(&ev->xselection);
+		break;
+
+	case PropertyNotify:
+		handle_property_notify(&ev->xproperty);
 		break;
 
 	case GenericEvent:
@@ -1068,14 +1993,23 @@ static void handle_event(XEvent* ev)
 		else if (!XGetEventData(xdisp, &ev->xcookie))
 			vinfo("XGetEventData() failed on xi2 GenericEvent\n");
 		else {
-			if (ev->xcookie.evtype != XI_RawMotion)
-				vinfo("unexpected xi2 evtype: %d\n", ev->xcookie.evtype);
-			else
+			if (ev->xcookie.evtype == XI_RawMotion)
 				handle_rawmotion(ev->xcookie.data);
+			else if (ev->xcookie.evtype == XI_HierarchyChanged)
+				memset(ptrack.devmode, 0, sizeof(ptrack.devmode));
+			else
+				vinfo("unexpected xi2 evtype: %d\n", ev->xcookie.evtype);
 			XFreeEventData(xdisp, &ev->xcookie);
 		}
 		break;
 
+	case MappingNotify:
+		if (ev->xmapping.request == MappingPointer)
+			break;
+		XRefreshKeyboardMapping(&ev->xmapping);
+		refresh_keymap();
+		break;
+
 	case MapNotify:
 	case UnmapNotify:
 	case DestroyNotify:
@@ -1101,352 +2035,178 @@ static void process_events(void)
 	}
 }
 
-/* The longest we'll wait for a SelectionNotify event before giving up */
-#define SELECTION_TIMEOUT_US 100000
+static void xfd_read_cb(struct fdmon_ctx* ctx, void* arg)
+{
+	process_events();
+}
 
-char* get_clipboard_text(void)
+/*
+ * Xlib may already have read (and queued up) events from the X connection in
+ * the course of handling other requests, in which case the file descriptor
+ * won't poll as readable; handle any such events before the event loop
+ * blocks.
+ *
+ * This is also where requests get flushed out to the server: injected
+ * input events, warps and the like are left in Xlib's output buffer as
+ * they're issued, so that everything done in handling one lot of messages
+ * (or X events, timers, etc.) goes out in a single write rather than one
+ * per event.
+ */
+static void x11_prepoll(void)
 {
-	XEvent ev;
-	Atom selection_atom = clipboard_xatoms[0].atom;
-	Atom proptype;
-	int propformat;
-	unsigned long nitems, bytes_remaining;
-	unsigned char* prop;
-	char* text;
-	uint64_t before;
+	if (XEventsQueued(xdisp, QueuedAlready))
+		process_events();
+
+	XFlush(xdisp);
+}
+
+void get_clipboard_text_async(clipboard_text_cb_t cb, void* arg)
+{
+	struct selection_waiter* w;
 
 	/*
 	 * If we (think we) own the selection, just go ahead and use it
 	 * without going through all the X crap.
 	 */
-	if (xselection_owned_since != 0 && clipboard_text)
-		return xstrdup(clipboard_text);
-
-	/* FIXME: delete et_selection_data from xwin before requestion conversion */
-	XConvertSelection(xdisp, selection_atom, XA_STRING, et_selection_data,
-	                  xwin, last_xevent_time);
-	XFlush(xdisp);
-
-	before = get_microtime();
-
-	while (get_microtime() - before < SELECTION_TIMEOUT_US) {
-		get_xevent(&ev);
-		if (ev.type != SelectionNotify) {
-			handle_event(&ev);
-			continue;
-		}
-
-		if (ev.xselection.property == None)
-			return xstrdup("");
-
-		if (ev.xselection.selection != selection_atom)
-			warn("unexpected selection in SelectionNotify event\n");
-		if (ev.xselection.property != et_selection_data)
-			warn("unexpected property in SelectionNotify event\n");
-		if (ev.xselection.requestor != xwin)
-			warn("unexpected requestor in SelectionNotify event\n");
-		if (ev.xselection.target != XA_STRING)
-			warn("unexpected target in SelectionNotify event\n");
-
-		XGetWindowProperty(ev.xselection.display, ev.xselection.requestor,
-		                   ev.xselection.property, 0, (1L << 24), True,
-		                   AnyPropertyType, &proptype, &propformat, &nitems,
-		                   &bytes_remaining, &prop);
-
-		if (proptype != XA_STRING && proptype != utf8_string_atom)
-			warn("selection window property has unexpected type\n");
-		if (bytes_remaining)
-			warn("%lu bytes remaining of selection window property\n",
-			     bytes_remaining);
-		if (propformat != 8) {
-			warn("selection window property has unexpected format (%d)\n",
-			     propformat);
-			return xstrdup("");
-		}
+	if (clipboard_xatoms[0].owned_since && clipboard_text) {
+		cb(xstrdup(clipboard_text), arg);
+		return;
+	}
 
-		text = xmalloc(nitems + 1);
-		memcpy(text, prop, nitems);
-		text[nitems] = '\0';
+	w = xmalloc(sizeof(*w));
+	w->cb = cb;
+	w->arg = arg;
+	w->next = NULL;
 
-		XFree(prop);
-		return text;
-	}
+	if (!selfetch.waiters_tail)
+		selfetch.waiters_tail = &selfetch.waiters;
+	*selfetch.waiters_tail = w;
+	selfetch.waiters_tail = &w->next;
 
-	errlog("timed out waiting for selection\n");
-	return xstrdup("");
+	start_selection_fetch();
 }
 
-int set_clipboard_text(const char* text)
+int set_clipboard_text_owned(char* text)
 {
 	int i;
 	Atom atom;
 
 	clear_clipboard_cache();
-	clipboard_text = xstrdup(text);
+	clipboard_text = text;
 
 	for (i = 0; i < ARR_LEN(clipboard_xatoms); i++) {
 		atom = clipboard_xatoms[i].atom;
 		XSetSelectionOwner(xdisp, atom, xwin, last_xevent_time);
 		if (XGetSelectionOwner(xdisp, atom) != xwin) {
 			errlog("failed to take ownership of X selection\n");
+			release_clipboard();
 			return -1;
 		}
+		clipboard_xatoms[i].owned_since = last_xevent_time;
 	}
 
-	xselection_owned_since = last_xevent_time;
+	/* Whatever was waiting for these can have them now */
+	release_clipboard();
 
 	return 0;
 }
 
-static MAKE_GAMMA_SCALE_FN(gamma_scale, unsigned short, lrintf);
-
-static void scale_gamma(const XRRCrtcGamma* from, XRRCrtcGamma* to, float f)
-{
-	int i;
-
-	assert(from->size == to->size);
-
-	for (i = 0; i < to->size; i++) {
-		to->red[i] = gamma_scale(from->red, from->size, i, f);
-		to->green[i] = gamma_scale(from->green, from->size, i, f);
-		to->blue[i] = gamma_scale(from->blue, from->size, i, f);
-	}
-}
-
-void set_display_brightness(float f)
-{
-	int i;
-
-	for (i = 0; i < xrr.resources->ncrtc; i++) {
-		scale_gamma(xrr.crtc_gammas[i].orig, xrr.crtc_gammas[i].alt, f);
-		XRRSetCrtcGamma(xdisp, xrr.resources->crtcs[i], xrr.crtc_gammas[i].alt);
-	}
-	XFlush(xdisp);
-}
-
-timer_ctx_t schedule_call(void (*fn)(void* arg), void* arg, uint64_t delay)
+int set_clipboard_text(const char* text)
 {
-	struct scheduled_call* call;
-	struct scheduled_call** prevnext;
-	struct scheduled_call* newcall = xmalloc(sizeof(*newcall));
-
-	newcall->fn = fn;
-	newcall->arg = arg;
-	newcall->calltime = get_microtime() + delay;
-
-	for (prevnext = &scheduled_calls, call = *prevnext;
-	     call;
-	     prevnext = &call->next, call = call->next) {
-		if (newcall->calltime < call->calltime)
-			break;
-	}
-
-	newcall->next = call;
-	*prevnext = newcall;
-
-	return newcall;
+	return set_clipboard_text_owned(xstrdup(text));
 }
 
-int cancel_call(timer_ctx_t timer)
+/*
+ * Ownership changes are watched (via XFixes, without our having to own the
+ * selection) for the selection get_clipboard_text_async() reads, which is
+ * the one that matters to what the master thinks our clipboard holds.
+ */
+int watch_clipboard_ownership(clipboard_lost_handler_t* cb)
 {
-	struct scheduled_call* call;
-	struct scheduled_call** prevnext;
-	struct scheduled_call* target = timer;
+	int maj = 1, min = 0;
 
-	for (prevnext = &scheduled_calls, call = *prevnext;
-	     call;
-	     prevnext = &call->next, call = call->next) {
-		if (call == target) {
-			*prevnext = call->next;
-			xfree(call);
-			return 1;
-		}
+	if (!XFixesQueryExtension(xdisp, &xfixes.evbase, &xfixes.errbase)
+	    || !XFixesQueryVersion(xdisp, &maj, &min)) {
+		vinfo("XFixes extension unavailable, can't watch clipboard\n");
+		return 0;
 	}
 
-	return 0;
-}
-
-struct fdmon_ctx {
-	int fd;
-	fdmon_callback_t readcb, writecb;
-	void* arg;
-	uint32_t flags;
-	int refcount;
-
-	struct fdmon_ctx* next;
-	struct fdmon_ctx* prev;
-};
-
-static struct {
-	struct fdmon_ctx* head;
-	struct fdmon_ctx* tail;
-} monitored_fds = {
-	.head = NULL,
-	.tail = NULL,
-};
-
-struct fdmon_ctx* fdmon_register_fd(int fd, fdmon_callback_t readcb,
-                                    fdmon_callback_t writecb, void* arg)
-{
-	struct fdmon_ctx* ctx = xmalloc(sizeof(*ctx));
-
-	ctx->fd = fd;
-	ctx->readcb = readcb;
-	ctx->writecb = writecb;
-	ctx->arg = arg;
-	ctx->flags = 0;
-	ctx->refcount = 1;
-
-	ctx->next = monitored_fds.head;
-	if (ctx->next)
-		ctx->next->prev = ctx;
-	monitored_fds.head = ctx;
-
-	ctx->prev = NULL;
-
-	if (!monitored_fds.tail)
-		monitored_fds.tail = ctx;
+	XFixesSelectSelectionInput(xdisp, xwin, clipboard_xatoms[0].atom,
+	                           XFixesSetSelectionOwnerNotifyMask
+	                           | XFixesSelectionWindowDestroyNotifyMask
+	                           | XFixesSelectionClientCloseNotifyMask);
+	XFlush(xdisp);
 
-	return ctx;
+	clipboard_lost_cb = cb;
+	return 1;
 }
 
-static void fdmon_unref(struct fdmon_ctx* ctx)
-{
-	assert(ctx->refcount > 0);
-	ctx->refcount -= 1;
-
-	if (ctx->refcount)
-		return;
-
-	if (!ctx->prev)
-		monitored_fds.head = ctx->next;
-
-	if (!ctx->next)
-		monitored_fds.tail = ctx->prev;
-
-	if (ctx->next)
-		ctx->next->prev = ctx->prev;
-
-	if (ctx->prev)
-		ctx->prev->next = ctx->next;
-
-	xfree(ctx);
-}
+static MAKE_GAMMA_SCALE_FN(gamma_scale, unsigned short, lrintf);
 
-static void fdmon_ref(struct fdmon_ctx* ctx)
+static void scale_gamma(const XRRCrtcGamma* from, XRRCrtcGamma* to, float f)
 {
-	assert(ctx->refcount > 0);
-	ctx->refcount += 1;
-}
+	int i;
 
-void fdmon_unregister(struct fdmon_ctx* ctx)
-{
-	fdmon_unmonitor(ctx, FM_READ|FM_WRITE);
-	fdmon_unref(ctx);
-}
+	assert(from->size == to->size);
 
-void fdmon_monitor(struct fdmon_ctx* ctx, uint32_t flags)
-{
-	if (flags & ~(FM_READ|FM_WRITE)) {
-		errlog("invalid fdmon flags: %u\n", flags);
-		abort();
+	for (i = 0; i < to->size; i++) {
+		to->red[i] = gamma_scale(from->red, from->size, i, f);
+		to->green[i] = gamma_scale(from->green, from->size, i, f);
+		to->blue[i] = gamma_scale(from->blue, from->size, i, f);
 	}
-
-	ctx->flags |= flags;
 }
 
-void fdmon_unmonitor(struct fdmon_ctx* ctx, uint32_t flags)
+/*
+ * Return the given CRTC's gamma table scaled to the given brightness level,
+ * from the cache if it's there and otherwise computing it (in place of the
+ * least recently used one if the cache is full).
+ */
+static XRRCrtcGamma* get_scaled_gamma(struct crtc_gamma* cg, int level)
 {
-	if (flags & ~(FM_READ|FM_WRITE)) {
-		errlog("invalid fdmon flags: %u\n", flags);
-		abort();
-	}
-
-	ctx->flags &= ~flags;
-}
+	struct scaled_gamma* victim = &cg->cache[0];
+	struct scaled_gamma* sg;
+	int i;
 
-static void run_scheduled_calls(uint64_t when)
-{
-	struct scheduled_call* call;
+	if (level == BRIGHTNESS_STEPS)
+		return cg->orig;
 
-	while (scheduled_calls && scheduled_calls->calltime <= when) {
-		call = scheduled_calls;
-		scheduled_calls = call->next;
-		call->fn(call->arg);
-		xfree(call);
+	for (i = 0; i < GAMMA_CACHE_SLOTS; i++) {
+		sg = &cg->cache[i];
+		if (sg->ramp && sg->level == level) {
+			sg->lastuse = ++gamma_cache_clock;
+			return sg->ramp;
+		}
+		if (!sg->ramp || (victim->ramp && sg->lastuse < victim->lastuse))
+			victim = sg;
 	}
-}
 
-static struct timeval* get_select_timeout(struct timeval* tv, uint64_t now_us)
-{
-	uint64_t maxwait_us;
+	if (!victim->ramp)
+		victim->ramp = XRRAllocGamma(cg->orig->size);
+	scale_gamma(cg->orig, victim->ramp, (float)level / BRIGHTNESS_STEPS);
+	victim->level = level;
+	victim->lastuse = ++gamma_cache_clock;
 
-	if (scheduled_calls) {
-		maxwait_us = scheduled_calls->calltime - now_us;
-		tv->tv_sec = maxwait_us / 1000000;
-		tv->tv_usec = maxwait_us % 1000000;
-		return tv;
-	} else {
-		return NULL;
-	}
+	return victim->ramp;
 }
 
-static void handle_fds(void)
+void set_display_brightness(float f)
 {
-	int status, nfds = 0;
-	fd_set rfds, wfds;
-	struct timeval sel_wait;
-	uint64_t now_us;
-	struct fdmon_ctx* mfd;
-	struct fdmon_ctx* next_mfd;
-	int xfd = xdisp ? XConnectionNumber(xdisp) : -1;
-
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-
-	now_us = get_microtime();
-
-	run_scheduled_calls(now_us);
-
-	if (xfd >= 0)
-		fdset_add(xfd, &rfds, &nfds);
-
-	for (mfd = monitored_fds.head; mfd; mfd = mfd->next) {
-		if (mfd->flags & FM_READ)
-			fdset_add(mfd->fd, &rfds, &nfds);
-		if (mfd->flags & FM_WRITE)
-			fdset_add(mfd->fd, &wfds, &nfds);
-	}
-
-	status = select(nfds, &rfds, &wfds, NULL, get_select_timeout(&sel_wait, now_us));
-	if (status < 0 && errno != EINTR) {
-		perror("select");
-		exit(1);
-	}
-
-	for (mfd = monitored_fds.head; mfd; mfd = next_mfd) {
-		/*
-		 * Callbacks could unregister mfd, so we ref/unref it around
-		 * the body of this loop
-		 */
-		fdmon_ref(mfd);
+	int i, level = quantize_brightness(f);
+	struct crtc_gamma* cg;
+	int changed = 0;
 
-		if ((mfd->flags & FM_READ) && FD_ISSET(mfd->fd, &rfds))
-			mfd->readcb(mfd, mfd->arg);
+	for (i = 0; i < xrr.resources->ncrtc; i++) {
+		cg = &xrr.crtc_gammas[i];
 
-		if ((mfd->flags & FM_WRITE) && FD_ISSET(mfd->fd, &wfds))
-			mfd->writecb(mfd, mfd->arg);
+		/* Skip CRTCs already at that level (or with nothing to scale) */
+		if (cg->level == level || !cg->orig->size)
+			continue;
 
-		next_mfd = mfd->next;
-		fdmon_unref(mfd);
+		XRRSetCrtcGamma(xdisp, xrr.resources->crtcs[i], get_scaled_gamma(cg, level));
+		cg->level = level;
+		changed = 1;
 	}
 
-	if (xfd >= 0 && FD_ISSET(xfd, &rfds))
-		process_events();
-}
-
-void run_event_loop(void)
-{
-	for (;;)
-		handle_fds();
+	if (changed)
+		XFlush(xdisp);
 }